@@ -4,14 +4,27 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstdlib>
+#include <exception>
+#include <iterator>
+#include <limits>
 #include <memory>
 #include <optional>
 #include <sstream>
 
 namespace ASTImpl {
 
+    // Evaluation does not throw. An operation that divides by zero or leaves
+    // the finite range yields NaN, which then absorbs every later operation,
+    // so a NaN result means #DIV/0 without any branch on the error path.
+    inline double Checked(double result) {
+        return std::isfinite(result) ? result : std::numeric_limits<double>::quiet_NaN();
+    }
+
     enum ExprPrecedence {
         EP_ADD,
         EP_SUB,
@@ -71,15 +84,34 @@ namespace ASTImpl {
     public:
         virtual ~Expr() = default;
         virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
+        // Cell references are printed moved by offset.
+        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const = 0;
 
         
-        virtual double Evaluate([[maybe_unused]] const std::unordered_map<Position, double, PositionHasher>& values_to_cells) const = 0;
+        virtual double Evaluate(const double* cell_values, const Aggregate* range_values) const = 0;
+
+        // Folds the value of the subtree into the aggregate of the call it is
+        // an argument of.
+        virtual void Accumulate(Aggregate& aggregate, const double* cell_values, const Aggregate* range_values) const {
+            aggregate.Add(Evaluate(cell_values, range_values));
+        }
+
+        // appends the postfix code of the subtree and binds cell references
+        // to their slots in program.cells
+        virtual void Compile(FormulaAST::Program& program) = 0;
+
+        // appends the nodes of the subtree in prefix order
+        virtual void Flatten(std::vector<FormulaAST::Node>& nodes) const = 0;
 
         // higher is tighter
         virtual ExprPrecedence GetPrecedence() const = 0;
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+        // A range has no value of its own and may only be passed to a call.
+        virtual bool IsRange() const {
+            return false;
+        }
+
+        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, Position offset,
             bool right_child = false) const {
             auto precedence = GetPrecedence();
             auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -88,7 +120,7 @@ namespace ASTImpl {
                 out << '(';
             }
 
-            DoPrintFormula(out, precedence);
+            DoPrintFormula(out, precedence, offset);
 
             if (parens_needed) {
                 out << ')';
@@ -97,6 +129,22 @@ namespace ASTImpl {
     };
 
     namespace {
+        void PrintCell(std::ostream& out, Position cell) {
+            if (!cell.IsValid()) {
+                out << FormulaError::Category::Ref;
+            }
+            else {
+                char name[Position::MAX_POSITION_LENGTH];
+                out.write(name, cell.ToChars(name) - name);
+            }
+        }
+
+        Position Shift(Position cell, Position offset) {
+            return { cell.row + offset.row, cell.col + offset.col };
+        }
+
+        const char* const RANGE_OUTSIDE_CALL = "Range outside of a function call";
+
         class BinaryOpExpr final : public Expr {
         public:
             enum Type : char {
@@ -107,7 +155,7 @@ namespace ASTImpl {
             };
 
         public:
-            explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+            explicit BinaryOpExpr(Type type, ArenaPtr<Expr> lhs, ArenaPtr<Expr> rhs)
                 : type_(type)
                 , lhs_(std::move(lhs))
                 , rhs_(std::move(rhs)) {
@@ -121,10 +169,10 @@ namespace ASTImpl {
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const override {
+                lhs_->PrintFormula(out, precedence, offset);
                 out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+                rhs_->PrintFormula(out, precedence, offset, /* right_child = */ true);
             }
 
             ExprPrecedence GetPrecedence() const override {
@@ -144,36 +192,69 @@ namespace ASTImpl {
                 }
             }
 
-            double Evaluate(const std::unordered_map<Position, double, PositionHasher>& values_to_cells) const override {
-                double result = 0.0;
-
-                if (type_ == Type::Add) {
-                    result = lhs_->Evaluate(values_to_cells) + rhs_->Evaluate(values_to_cells);
-                }
-                else if (type_ == Type::Subtract) {
-                    result = lhs_->Evaluate(values_to_cells) - rhs_->Evaluate(values_to_cells);
-                }
-                else if (type_ == Type::Multiply) {
-                    result =  lhs_->Evaluate(values_to_cells) * rhs_->Evaluate(values_to_cells);
+            double Evaluate(const double* cell_values, const Aggregate* range_values) const override {
+                double lhs = lhs_->Evaluate(cell_values, range_values);
+                double rhs = rhs_->Evaluate(cell_values, range_values);
+                switch (type_) {
+                case Add:
+                    return Checked(lhs + rhs);
+                case Subtract:
+                    return Checked(lhs - rhs);
+                case Multiply:
+                    return Checked(lhs * rhs);
+                default:
+                    return Checked(lhs / rhs);
                 }
-                else {
-                    double rhs_result = rhs_->Evaluate(values_to_cells);
-                    if (rhs_result == 0) {
-                        throw FormulaError(FormulaError::Category::Div0);
-                    }
-                    result = lhs_->Evaluate(values_to_cells) / rhs_result;
+            }
+
+            void Compile(FormulaAST::Program& program) override {
+                using OpCode = FormulaAST::Instruction::OpCode;
+
+                lhs_->Compile(program);
+                rhs_->Compile(program);
+                switch (type_) {
+                case Add:
+                    program.code.push_back({ OpCode::Add });
+                    break;
+                case Subtract:
+                    program.code.push_back({ OpCode::Subtract });
+                    break;
+                case Multiply:
+                    program.code.push_back({ OpCode::Multiply });
+                    break;
+                case Divide:
+                    program.code.push_back({ OpCode::Divide });
+                    break;
                 }
-                 
-                if (!std::isfinite(result)) {
-                    throw FormulaError(FormulaError::Category::Div0);
+            }
+
+            void Flatten(std::vector<FormulaAST::Node>& nodes) const override {
+                using Kind = FormulaAST::Node::Kind;
+
+                FormulaAST::Node node;
+                switch (type_) {
+                case Add:
+                    node.kind = Kind::Add;
+                    break;
+                case Subtract:
+                    node.kind = Kind::Subtract;
+                    break;
+                case Multiply:
+                    node.kind = Kind::Multiply;
+                    break;
+                case Divide:
+                    node.kind = Kind::Divide;
+                    break;
                 }
-                return result;
+                nodes.push_back(node);
+                lhs_->Flatten(nodes);
+                rhs_->Flatten(nodes);
             }
 
         private:
             Type type_;
-            std::unique_ptr<Expr> lhs_;
-            std::unique_ptr<Expr> rhs_;
+            ArenaPtr<Expr> lhs_;
+            ArenaPtr<Expr> rhs_;
         };
 
         class UnaryOpExpr final : public Expr {
@@ -184,7 +265,7 @@ namespace ASTImpl {
             };
 
         public:
-            explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+            explicit UnaryOpExpr(Type type, ArenaPtr<Expr> operand)
                 : type_(type)
                 , operand_(std::move(operand)) {
             }
@@ -195,26 +276,41 @@ namespace ASTImpl {
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const override {
                 out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
+                operand_->PrintFormula(out, precedence, offset);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_UNARY;
             }
 
-            double Evaluate(const std::unordered_map<Position, double, PositionHasher>& values_to_cells) const override {
+            double Evaluate(const double* cell_values, const Aggregate* range_values) const override {
                 if (type_ == Type::UnaryPlus) {
-                    return operand_->Evaluate(values_to_cells);
+                    return operand_->Evaluate(cell_values, range_values);
                 }
 
-                return operand_->Evaluate(values_to_cells) * -1;
+                return operand_->Evaluate(cell_values, range_values) * -1;
+            }
+
+            void Compile(FormulaAST::Program& program) override {
+                operand_->Compile(program);
+                if (type_ == Type::UnaryMinus) {
+                    program.code.push_back({ FormulaAST::Instruction::OpCode::Negate });
+                }
+            }
+
+            void Flatten(std::vector<FormulaAST::Node>& nodes) const override {
+                FormulaAST::Node node;
+                node.kind = type_ == Type::UnaryMinus ? FormulaAST::Node::Kind::UnaryMinus
+                                                      : FormulaAST::Node::Kind::UnaryPlus;
+                nodes.push_back(node);
+                operand_->Flatten(nodes);
             }
 
         private:
             Type type_;
-            std::unique_ptr<Expr> operand_;
+            ArenaPtr<Expr> operand_;
         };
 
         class CellExpr final : public Expr {
@@ -224,30 +320,182 @@ namespace ASTImpl {
             }
 
             void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
-                    out << FormulaError::Category::Ref;
-                }
-                else {
-                    out << cell_->ToString();
-                }
+                PrintCell(out, *cell_);
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+                PrintCell(out, Shift(*cell_, offset));
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_ATOM;
             }
 
-            double Evaluate(const std::unordered_map<Position, double, PositionHasher>& values_to_cells) const override {
-                return values_to_cells.at(*cell_);
+            double Evaluate(const double* cell_values, [[maybe_unused]] const Aggregate* range_values) const override {
+                return cell_values[slot_];
+            }
+
+            void Compile(FormulaAST::Program& program) override {
+                auto slot = std::lower_bound(program.cells.begin(), program.cells.end(), *cell_);
+                assert(slot != program.cells.end() && *slot == *cell_);
+                slot_ = static_cast<std::uint32_t>(slot - program.cells.begin());
+                program.code.push_back({ FormulaAST::Instruction::OpCode::LoadCell, slot_ });
+            }
+
+            void Flatten(std::vector<FormulaAST::Node>& nodes) const override {
+                FormulaAST::Node node;
+                node.kind = FormulaAST::Node::Kind::Cell;
+                node.range.from = *cell_;
+                nodes.push_back(node);
             }
 
         private:
             const Position* cell_;
+            std::uint32_t slot_ = 0;
         };
 
+        class RangeExpr final : public Expr {
+        public:
+            explicit RangeExpr(Range range)
+                : range_(range) {
+            }
+
+            void Print(std::ostream& out) const override {
+                DoPrintFormula(out, EP_ATOM, { 0, 0 });
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position offset) const override {
+                PrintCell(out, Shift(range_.from, offset));
+                out << ':';
+                PrintCell(out, Shift(range_.to, offset));
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            bool IsRange() const override {
+                return true;
+            }
+
+            double Evaluate([[maybe_unused]] const double* cell_values,
+                [[maybe_unused]] const Aggregate* range_values) const override {
+                assert(false);
+                return std::numeric_limits<double>::quiet_NaN();
+            }
+
+            void Accumulate(Aggregate& aggregate, [[maybe_unused]] const double* cell_values,
+                const Aggregate* range_values) const override {
+                aggregate.Merge(range_values[slot_]);
+            }
+
+            void Compile(FormulaAST::Program& program) override {
+                slot_ = static_cast<std::uint32_t>(program.ranges.size());
+                program.ranges.push_back(range_);
+            }
+
+            void Flatten(std::vector<FormulaAST::Node>& nodes) const override {
+                FormulaAST::Node node;
+                node.kind = FormulaAST::Node::Kind::Range;
+                node.range = range_;
+                nodes.push_back(node);
+            }
+
+        private:
+            Range range_;
+            std::uint32_t slot_ = 0;
+        };
+
+        class CallExpr final : public Expr {
+        public:
+            CallExpr(AggregateFunction function, std::pmr::vector<ArenaPtr<Expr>> arguments)
+                : function_(function)
+                , arguments_(std::move(arguments)) {
+            }
+
+            void Print(std::ostream& out) const override {
+                out << '(' << GetAggregateFunctionName(function_);
+                for (const auto& argument : arguments_) {
+                    out << ' ';
+                    argument->Print(out);
+                }
+                out << ')';
+            }
+
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, Position offset) const override {
+                out << GetAggregateFunctionName(function_) << '(';
+                bool first = true;
+                for (const auto& argument : arguments_) {
+                    if (!first) {
+                        out << ',';
+                    }
+                    first = false;
+                    argument->PrintFormula(out, precedence, offset);
+                }
+                out << ')';
+            }
+
+            ExprPrecedence GetPrecedence() const override {
+                return EP_ATOM;
+            }
+
+            // Ranges are folded in before the other arguments, in the order
+            // the compiled program uses.
+            double Evaluate(const double* cell_values, const Aggregate* range_values) const override {
+                Aggregate aggregate(function_);
+                for (const auto& argument : arguments_) {
+                    if (argument->IsRange()) {
+                        argument->Accumulate(aggregate, cell_values, range_values);
+                    }
+                }
+                for (const auto& argument : arguments_) {
+                    if (!argument->IsRange()) {
+                        argument->Accumulate(aggregate, cell_values, range_values);
+                    }
+                }
+                return Checked(aggregate.GetResult());
+            }
+
+            void Compile(FormulaAST::Program& program) override {
+                FormulaAST::Call call{ function_, static_cast<std::uint32_t>(program.ranges.size()) };
+                for (const auto& argument : arguments_) {
+                    if (argument->IsRange()) {
+                        argument->Compile(program);
+                        ++call.range_count;
+                    }
+                }
+                for (const auto& argument : arguments_) {
+                    if (!argument->IsRange()) {
+                        argument->Compile(program);
+                        ++call.argument_count;
+                    }
+                }
+                program.code.push_back({ FormulaAST::Instruction::OpCode::Call,
+                    static_cast<std::uint32_t>(program.calls.size()) });
+                program.calls.push_back(call);
+            }
+
+            void Flatten(std::vector<FormulaAST::Node>& nodes) const override {
+                FormulaAST::Node node;
+                node.kind = FormulaAST::Node::Kind::Call;
+                node.function = function_;
+                node.argument_count = static_cast<std::uint32_t>(arguments_.size());
+                nodes.push_back(node);
+                for (const auto& argument : arguments_) {
+                    argument->Flatten(nodes);
+                }
+            }
+
+        private:
+            AggregateFunction function_;
+            std::pmr::vector<ArenaPtr<Expr>> arguments_;
+        };
+
+        Range MakeRange(Position from, Position to) {
+            return { { std::min(from.row, to.row), std::min(from.col, to.col) },
+                { std::max(from.row, to.row), std::max(from.col, to.col) } };
+        }
+
         class NumberExpr final : public Expr {
         public:
             explicit NumberExpr(double value)
@@ -258,7 +506,7 @@ namespace ASTImpl {
                 out << value_;
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, Position /* offset */) const override {
                 out << value_;
             }
 
@@ -266,25 +514,46 @@ namespace ASTImpl {
                 return EP_ATOM;
             }
 
-            double Evaluate([[maybe_unused]] const std::unordered_map<Position, double, PositionHasher>& values_to_cells) const override {
+            double Evaluate([[maybe_unused]] const double* cell_values,
+                [[maybe_unused]] const Aggregate* range_values) const override {
                 return value_;
             }
 
+            void Compile(FormulaAST::Program& program) override {
+                program.code.push_back({ FormulaAST::Instruction::OpCode::PushNumber,
+                    static_cast<std::uint32_t>(program.numbers.size()) });
+                program.numbers.push_back(value_);
+            }
+
+            void Flatten(std::vector<FormulaAST::Node>& nodes) const override {
+                FormulaAST::Node node;
+                node.number = value_;
+                nodes.push_back(node);
+            }
+
         private:
             double value_;
         };
 
         class ParseASTListener final : public FormulaBaseListener {
         public:
-            std::unique_ptr<Expr> MoveRoot() {
+            explicit ParseASTListener(std::pmr::memory_resource* resource)
+                : resource_(resource)
+                , cells_(resource) {
+            }
+
+            ArenaPtr<Expr> MoveRoot() {
                 assert(args_.size() == 1);
                 auto root = std::move(args_.front());
                 args_.clear();
+                if (root->IsRange()) {
+                    throw ParsingError(RANGE_OUTSIDE_CALL);
+                }
 
                 return root;
             }
 
-            std::forward_list<Position> MoveCells() {
+            std::pmr::forward_list<Position> MoveCells() {
                 return std::move(cells_);
             }
 
@@ -293,6 +562,9 @@ namespace ASTImpl {
                 assert(args_.size() >= 1);
 
                 auto operand = std::move(args_.back());
+                if (operand->IsRange()) {
+                    throw ParsingError(RANGE_OUTSIDE_CALL);
+                }
 
                 UnaryOpExpr::Type type;
                 if (ctx->SUB()) {
@@ -303,7 +575,7 @@ namespace ASTImpl {
                     type = UnaryOpExpr::UnaryPlus;
                 }
 
-                auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
+                auto node = MakeArenaPtr<UnaryOpExpr>(resource_, type, std::move(operand));
                 args_.back() = std::move(node);
             }
 
@@ -316,7 +588,7 @@ namespace ASTImpl {
                     throw ParsingError("Invalid number: " + valueStr);
                 }
 
-                auto node = std::make_unique<NumberExpr>(value);
+                auto node = MakeArenaPtr<NumberExpr>(resource_, value);
                 args_.push_back(std::move(node));
             }
 
@@ -328,7 +600,7 @@ namespace ASTImpl {
                 }
 
                 cells_.push_front(value);
-                auto node = std::make_unique<CellExpr>(&cells_.front());
+                auto node = MakeArenaPtr<CellExpr>(resource_, &cells_.front());
                 args_.push_back(std::move(node));
             }
 
@@ -339,6 +611,9 @@ namespace ASTImpl {
                 args_.pop_back();
 
                 auto lhs = std::move(args_.back());
+                if (lhs->IsRange() || rhs->IsRange()) {
+                    throw ParsingError(RANGE_OUTSIDE_CALL);
+                }
 
                 BinaryOpExpr::Type type;
                 if (ctx->ADD()) {
@@ -355,17 +630,53 @@ namespace ASTImpl {
                     type = BinaryOpExpr::Divide;
                 }
 
-                auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
+                auto node = MakeArenaPtr<BinaryOpExpr>(resource_, type, std::move(lhs), std::move(rhs));
                 args_.back() = std::move(node);
             }
 
+            void exitRange(FormulaParser::RangeContext* ctx) override {
+                auto from = ParsePosition(ctx->CELL(0)->getSymbol()->getText());
+                auto to = ParsePosition(ctx->CELL(1)->getSymbol()->getText());
+                auto node = MakeArenaPtr<RangeExpr>(resource_, MakeRange(from, to));
+                args_.push_back(std::move(node));
+            }
+
+            void exitCall(FormulaParser::CallContext* ctx) override {
+                const size_t argument_count = ctx->expr().size();
+                assert(args_.size() >= argument_count);
+
+                auto name = ctx->NAME()->getSymbol()->getText();
+                auto function = FindAggregateFunction(name);
+                if (!function) {
+                    throw ParsingError("Unknown function: " + name);
+                }
+
+                std::pmr::vector<ArenaPtr<Expr>> arguments(resource_);
+                arguments.reserve(argument_count);
+                auto first_argument = args_.end() - argument_count;
+                std::move(first_argument, args_.end(), std::back_inserter(arguments));
+                args_.erase(first_argument, args_.end());
+
+                auto node = MakeArenaPtr<CallExpr>(resource_, *function, std::move(arguments));
+                args_.push_back(std::move(node));
+            }
+
             void visitErrorNode(antlr4::tree::ErrorNode* node) override {
                 throw ParsingError("Error when parsing: " + node->getSymbol()->getText());
             }
 
         private:
-            std::vector<std::unique_ptr<Expr>> args_;
-            std::forward_list<Position> cells_;
+            std::pmr::memory_resource* resource_;
+            std::vector<ArenaPtr<Expr>> args_;
+            std::pmr::forward_list<Position> cells_;
+
+            static Position ParsePosition(const std::string& value_str) {
+                auto value = Position::FromString(value_str);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + value_str);
+                }
+                return value;
+            }
         };
 
         class BailErrorListener : public antlr4::BaseErrorListener {
@@ -378,10 +689,396 @@ namespace ASTImpl {
             }
         };
 
+        // Recursive descent over the characters of the formula, accepting the
+        // language of Formula.g4 and building the same tree as
+        // ParseASTListener. Binary operators are parsed by precedence
+        // climbing: both levels are left-associative and a unary operator
+        // applies to the atom or unary expression that follows it only, as in
+        // the ANTLR grammar where -A1*2 means (-A1)*2. Errors the listener
+        // finds on the tree are deferred to the end and reported in the order
+        // it visits the nodes, children first.
+        class PrattParser final {
+        public:
+            PrattParser(std::string_view input, std::pmr::memory_resource* resource)
+                : input_(input)
+                , resource_(resource)
+                , cells_(resource) {
+            }
+
+            ArenaPtr<Expr> ParseMain() {
+                auto root = ParseBinary(ADDITIVE_PRECEDENCE);
+                CheckOperand(*root);
+                SkipSpaces();
+                if (pos_ != input_.size()) {
+                    Fail("extraneous input");
+                }
+                if (deferred_error_) {
+                    std::rethrow_exception(deferred_error_);
+                }
+                return root;
+            }
+
+            std::pmr::forward_list<Position> MoveCells() {
+                return std::move(cells_);
+            }
+
+        private:
+            static const int ADDITIVE_PRECEDENCE = 1;
+            static const int MULTIPLICATIVE_PRECEDENCE = 2;
+
+            std::string_view input_;
+            size_t pos_ = 0;
+            std::pmr::memory_resource* resource_;
+            std::pmr::forward_list<Position> cells_;
+            // Invalid numbers and positions are reported only once the whole
+            // formula is known to be well-formed, as the tree listener does.
+            std::exception_ptr deferred_error_;
+
+            template <class Error>
+            void Defer(Error error) {
+                if (!deferred_error_) {
+                    deferred_error_ = std::make_exception_ptr(std::move(error));
+                }
+            }
+
+            void CheckOperand(const Expr& operand) {
+                if (operand.IsRange()) {
+                    Defer(ParsingError(RANGE_OUTSIDE_CALL));
+                }
+            }
+
+            [[noreturn]] void Fail(const char* what) const {
+                throw ParsingError(std::string("Error when parsing: ") + what + " at position " + std::to_string(pos_));
+            }
+
+            void SkipSpaces() {
+                while (pos_ < input_.size()) {
+                    char ch = input_[pos_];
+                    if (ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r') {
+                        break;
+                    }
+                    ++pos_;
+                }
+            }
+
+            char Peek() {
+                SkipSpaces();
+                return pos_ < input_.size() ? input_[pos_] : '\0';
+            }
+
+            static bool IsDigit(char ch) {
+                return ch >= '0' && ch <= '9';
+            }
+
+            static bool IsUpper(char ch) {
+                return ch >= 'A' && ch <= 'Z';
+            }
+
+            size_t SkipDigits(size_t pos) const {
+                while (pos < input_.size() && IsDigit(input_[pos])) {
+                    ++pos;
+                }
+                return pos;
+            }
+
+            static int GetPrecedence(char op) {
+                switch (op) {
+                case '+':
+                case '-':
+                    return ADDITIVE_PRECEDENCE;
+                case '*':
+                case '/':
+                    return MULTIPLICATIVE_PRECEDENCE;
+                default:
+                    return 0;
+                }
+            }
+
+            ArenaPtr<Expr> ParseBinary(int min_precedence) {
+                auto lhs = ParseUnary();
+                for (;;) {
+                    char op = Peek();
+                    int precedence = GetPrecedence(op);
+                    if (precedence == 0 || precedence < min_precedence) {
+                        return lhs;
+                    }
+                    ++pos_;
+                    auto rhs = ParseBinary(precedence + 1);
+                    CheckOperand(*lhs);
+                    CheckOperand(*rhs);
+                    lhs = MakeArenaPtr<BinaryOpExpr>(resource_, static_cast<BinaryOpExpr::Type>(op),
+                        std::move(lhs), std::move(rhs));
+                }
+            }
+
+            ArenaPtr<Expr> ParseUnary() {
+                char ch = Peek();
+                if (ch == '+' || ch == '-') {
+                    ++pos_;
+                    auto operand = ParseUnary();
+                    CheckOperand(*operand);
+                    return MakeArenaPtr<UnaryOpExpr>(resource_, static_cast<UnaryOpExpr::Type>(ch),
+                        std::move(operand));
+                }
+                if (ch == '(') {
+                    ++pos_;
+                    auto expr = ParseBinary(ADDITIVE_PRECEDENCE);
+                    if (Peek() != ')') {
+                        Fail("missing ')'");
+                    }
+                    ++pos_;
+                    return expr;
+                }
+                if (IsDigit(ch) || ch == '.') {
+                    return ParseNumber();
+                }
+                if (IsUpper(ch)) {
+                    return ParseReference();
+                }
+                Fail(pos_ == input_.size() ? "unexpected end of formula" : "unexpected character");
+            }
+
+            // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+            ArenaPtr<Expr> ParseNumber() {
+                size_t begin = pos_;
+                size_t end = SkipDigits(pos_);
+                if (end < input_.size() && input_[end] == '.' && end + 1 < input_.size() && IsDigit(input_[end + 1])) {
+                    end = SkipDigits(end + 1);
+                }
+                if (end == begin) {
+                    Fail("unexpected character");
+                }
+                if (end < input_.size() && (input_[end] == 'e' || input_[end] == 'E')) {
+                    size_t exponent = end + 1;
+                    if (exponent < input_.size() && (input_[exponent] == '+' || input_[exponent] == '-')) {
+                        ++exponent;
+                    }
+                    if (exponent < input_.size() && IsDigit(input_[exponent])) {
+                        end = SkipDigits(exponent);
+                    }
+                }
+                pos_ = end;
+
+                std::string_view token = input_.substr(begin, end - begin);
+                double value = 0;
+                auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+                if (ec == std::errc::result_out_of_range) {
+                    // tiny values round to zero as with stream extraction,
+                    // huge ones are rejected
+                    value = std::strtod(std::string(token).c_str(), nullptr);
+                    if (std::isinf(value)) {
+                        Defer(ParsingError("Invalid number: " + std::string(token)));
+                    }
+                }
+                else if (ec != std::errc() || ptr != token.data() + token.size()) {
+                    Defer(ParsingError("Invalid number: " + std::string(token)));
+                }
+                return MakeArenaPtr<NumberExpr>(resource_, value);
+            }
+
+            // Scans [A-Z]+[0-9]*: a CELL when there are digits, a NAME otherwise.
+            std::string_view ScanWord() {
+                size_t begin = pos_;
+                while (pos_ < input_.size() && IsUpper(input_[pos_])) {
+                    ++pos_;
+                }
+                pos_ = SkipDigits(pos_);
+                return input_.substr(begin, pos_ - begin);
+            }
+
+            static bool IsCell(std::string_view word) {
+                return IsDigit(word.back());
+            }
+
+            Position ParsePosition(std::string_view value_str) {
+                auto value = Position::FromString(value_str);
+                if (!value.IsValid()) {
+                    Defer(FormulaException("Invalid position: " + std::string(value_str)));
+                }
+                return value;
+            }
+
+            // CELL | CELL ':' CELL | NAME '(' expr (',' expr)* ')'
+            ArenaPtr<Expr> ParseReference() {
+                std::string_view word = ScanWord();
+                if (!IsCell(word)) {
+                    return ParseCall(word);
+                }
+
+                auto from = ParsePosition(word);
+                if (Peek() != ':') {
+                    cells_.push_front(from);
+                    return MakeArenaPtr<CellExpr>(resource_, &cells_.front());
+                }
+                ++pos_;
+                if (!IsUpper(Peek())) {
+                    Fail("unexpected character");
+                }
+                word = ScanWord();
+                if (!IsCell(word)) {
+                    Fail("unexpected character");
+                }
+                auto to = ParsePosition(word);
+                return MakeArenaPtr<RangeExpr>(resource_, MakeRange(from, to));
+            }
+
+            ArenaPtr<Expr> ParseCall(std::string_view name) {
+                if (Peek() != '(') {
+                    Fail("unexpected name");
+                }
+                ++pos_;
+                if (Peek() == ')') {
+                    Fail("missing argument");
+                }
+                std::pmr::vector<ArenaPtr<Expr>> arguments(resource_);
+                for (;;) {
+                    arguments.push_back(ParseBinary(ADDITIVE_PRECEDENCE));
+                    if (Peek() != ',') {
+                        break;
+                    }
+                    ++pos_;
+                }
+                if (Peek() != ')') {
+                    Fail("missing ')'");
+                }
+                ++pos_;
+
+                auto function = FindAggregateFunction(name);
+                if (!function) {
+                    Defer(ParsingError("Unknown function: " + std::string(name)));
+                    function = AggregateFunction::Sum;
+                }
+                return MakeArenaPtr<CallExpr>(resource_, *function, std::move(arguments));
+            }
+        };
+
+
+        // Rebuilds a tree from its nodes in prefix order. The nodes are
+        // checked as strictly as the parser checks a text.
+        class TreeBuilder final {
+        public:
+            TreeBuilder(const FormulaAST::Node* nodes, size_t count, std::pmr::memory_resource* resource)
+                : nodes_(nodes)
+                , count_(count)
+                , resource_(resource)
+                , cells_(resource) {
+            }
+
+            ArenaPtr<Expr> BuildMain() {
+                auto root = BuildOperand();
+                if (next_ != count_) {
+                    Fail("extraneous nodes");
+                }
+                return root;
+            }
+
+            std::pmr::forward_list<Position> MoveCells() {
+                return std::move(cells_);
+            }
+
+        private:
+            const FormulaAST::Node* nodes_;
+            size_t count_;
+            size_t next_ = 0;
+            std::pmr::memory_resource* resource_;
+            std::pmr::forward_list<Position> cells_;
+
+            [[noreturn]] void Fail(const char* what) const {
+                throw ParsingError(std::string("Malformed formula tree: ") + what + " at node " + std::to_string(next_));
+            }
+
+            ArenaPtr<Expr> BuildOperand() {
+                auto operand = Build();
+                if (operand->IsRange()) {
+                    Fail(RANGE_OUTSIDE_CALL);
+                }
+                return operand;
+            }
+
+            ArenaPtr<Expr> Build() {
+                using Kind = FormulaAST::Node::Kind;
+
+                if (next_ == count_) {
+                    Fail("missing nodes");
+                }
+                const FormulaAST::Node& node = nodes_[next_++];
+                switch (node.kind) {
+                case Kind::Number:
+                    if (!std::isfinite(node.number)) {
+                        Fail("invalid number");
+                    }
+                    return MakeArenaPtr<NumberExpr>(resource_, node.number);
+                case Kind::Cell:
+                    if (!node.range.from.IsValid()) {
+                        Fail("invalid position");
+                    }
+                    cells_.push_front(node.range.from);
+                    return MakeArenaPtr<CellExpr>(resource_, &cells_.front());
+                case Kind::Range:
+                    if (!node.range.IsValid()) {
+                        Fail("invalid range");
+                    }
+                    return MakeArenaPtr<RangeExpr>(resource_, node.range);
+                case Kind::UnaryPlus:
+                case Kind::UnaryMinus: {
+                    auto type = node.kind == Kind::UnaryMinus ? UnaryOpExpr::UnaryMinus : UnaryOpExpr::UnaryPlus;
+                    return MakeArenaPtr<UnaryOpExpr>(resource_, type, BuildOperand());
+                }
+                case Kind::Add:
+                case Kind::Subtract:
+                case Kind::Multiply:
+                case Kind::Divide: {
+                    auto lhs = BuildOperand();
+                    auto rhs = BuildOperand();
+                    return MakeArenaPtr<BinaryOpExpr>(resource_, GetBinaryType(node.kind), std::move(lhs),
+                        std::move(rhs));
+                }
+                case Kind::Call: {
+                    if (node.argument_count == 0) {
+                        Fail("missing argument");
+                    }
+                    if (node.function > AggregateFunction::Count) {
+                        Fail("unknown function");
+                    }
+                    std::pmr::vector<ArenaPtr<Expr>> arguments(resource_);
+                    for (std::uint32_t i = 0; i < node.argument_count; ++i) {
+                        arguments.push_back(Build());
+                    }
+                    return MakeArenaPtr<CallExpr>(resource_, node.function, std::move(arguments));
+                }
+                }
+                Fail("unknown node");
+            }
+
+            static BinaryOpExpr::Type GetBinaryType(FormulaAST::Node::Kind kind) {
+                switch (kind) {
+                case FormulaAST::Node::Kind::Add:
+                    return BinaryOpExpr::Add;
+                case FormulaAST::Node::Kind::Subtract:
+                    return BinaryOpExpr::Subtract;
+                case FormulaAST::Node::Kind::Multiply:
+                    return BinaryOpExpr::Multiply;
+                default:
+                    return BinaryOpExpr::Divide;
+                }
+            }
+        };
+
     }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+FormulaAST ParseFormulaAST(std::string_view in, std::pmr::memory_resource* resource) {
+    ASTImpl::PrattParser parser(in, resource);
+    auto root = parser.ParseMain();
+    return FormulaAST(std::move(root), parser.MoveCells());
+}
+
+FormulaAST ParseFormulaAST(std::istream& in, std::pmr::memory_resource* resource) {
+    std::string input(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(std::string_view(input), resource);
+}
+
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in, std::pmr::memory_resource* resource) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -399,15 +1096,25 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     parser.removeErrorListeners();
 
     tree::ParseTree* tree = parser.main();
-    ASTImpl::ParseASTListener listener;
+    ASTImpl::ParseASTListener listener(resource);
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
     return FormulaAST(listener.MoveRoot(), listener.MoveCells());
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
-    std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+FormulaAST ParseFormulaASTWithAntlr(std::string_view in_str, std::pmr::memory_resource* resource) {
+    std::istringstream in{ std::string(in_str) };
+    return ParseFormulaASTWithAntlr(in, resource);
+}
+
+FormulaAST MakeFormulaAST(const FormulaAST::Node* nodes, size_t count, std::pmr::memory_resource* resource) {
+    ASTImpl::TreeBuilder builder(nodes, count, resource);
+    auto root = builder.BuildMain();
+    return FormulaAST(std::move(root), builder.MoveCells());
+}
+
+void FormulaAST::Flatten(std::vector<Node>& nodes) const {
+    root_expr_->Flatten(nodes);
 }
 
 void FormulaAST::PrintCells(std::ostream& out) const {
@@ -420,18 +1127,303 @@ void FormulaAST::Print(std::ostream& out) const {
     root_expr_->Print(out);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position offset) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, offset);
+}
+
+namespace {
+    FormulaAST::Value ToValue(double result) {
+        if (std::isnan(result)) {
+            return FormulaError(FormulaError::Category::Div0);
+        }
+        return result;
+    }
+
+    // small programs keep their stack in the frame of Execute
+    const size_t INLINE_STACK_SIZE = 32;
+
+    // A value computed by a contiguous piece of the optimized code.
+    struct Operand {
+        size_t begin;
+        std::optional<double> constant;
+        // false when the value is known not to be -0, which x + 0 would
+        // turn into +0
+        bool may_be_negative_zero = true;
+    };
+
+    bool IsNegativeZero(double value) {
+        return value == 0 && std::signbit(value);
+    }
+
+    // Rewrites the program into an equivalent one, bit for bit, including
+    // NaN for errors and the sign of zero. Constant operations are folded
+    // with the same Checked arithmetic Execute applies; x*1, x/1, x-0 and
+    // x+0 (unless x may be -0) are dropped; x*-1 and x/-1 become negations;
+    // a negation of a negation cancels out and x+-y becomes x-y. Operands
+    // that are not constant are always finite or NaN, so leaving out the
+    // Checked of an identity changes nothing.
+    void Optimize(FormulaAST::Program& program) {
+        using ASTImpl::Checked;
+        using Instruction = FormulaAST::Instruction;
+        using OpCode = Instruction::OpCode;
+
+        std::vector<Instruction> code;
+        std::vector<Operand> operands;
+        auto push_constant = [&](size_t begin, double value) {
+            code.resize(begin);
+            code.push_back({ OpCode::PushNumber, static_cast<std::uint32_t>(program.numbers.size()) });
+            program.numbers.push_back(value);
+            operands.push_back({ begin, value, IsNegativeZero(value) });
+        };
+        auto negate = [&](Operand operand) {
+            if (operand.constant) {
+                push_constant(operand.begin, -*operand.constant);
+            }
+            else if (code.back().code == OpCode::Negate) {
+                code.pop_back();
+                operands.push_back({ operand.begin, std::nullopt, true });
+            }
+            else {
+                code.push_back({ OpCode::Negate });
+                operands.push_back({ operand.begin, std::nullopt, true });
+            }
+        };
+        auto keep_lhs = [&](const Operand& lhs, const Operand& rhs) {
+            code.resize(rhs.begin);
+            operands.push_back(lhs);
+        };
+        auto keep_rhs = [&](const Operand& lhs, const Operand& rhs) {
+            code.erase(code.begin() + lhs.begin, code.begin() + rhs.begin);
+            operands.push_back({ lhs.begin, rhs.constant, rhs.may_be_negative_zero });
+        };
+
+        for (const auto& instruction : program.code) {
+            switch (instruction.code) {
+            case OpCode::PushNumber:
+                push_constant(code.size(), program.numbers[instruction.argument]);
+                continue;
+            case OpCode::LoadCell:
+                operands.push_back({ code.size(), std::nullopt, true });
+                code.push_back(instruction);
+                continue;
+            case OpCode::Negate: {
+                Operand operand = operands.back();
+                operands.pop_back();
+                negate(operand);
+                continue;
+            }
+            case OpCode::Call: {
+                // the result starts where the first argument does
+                const size_t argument_count = program.calls[instruction.argument].argument_count;
+                const size_t begin = argument_count > 0 ? operands[operands.size() - argument_count].begin : code.size();
+                operands.resize(operands.size() - argument_count);
+                operands.push_back({ begin, std::nullopt, true });
+                code.push_back(instruction);
+                continue;
+            }
+            default:
+                break;
+            }
+
+            Operand rhs = operands.back();
+            operands.pop_back();
+            Operand lhs = operands.back();
+            operands.pop_back();
+            if (lhs.constant && rhs.constant) {
+                double value = 0;
+                switch (instruction.code) {
+                case OpCode::Add:
+                    value = Checked(*lhs.constant + *rhs.constant);
+                    break;
+                case OpCode::Subtract:
+                    value = Checked(*lhs.constant - *rhs.constant);
+                    break;
+                case OpCode::Multiply:
+                    value = Checked(*lhs.constant * *rhs.constant);
+                    break;
+                default:
+                    value = Checked(*lhs.constant / *rhs.constant);
+                    break;
+                }
+                push_constant(lhs.begin, value);
+                continue;
+            }
+
+            auto is = [](const Operand& operand, double value) {
+                return operand.constant && *operand.constant == value;
+            };
+            switch (instruction.code) {
+            case OpCode::Add:
+            case OpCode::Subtract: {
+                const bool subtract = instruction.code == OpCode::Subtract;
+                // x - 0 and x + -0 are x; x + 0 and x - -0 are x unless x is -0
+                if (is(rhs, 0) && (IsNegativeZero(*rhs.constant) != subtract || !lhs.may_be_negative_zero)) {
+                    keep_lhs(lhs, rhs);
+                    continue;
+                }
+                if (!subtract && is(lhs, 0) && (IsNegativeZero(*lhs.constant) || !rhs.may_be_negative_zero)) {
+                    keep_rhs(lhs, rhs);
+                    continue;
+                }
+                OpCode op = instruction.code;
+                if (!rhs.constant && code.back().code == OpCode::Negate) {
+                    code.pop_back();
+                    op = subtract ? OpCode::Add : OpCode::Subtract;
+                }
+                // a sum is -0 only when both terms are, a difference only
+                // when its left side is
+                const bool may_be_negative_zero = op == OpCode::Add
+                    ? lhs.may_be_negative_zero && rhs.may_be_negative_zero
+                    : lhs.may_be_negative_zero;
+                code.push_back({ op });
+                operands.push_back({ lhs.begin, std::nullopt, may_be_negative_zero });
+                continue;
+            }
+            case OpCode::Multiply:
+                if (is(rhs, 1)) {
+                    keep_lhs(lhs, rhs);
+                    continue;
+                }
+                if (is(lhs, 1)) {
+                    keep_rhs(lhs, rhs);
+                    continue;
+                }
+                if (is(rhs, -1)) {
+                    code.resize(rhs.begin);
+                    negate(lhs);
+                    continue;
+                }
+                if (is(lhs, -1)) {
+                    code.erase(code.begin() + lhs.begin, code.begin() + rhs.begin);
+                    negate({ lhs.begin, std::nullopt, rhs.may_be_negative_zero });
+                    continue;
+                }
+                break;
+            default:
+                if (is(rhs, 1)) {
+                    keep_lhs(lhs, rhs);
+                    continue;
+                }
+                if (is(rhs, -1)) {
+                    code.resize(rhs.begin);
+                    negate(lhs);
+                    continue;
+                }
+                break;
+            }
+            code.push_back(instruction);
+            operands.push_back({ lhs.begin, std::nullopt, true });
+        }
+
+        // Folding leaves numbers no instruction reads.
+        std::pmr::vector<double> numbers(program.numbers.get_allocator());
+        for (auto& instruction : code) {
+            if (instruction.code == OpCode::PushNumber) {
+                double value = program.numbers[instruction.argument];
+                instruction.argument = static_cast<std::uint32_t>(numbers.size());
+                numbers.push_back(value);
+            }
+        }
+        program.numbers = std::move(numbers);
+        program.code.assign(code.begin(), code.end());
+    }
+}
+
+FormulaAST::Value FormulaAST::Execute(const double* cell_values, const Aggregate* range_values) const {
+    using ASTImpl::Checked;
+    using OpCode = Instruction::OpCode;
+
+    double inline_stack[INLINE_STACK_SIZE];
+    std::vector<double> heap_stack;
+    double* stack = inline_stack;
+    if (program_.max_stack_depth > INLINE_STACK_SIZE) {
+        heap_stack.resize(program_.max_stack_depth);
+        stack = heap_stack.data();
+    }
+
+    // top points past the last value on the stack
+    double* top = stack;
+    for (const auto& instruction : program_.code) {
+        switch (instruction.code) {
+        case OpCode::PushNumber:
+            *top++ = program_.numbers[instruction.argument];
+            break;
+        case OpCode::LoadCell:
+            *top++ = cell_values[instruction.argument];
+            break;
+        case OpCode::Add:
+            --top;
+            top[-1] = Checked(top[-1] + top[0]);
+            break;
+        case OpCode::Subtract:
+            --top;
+            top[-1] = Checked(top[-1] - top[0]);
+            break;
+        case OpCode::Multiply:
+            --top;
+            top[-1] = Checked(top[-1] * top[0]);
+            break;
+        case OpCode::Divide:
+            --top;
+            top[-1] = Checked(top[-1] / top[0]);
+            break;
+        case OpCode::Negate:
+            top[-1] = -top[-1];
+            break;
+        case OpCode::Call: {
+            const Call& call = program_.calls[instruction.argument];
+            Aggregate aggregate(call.function);
+            for (std::uint32_t i = 0; i < call.range_count; ++i) {
+                aggregate.Merge(range_values[call.first_range + i]);
+            }
+            top -= call.argument_count;
+            for (std::uint32_t i = 0; i < call.argument_count; ++i) {
+                aggregate.Add(top[i]);
+            }
+            *top++ = Checked(aggregate.GetResult());
+            break;
+        }
+        }
+    }
+    assert(top == stack + 1);
+    return ToValue(stack[0]);
 }
 
-double FormulaAST::Execute(const std::unordered_map<Position, double, PositionHasher>& values_to_cells) const {
-    return root_expr_->Evaluate(values_to_cells);
+FormulaAST::Value FormulaAST::ExecuteTree(const double* cell_values, const Aggregate* range_values) const {
+    return ToValue(root_expr_->Evaluate(cell_values, range_values));
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
+FormulaAST::FormulaAST(ArenaPtr<ASTImpl::Expr> root_expr, std::pmr::forward_list<Position> cells)
     : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
+    , cells_(std::move(cells))
+    , program_(cells_.get_allocator().resource()) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+
+    program_.cells.assign(cells_.begin(), cells_.end());
+    program_.cells.erase(std::unique(program_.cells.begin(), program_.cells.end()), program_.cells.end());
+    root_expr_->Compile(program_);
+    Optimize(program_);
+
+    size_t depth = 0;
+    for (const auto& instruction : program_.code) {
+        switch (instruction.code) {
+        case Instruction::OpCode::PushNumber:
+        case Instruction::OpCode::LoadCell:
+            program_.max_stack_depth = std::max(program_.max_stack_depth, ++depth);
+            break;
+        case Instruction::OpCode::Negate:
+            break;
+        case Instruction::OpCode::Call:
+            depth -= program_.calls[instruction.argument].argument_count;
+            program_.max_stack_depth = std::max(program_.max_stack_depth, ++depth);
+            break;
+        default:
+            --depth;
+            break;
+        }
+    }
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
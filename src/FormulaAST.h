@@ -1,11 +1,18 @@
 #pragma once
 
 #include "FormulaLexer.h"
+#include "aggregate.h"
+#include "arena.h"
 #include "common.h"
 
+#include <cstdint>
 #include <forward_list>
 #include <functional>
+#include <memory_resource>
 #include <stdexcept>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
     class Expr;
@@ -17,35 +24,146 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-        std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    // One step of the compiled formula: a postfix program run on a value stack.
+    struct Instruction {
+        enum class OpCode : std::uint8_t {
+            PushNumber,  // pushes numbers[argument]
+            LoadCell,    // pushes the value of cells[argument]
+            Add,
+            Subtract,
+            Multiply,
+            Divide,
+            Negate,
+            // pops the plain arguments of calls[argument], pushes its result
+            Call,
+        };
+
+        OpCode code;
+        std::uint32_t argument = 0;
+    };
+
+    // A call of an aggregate function. Its ranges are aggregated before the
+    // program runs; the other arguments are evaluated onto the stack.
+    struct Call {
+        AggregateFunction function;
+        std::uint32_t first_range = 0;
+        std::uint32_t range_count = 0;
+        std::uint32_t argument_count = 0;
+    };
+
+    struct Program {
+        explicit Program(std::pmr::memory_resource* resource)
+            : code(resource), numbers(resource), cells(resource), ranges(resource), calls(resource) {
+        }
+
+        std::pmr::vector<Instruction> code;
+        std::pmr::vector<double> numbers;
+        // referenced cells without repetitions, sorted
+        std::pmr::vector<Position> cells;
+        // ranges passed to calls, the ranges of each call next to each other
+        std::pmr::vector<Range> ranges;
+        std::pmr::vector<Call> calls;
+        size_t max_stack_depth = 0;
+    };
+
+    // A node of the tree in a fixed-size form. A tree is stored as its nodes
+    // in prefix order, every operator or call followed by its operands, and
+    // rebuilt from them by MakeFormulaAST without going through its text.
+    struct Node {
+        enum class Kind : std::uint8_t {
+            Number,
+            Cell,
+            Range,
+            UnaryPlus,
+            UnaryMinus,
+            Add,
+            Subtract,
+            Multiply,
+            Divide,
+            Call,
+        };
+
+        Kind kind = Kind::Number;
+        AggregateFunction function = AggregateFunction::Sum;
+        // Spells out the padding so that no indeterminate bytes are written.
+        std::uint16_t reserved = 0;
+        // operands of a call
+        std::uint32_t argument_count = 0;
+        double number = 0;
+        // a single cell is range.from
+        Range range;
+    };
+    static_assert(sizeof(Node) == 32, "a changed layout needs a new SNAPSHOT_VERSION");
+
+    // The program is allocated from the same resource as the cells.
+    explicit FormulaAST(ArenaPtr<ASTImpl::Expr> root_expr,
+        std::pmr::forward_list<Position> cells);
+    FormulaAST(FormulaAST&&);
+    // Cell nodes of the tree point into cells_, which a move assignment
+    // between different resources would copy element by element.
+    FormulaAST& operator=(FormulaAST&&) = delete;
     ~FormulaAST();
 
-    
-    double Execute(const std::unordered_map<Position, double, PositionHasher>&) const;
+    using Value = std::variant<double, FormulaError>;
+
+    // Runs the compiled program. cell_values[i] holds the value of
+    // GetProgram().cells[i], range_values[i] the aggregate of
+    // GetProgram().ranges[i] by the function of the call it is passed to.
+    // Arithmetic errors are returned, not thrown.
+    Value Execute(const double* cell_values, const Aggregate* range_values = nullptr) const;
+    // Walks the tree instead; kept as a reference for tests and benchmarks.
+    Value ExecuteTree(const double* cell_values, const Aggregate* range_values = nullptr) const;
+
+    const Program& GetProgram() const {
+        return program_;
+    }
+
+    // Appends the nodes of the tree.
+    void Flatten(std::vector<Node>& nodes) const;
 
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    // Prints the formula as if it were moved by offset: every cell reference
+    // is shifted by it.
+    void PrintFormula(std::ostream& out, Position offset = { 0, 0 }) const;
 
-    std::forward_list<Position>& GetCells() {
+    std::pmr::forward_list<Position>& GetCells() {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
+    const std::pmr::forward_list<Position>& GetCells() const {
         return cells_;
     }
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    ArenaPtr<ASTImpl::Expr> root_expr_;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    std::pmr::forward_list<Position> cells_;
+
+    // the tree compiled into a flat instruction stream;
+    // the tree itself is only walked for printing
+    Program program_;
 };
 
-FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
+// Nodes of the tree and the compiled program are allocated from resource.
+// Syntax errors throw ParsingError, references outside the sheet throw
+// FormulaException.
+FormulaAST ParseFormulaAST(std::string_view in,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+FormulaAST ParseFormulaAST(std::istream& in,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+// The same through the parser generated from Formula.g4. Much slower; kept as
+// the reference the hand-written parser is tested against.
+FormulaAST ParseFormulaASTWithAntlr(std::string_view in,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+FormulaAST ParseFormulaASTWithAntlr(std::istream& in,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+// Rebuilds a tree from the nodes Flatten wrote and compiles it; nothing is
+// parsed. Nodes that do not form a valid tree throw ParsingError.
+FormulaAST MakeFormulaAST(const FormulaAST::Node* nodes, size_t count,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
@@ -0,0 +1,122 @@
+#include "aggregate.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace {
+    struct FunctionName {
+        AggregateFunction function;
+        std::string_view name;
+    };
+
+    const FunctionName FUNCTION_NAMES[] = {
+        { AggregateFunction::Sum, "SUM" },
+        { AggregateFunction::Average, "AVERAGE" },
+        { AggregateFunction::Min, "MIN" },
+        { AggregateFunction::Max, "MAX" },
+        { AggregateFunction::Count, "COUNT" },
+    };
+
+    double InitialValue(AggregateFunction function) {
+        switch (function) {
+        case AggregateFunction::Min:
+            return std::numeric_limits<double>::infinity();
+        case AggregateFunction::Max:
+            return -std::numeric_limits<double>::infinity();
+        default:
+            return 0;
+        }
+    }
+
+    // std::min and std::max keep their first argument when comparing with
+    // NaN, so a NaN already folded in stays there.
+    double Min(double accumulated, double number) {
+        return std::isnan(number) ? number : std::min(accumulated, number);
+    }
+
+    double Max(double accumulated, double number) {
+        return std::isnan(number) ? number : std::max(accumulated, number);
+    }
+}
+
+std::optional<AggregateFunction> FindAggregateFunction(std::string_view name) {
+    for (const auto& function_name : FUNCTION_NAMES) {
+        if (function_name.name == name) {
+            return function_name.function;
+        }
+    }
+    return std::nullopt;
+}
+
+std::string_view GetAggregateFunctionName(AggregateFunction function) {
+    return FUNCTION_NAMES[static_cast<size_t>(function)].name;
+}
+
+Aggregate::Aggregate(AggregateFunction function)
+    : function_(function)
+    , value_(InitialValue(function)) {
+}
+
+Aggregate::Aggregate(AggregateFunction function, double value, size_t count)
+    : function_(function)
+    , value_(count == 0 ? InitialValue(function) : value)
+    , count_(count) {
+}
+
+AggregateFunction Aggregate::GetFunction() const {
+    return function_;
+}
+
+void Aggregate::Add(double number) {
+    switch (function_) {
+    case AggregateFunction::Sum:
+    case AggregateFunction::Average:
+        value_ += number;
+        break;
+    case AggregateFunction::Min:
+        value_ = Min(value_, number);
+        break;
+    case AggregateFunction::Max:
+        value_ = Max(value_, number);
+        break;
+    case AggregateFunction::Count:
+        if (std::isnan(number)) {
+            return;
+        }
+        break;
+    }
+    ++count_;
+}
+
+void Aggregate::Merge(const Aggregate& other) {
+    switch (function_) {
+    case AggregateFunction::Sum:
+    case AggregateFunction::Average:
+        value_ += other.value_;
+        break;
+    case AggregateFunction::Min:
+        value_ = Min(value_, other.value_);
+        break;
+    case AggregateFunction::Max:
+        value_ = Max(value_, other.value_);
+        break;
+    case AggregateFunction::Count:
+        break;
+    }
+    count_ += other.count_;
+}
+
+double Aggregate::GetResult() const {
+    switch (function_) {
+    case AggregateFunction::Average:
+        return count_ == 0 ? std::numeric_limits<double>::quiet_NaN() : value_ / count_;
+    case AggregateFunction::Min:
+    case AggregateFunction::Max:
+        return count_ == 0 ? 0 : value_;
+    case AggregateFunction::Count:
+        return static_cast<double>(count_);
+    default:
+        return value_;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+enum class AggregateFunction : std::uint8_t {
+    Sum,
+    Average,
+    Min,
+    Max,
+    Count,
+};
+
+// Looks a function up by its name in a formula, e.g. "SUM".
+std::optional<AggregateFunction> FindAggregateFunction(std::string_view name);
+std::string_view GetAggregateFunctionName(AggregateFunction function);
+
+// Running result of an aggregate function over a sequence of numbers. The
+// aggregates of two parts of a sequence merge into the aggregate of the
+// whole, so a range can be summarised column by column and combined with the
+// plain arguments of the call.
+class Aggregate {
+public:
+    explicit Aggregate(AggregateFunction function);
+    // The aggregate of count numbers whose sum, minimum or maximum, as the
+    // function requires, is value.
+    Aggregate(AggregateFunction function, double value, size_t count);
+
+    AggregateFunction GetFunction() const;
+
+    // NaN, the result of a failed operation, spoils every function but
+    // COUNT, which skips it.
+    void Add(double number);
+    void Merge(const Aggregate& other);
+
+    // NaN for the average of no numbers; the minimum and the maximum of no
+    // numbers are zero.
+    double GetResult() const;
+
+private:
+    AggregateFunction function_;
+    double value_;
+    size_t count_ = 0;
+};
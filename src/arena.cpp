@@ -0,0 +1,55 @@
+#include "arena.h"
+
+CountingResource::CountingResource(std::pmr::memory_resource* upstream)
+    : upstream_(upstream) {
+}
+
+size_t CountingResource::GetAllocations() const {
+    return allocations_;
+}
+
+size_t CountingResource::GetBlocksInUse() const {
+    return blocks_in_use_;
+}
+
+size_t CountingResource::GetBytesInUse() const {
+    return bytes_in_use_;
+}
+
+void* CountingResource::do_allocate(size_t bytes, size_t alignment) {
+    void* ptr = upstream_->allocate(bytes, alignment);
+    ++allocations_;
+    ++blocks_in_use_;
+    bytes_in_use_ += bytes;
+    return ptr;
+}
+
+void CountingResource::do_deallocate(void* ptr, size_t bytes, size_t alignment) {
+    upstream_->deallocate(ptr, bytes, alignment);
+    --blocks_in_use_;
+    bytes_in_use_ -= bytes;
+}
+
+bool CountingResource::do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+}
+
+Arena::Arena()
+    : system_(std::pmr::new_delete_resource())
+    , pool_(&system_)
+    , objects_(&pool_) {
+}
+
+std::pmr::memory_resource* Arena::GetResource() {
+    return &objects_;
+}
+
+Arena::Stats Arena::GetStats() const {
+    Stats stats;
+    stats.allocations = objects_.GetAllocations();
+    stats.objects_in_use = objects_.GetBlocksInUse();
+    stats.bytes_in_use = objects_.GetBytesInUse();
+    stats.chunks = system_.GetBlocksInUse();
+    stats.bytes_reserved = system_.GetBytesInUse();
+    return stats;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <utility>
+
+// Destroys an object made by MakeArenaPtr and returns its memory to the
+// resource it came from. The size is recorded at allocation, so a pointer to
+// a base class releases the full derived object.
+struct ArenaDeleter {
+    std::pmr::memory_resource* resource = nullptr;
+    size_t size = 0;
+    size_t alignment = 0;
+
+    template <class T>
+    void operator()(T* ptr) const {
+        ptr->~T();
+        resource->deallocate(ptr, size, alignment);
+    }
+};
+
+template <class T>
+using ArenaPtr = std::unique_ptr<T, ArenaDeleter>;
+
+template <class T, class... Args>
+ArenaPtr<T> MakeArenaPtr(std::pmr::memory_resource* resource, Args&&... args) {
+    void* memory = resource->allocate(sizeof(T), alignof(T));
+    try {
+        T* ptr = new (memory) T(std::forward<Args>(args)...);
+        return ArenaPtr<T>(ptr, ArenaDeleter{ resource, sizeof(T), alignof(T) });
+    }
+    catch (...) {
+        resource->deallocate(memory, sizeof(T), alignof(T));
+        throw;
+    }
+}
+
+// Counts the blocks passing through it on the way to the upstream resource.
+class CountingResource : public std::pmr::memory_resource {
+public:
+    explicit CountingResource(std::pmr::memory_resource* upstream);
+
+    size_t GetAllocations() const;
+    size_t GetBlocksInUse() const;
+    size_t GetBytesInUse() const;
+
+private:
+    std::pmr::memory_resource* upstream_;
+    size_t allocations_ = 0;
+    size_t blocks_in_use_ = 0;
+    size_t bytes_in_use_ = 0;
+
+    void* do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void* ptr, size_t bytes, size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override;
+};
+
+// Pooled memory owned by one sheet. Small objects are carved out of large
+// chunks, freed blocks are reused by later objects of the same size, and the
+// chunks go back to the system all at once when the arena is destroyed.
+// Not thread-safe.
+class Arena {
+public:
+    struct Stats {
+        size_t allocations = 0;     // objects allocated over the arena's lifetime
+        size_t objects_in_use = 0;
+        size_t bytes_in_use = 0;
+        size_t chunks = 0;          // chunks currently taken from the system
+        size_t bytes_reserved = 0;
+    };
+
+    Arena();
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    std::pmr::memory_resource* GetResource();
+    Stats GetStats() const;
+
+private:
+    CountingResource system_;
+    std::pmr::unsynchronized_pool_resource pool_;
+    CountingResource objects_;
+};
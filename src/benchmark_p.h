@@ -0,0 +1,42 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+
+namespace BenchmarkPrivate {
+    inline volatile unsigned char sink = 0;
+
+    inline void Consume(const void* data) {
+        sink = *static_cast<const unsigned char*>(data);
+    }
+}  // namespace BenchmarkPrivate
+
+// Keeps the compiler from throwing away a computation whose result is unused.
+template <class T>
+void DoNotOptimize(const T& value) {
+    BenchmarkPrivate::Consume(&value);
+}
+
+class BenchmarkRunner {
+public:
+    // Calls func the given number of times and reports the achieved rate.
+    template <class BenchFunc>
+    void Measure(const std::string& name, size_t iterations, BenchFunc func) {
+        using Clock = std::chrono::steady_clock;
+
+        const auto start = Clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            func();
+        }
+        const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        std::cerr << name << ": " << iterations << " runs in " << seconds * 1000 << " ms, "
+                  << static_cast<size_t>(iterations / seconds) << " runs/s" << std::endl;
+    }
+};
+
+#define RUN_BENCHMARK(br, func) \
+    std::cerr << "== " << #func << std::endl; \
+    func(br)
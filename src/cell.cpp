@@ -20,39 +20,47 @@ std::vector<Position> EmptyImpl::GetReferencedCells() const {
     return {};
 }
 
-TextImpl::TextImpl(std::string text) : impl_(std::move(text)) {
+TextImpl::TextImpl(StringPool::Handle text) : impl_(std::move(text)) {
 
 }
 
 Cell::Value TextImpl::GetValue() const {
-    if (impl_[0] == '\'') {
-        return std::string(impl_.begin() + 1, impl_.end());
-    }
-    return impl_;
+    return std::string(impl_.GetValue());
 }
 
 
 std::string TextImpl::GetText() const {
-    return impl_;
+    return std::string(impl_.GetText());
+}
+
+std::string_view TextImpl::GetTextValue() const {
+    return impl_.GetValue();
+}
+
+std::string_view TextImpl::GetTextView() const {
+    return impl_.GetText();
 }
 
 std::vector<Position> TextImpl::GetReferencedCells() const {
     return {};
 }
 
-FormulaImpl::FormulaImpl(std::string formula, Sheet& sheet) : impl_(formula), sheet_(sheet) {
+FormulaImpl::FormulaImpl(std::string_view expression, Position pos, Sheet& sheet)
+    : impl_(sheet.GetFormulaTable().Get(expression, pos)), sheet_(sheet) {
+
+}
+
+FormulaImpl::FormulaImpl(Formula formula, Sheet& sheet)
+    : impl_(std::move(formula)), sheet_(sheet) {
 
 }
 
 Cell::Value FormulaImpl::GetValue() const {
-    try {
-        auto result = impl_.Evaluate(sheet_);
-        return std::get<double>(result);
-    }
-    catch (FormulaError& er) {
-        return er;
+    auto result = impl_.Evaluate(sheet_, sheet_.GetValueStore());
+    if (std::holds_alternative<FormulaError>(result)) {
+        return std::get<FormulaError>(result);
     }
-
+    return std::get<double>(result);
 }
 
 std::string FormulaImpl::GetText() const {
@@ -64,6 +72,14 @@ std::vector<Position> FormulaImpl::GetReferencedCells() const {
     return impl_.GetReferencedCells();
 }
 
+std::vector<Range> FormulaImpl::GetReferencedRanges() const {
+    return impl_.GetReferencedRanges();
+}
+
+const Formula* FormulaImpl::GetFormula() const {
+    return &impl_;
+}
+
 
 Cell::Cell(Sheet& sheet) : sheet_(sheet) {
 
@@ -76,18 +92,22 @@ Cell::~Cell() {
 void Cell::Set(Position pos, std::string text) {
     pos_ = std::move(pos);
     if (text.empty()) {
-        impl_ = std::make_unique<EmptyImpl>();
+        impl_ = MakeArenaPtr<EmptyImpl>(sheet_.GetMemoryResource());
     }
-    else if (text.size() > 1 && text[0] == '=' && text[1] != '\'') {
-        std::string expression(text.begin() + 1, text.end());
-        impl_ = std::make_unique<FormulaImpl>(std::move(expression), sheet_);
+    else if (IsFormulaText(text)) {
+        impl_ = MakeArenaPtr<FormulaImpl>(sheet_.GetMemoryResource(), std::string_view(text).substr(1), pos_, sheet_);
     }
     else {
-        impl_ = std::make_unique<TextImpl>(std::move(text));
+        impl_ = MakeArenaPtr<TextImpl>(sheet_.GetMemoryResource(), sheet_.GetStringPool().Intern(text));
     }
 
 }
 
+void Cell::Set(Position pos, Formula formula) {
+    pos_ = std::move(pos);
+    impl_ = MakeArenaPtr<FormulaImpl>(sheet_.GetMemoryResource(), std::move(formula), sheet_);
+}
+
 void Cell::Clear() {
     Set(pos_, ""s);
 }
@@ -105,6 +125,42 @@ Cell::Value Cell::CalculateValue() const {
     return impl_->GetValue();
 }
 
+std::string_view Cell::GetTextValue() const {
+    return impl_->GetTextValue();
+}
+
+std::string_view Cell::GetTextView() const {
+    return impl_->GetTextView();
+}
+
+const Formula* Cell::GetFormula() const {
+    return impl_->GetFormula();
+}
+
+bool Cell::IsDirty() const {
+    return is_dirty_;
+}
+
+void Cell::SetDirty(bool dirty) const {
+    is_dirty_ = dirty;
+}
+
+bool Cell::IsActive() const {
+    return is_active_;
+}
+
+void Cell::SetActive(bool active) {
+    is_active_ = active;
+}
+
+bool Cell::IsFormulaText(std::string_view text) {
+    return text.size() > 1 && text[0] == FORMULA_SIGN && text[1] != ESCAPE_SIGN;
+}
+
 std::vector<Position> Cell::GetReferencedCells() const {
     return impl_->GetReferencedCells();
 }
+
+std::vector<Range> Cell::GetReferencedRanges() const {
+    return impl_->GetReferencedRanges();
+}
@@ -1,8 +1,10 @@
 ﻿#pragma once
 
+#include "arena.h"
 #include "common.h"
 #include "formula.h"
 #include "sheet.h"
+#include "string_pool.h"
 
 #include <functional>
 #include <unordered_set>
@@ -15,6 +17,20 @@ public:
     virtual Value GetValue() const = 0;
     virtual std::string GetText() const = 0;
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    virtual std::vector<Range> GetReferencedRanges() const {
+        return {};
+    }
+    // The value of a text cell, without copying it.
+    virtual std::string_view GetTextValue() const {
+        return {};
+    }
+    // The text of a text cell as entered, without copying it.
+    virtual std::string_view GetTextView() const {
+        return {};
+    }
+    virtual const Formula* GetFormula() const {
+        return nullptr;
+    }
     virtual ~Impl() = default;
 };
 
@@ -29,20 +45,25 @@ public:
 
 class TextImpl : public Impl {
 public:
-    explicit TextImpl(std::string txt);
+    explicit TextImpl(StringPool::Handle text);
     Value GetValue() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    std::string_view GetTextValue() const override;
+    std::string_view GetTextView() const override;
 private:
-    std::string impl_;
+    StringPool::Handle impl_;
 };
 
 class FormulaImpl : public Impl {
 public:
-    explicit FormulaImpl(std::string, Sheet& sheet);
+    FormulaImpl(std::string_view expression, Position pos, Sheet& sheet);
+    FormulaImpl(Formula formula, Sheet& sheet);
     Value GetValue() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<Range> GetReferencedRanges() const override;
+    const Formula* GetFormula() const override;
 private:
     Formula impl_;
     Sheet& sheet_;
@@ -52,22 +73,48 @@ private:
 class Cell : public CellInterface {
 public:
     Cell(Sheet& sheet);
+    Cell(Cell&& other) = default;
     ~Cell();
 
     void Set(Position pos, std::string text);
+    // Sets a formula compiled beforehand.
+    void Set(Position pos, Formula formula);
     void Clear();
 
     Value GetValue() const override;
     std::string GetText() const override;
     std::vector<Position> GetReferencedCells() const override;
+    // Ranges the formula aggregates; their cells are not listed by
+    // GetReferencedCells.
+    std::vector<Range> GetReferencedRanges() const;
 
     Value CalculateValue() const;
+    // Empty unless the cell holds text.
+    std::string_view GetTextValue() const;
+    // GetText of a text cell without the copy; empty for other cells.
+    std::string_view GetTextView() const;
+    // nullptr unless the cell holds a formula.
+    const Formula* GetFormula() const;
+
+    // A dirty cell's stored value is stale until the sheet evaluates it again.
+    bool IsDirty() const;
+    void SetDirty(bool dirty) const;
+
+    // Whether the cell counts towards the printable area; empty cells kept
+    // only for their dependents do not.
+    bool IsActive() const;
+    void SetActive(bool active);
+
+    // Whether Set reads text as a formula rather than as plain text.
+    static bool IsFormulaText(std::string_view text);
 
 private:
     
-    std::unique_ptr<Impl> impl_;
+    ArenaPtr<Impl> impl_;
     Sheet& sheet_;
     Position pos_;
+    mutable bool is_dirty_ = false;
+    bool is_active_ = false;
 
 };
 
@@ -18,24 +18,29 @@ struct Position {
 
     bool IsValid() const;
     std::string ToString() const;
+    // Writes what ToString returns into buffer, which has to hold
+    // MAX_POSITION_LENGTH characters, without allocating. Returns the end of
+    // what was written.
+    char* ToChars(char* buffer) const;
 
     static Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    static const int MAX_POSITION_LENGTH = 17;
     static const Position NONE;
 };
 
 struct PositionHasher {
 
+    // Every valid position hashes its own index in the sheet, so no two of
+    // them collide.
     size_t operator()(Position pos) const {
-        size_t x_hash = int_hasher_(pos.row);
-        size_t y_hash = int_hasher_(pos.col);
-        return x_hash * 36 + y_hash * 36 * 36;
+        return index_hasher_(static_cast<size_t>(pos.row) * Position::MAX_COLS + pos.col);
     }
 
 private:
-    std::hash<int> int_hasher_;
+    std::hash<size_t> index_hasher_;
 };
 
 struct PostionEqual { 
@@ -51,6 +56,28 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+//     from  to .
+struct Range {
+    Position from;
+    Position to;
+
+    bool operator==(Range rhs) const;
+
+    //    , from      to.
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    Size GetSize() const;
+};
+
+struct RangeHasher {
+    size_t operator()(Range range) const {
+        return position_hasher_(range.from) * 37 + position_hasher_(range.to);
+    }
+
+private:
+    PositionHasher position_hasher_;
+};
+
 //  ,      .
 class FormulaError {
 public:
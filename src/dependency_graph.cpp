@@ -0,0 +1,511 @@
+#include "dependency_graph.h"
+
+#include "tiled_grid.h"
+
+#include <algorithm>
+#include <cassert>
+
+const DependencyGraph::PositionSet DependencyGraph::EMPTY_SET;
+const std::vector<Range> DependencyGraph::EMPTY_RANGES;
+
+void DependencyGraph::SetPrecedents(Position pos, const std::vector<Position>& precedents,
+    const std::vector<Range>& range_precedents) {
+    // Removing edges never invalidates the topological order.
+    auto old_precedents = precedents_.find(pos);
+    if (old_precedents != precedents_.end()) {
+        auto old_precedent_cells = std::move(old_precedents->second);
+        precedents_.erase(old_precedents);
+        for (const auto& precedent_pos : old_precedent_cells) {
+            auto dependents = dependents_.find(precedent_pos);
+            dependents->second.erase(pos);
+            if (dependents->second.empty()) {
+                dependents_.erase(dependents);
+                ReleaseOrder(precedent_pos);
+            }
+        }
+    }
+    auto old_range_precedents = range_precedents_.find(pos);
+    if (old_range_precedents != range_precedents_.end()) {
+        auto old_ranges = std::move(old_range_precedents->second);
+        range_precedents_.erase(old_range_precedents);
+        for (const auto& range : old_ranges) {
+            RemoveRangeDependent(range, pos);
+        }
+    }
+
+    if (precedents.empty() && range_precedents.empty()) {
+        ReleaseOrder(pos);
+        return;
+    }
+
+    // New cells are appended to the order, precedents first, so that filling
+    // a sheet top-down never needs reordering.
+    for (const auto& precedent_pos : precedents) {
+        AssignOrder(precedent_pos);
+    }
+    size_t pos_order = AssignOrder(pos);
+
+    if (!precedents.empty()) {
+        auto& new_precedents = precedents_[pos];
+        for (const auto& precedent_pos : precedents) {
+            if (!new_precedents.insert(precedent_pos).second) {
+                continue;
+            }
+            dependents_[precedent_pos].insert(pos);
+            if (order_.at(precedent_pos) > pos_order) {
+                Reorder(precedent_pos, pos);
+                pos_order = order_.at(pos);
+            }
+        }
+    }
+
+    if (range_precedents.empty()) {
+        return;
+    }
+    auto& new_range_precedents = range_precedents_[pos];
+    for (const auto& range : range_precedents) {
+        if (std::find(new_range_precedents.begin(), new_range_precedents.end(), range) != new_range_precedents.end()) {
+            continue;
+        }
+        new_range_precedents.push_back(range);
+        AddRangeDependent(range, pos);
+
+        // Nothing can be ordered after the last cell.
+        if (pos_order + 1 == next_order_) {
+            continue;
+        }
+        std::vector<Position> late_cells;
+        ForEachEntryInRange(order_, range, [&late_cells, pos_order](Position cell_pos, size_t order) {
+            if (order > pos_order) {
+                late_cells.push_back(cell_pos);
+            }
+        });
+        for (const auto& cell_pos : late_cells) {
+            if (order_.at(cell_pos) > pos_order) {
+                Reorder(cell_pos, pos);
+                pos_order = order_.at(pos);
+            }
+        }
+    }
+}
+
+std::optional<Position> DependencyGraph::Build(std::vector<CellReferences> references) {
+    InsertEdges(std::move(references));
+
+    // Every cell with edges waits for its precedents, counted once per edge
+    // that ForEachDependent will later walk: a cell inside two ranges of the
+    // same formula holds it back twice. The counts are kept in a grid, as
+    // looking them up is most of the work.
+    TiledGrid<size_t> waiting;
+    std::vector<Position> cells;
+    auto add_cell = [&waiting, &cells](Position pos) {
+        if (!waiting.Find(pos)) {
+            waiting.Emplace(pos, 0);
+            cells.push_back(pos);
+        }
+    };
+    for (const auto& [pos, precedents] : precedents_) {
+        add_cell(pos);
+    }
+    for (const auto& [pos, dependents] : dependents_) {
+        add_cell(pos);
+    }
+    for (const auto& [pos, ranges] : range_precedents_) {
+        add_cell(pos);
+    }
+    for (const auto& pos : cells) {
+        size_t precedent_count = GetPrecedents(pos).size();
+        for (const auto& range : GetRangePrecedents(pos)) {
+            waiting.ForEach(range, [&precedent_count](Position, size_t) {
+                ++precedent_count;
+            });
+        }
+        *waiting.Find(pos) = precedent_count;
+    }
+
+    std::vector<Position> ordered;
+    ordered.reserve(cells.size());
+    for (const auto& pos : cells) {
+        if (*waiting.Find(pos) == 0) {
+            ordered.push_back(pos);
+        }
+    }
+    for (size_t i = 0; i < ordered.size(); ++i) {
+        ForEachDependent(ordered[i], [&](Position dependent_pos) {
+            if (--*waiting.Find(dependent_pos) == 0) {
+                ordered.push_back(dependent_pos);
+            }
+        });
+    }
+
+    if (ordered.size() == cells.size()) {
+        order_.reserve(ordered.size());
+        for (const auto& pos : ordered) {
+            order_.emplace(pos, next_order_++);
+        }
+        return std::nullopt;
+    }
+
+    // Every cell left waits for another one left, so walking back from any
+    // of them ends up going round a cycle.
+    Position current = *std::find_if(cells.begin(), cells.end(), [&waiting](Position pos) {
+        return *waiting.Find(pos) != 0;
+    });
+    PositionSet visited;
+    while (visited.insert(current).second) {
+        std::optional<Position> next;
+        for (const auto& precedent_pos : GetPrecedents(current)) {
+            if (*waiting.Find(precedent_pos) != 0) {
+                next = precedent_pos;
+                break;
+            }
+        }
+        for (const auto& range : GetRangePrecedents(current)) {
+            if (next) {
+                break;
+            }
+            waiting.ForEach(range, [&next](Position cell_pos, size_t precedent_count) {
+                if (precedent_count != 0) {
+                    next = cell_pos;
+                }
+            });
+        }
+        current = *next;
+    }
+    *this = DependencyGraph();
+    return current;
+}
+
+bool DependencyGraph::Restore(std::vector<CellReferences> references, const Position* order, size_t count) {
+    InsertEdges(std::move(references));
+    auto has_edges = [this](Position pos) {
+        return precedents_.count(pos) != 0 || dependents_.count(pos) != 0 || range_precedents_.count(pos) != 0;
+    };
+    auto is_ordered = [this](const auto& entry) {
+        return order_.count(entry.first) != 0;
+    };
+
+    // Every cell with edges has to be listed once, and nothing else.
+    order_.reserve(count);
+    bool valid = true;
+    for (size_t i = 0; i < count && valid; ++i) {
+        valid = has_edges(order[i]) && order_.emplace(order[i], next_order_++).second;
+    }
+    valid = valid && std::all_of(precedents_.begin(), precedents_.end(), is_ordered)
+        && std::all_of(dependents_.begin(), dependents_.end(), is_ordered)
+        && std::all_of(range_precedents_.begin(), range_precedents_.end(), is_ordered);
+
+    // Every edge has to point forward in the order, or the saved cells could
+    // form a cycle that SetCell would never have let in.
+    for (auto it = precedents_.begin(); valid && it != precedents_.end(); ++it) {
+        const size_t dependent_order = order_.at(it->first);
+        valid = std::all_of(it->second.begin(), it->second.end(), [&](Position precedent) {
+            return order_.at(precedent) < dependent_order;
+        });
+    }
+    for (auto it = range_precedents_.begin(); valid && it != range_precedents_.end(); ++it) {
+        const size_t dependent_order = order_.at(it->first);
+        for (Range range : it->second) {
+            ForEachEntryInRange(order_, range, [&](Position, size_t precedent_order) {
+                valid = valid && precedent_order < dependent_order;
+            });
+        }
+    }
+    if (!valid) {
+        *this = DependencyGraph();
+    }
+    return valid;
+}
+
+std::vector<Position> DependencyGraph::GetOrder() const {
+    std::vector<std::pair<size_t, Position>> ordered_cells;
+    ordered_cells.reserve(order_.size());
+    for (const auto& [pos, order] : order_) {
+        ordered_cells.emplace_back(order, pos);
+    }
+    std::sort(ordered_cells.begin(), ordered_cells.end());
+
+    std::vector<Position> result;
+    result.reserve(ordered_cells.size());
+    for (const auto& [order, pos] : ordered_cells) {
+        result.push_back(pos);
+    }
+    return result;
+}
+
+void DependencyGraph::InsertEdges(std::vector<CellReferences> references) {
+    assert(order_.empty() && range_dependents_.empty());
+    precedents_.reserve(references.size());
+    dependents_.reserve(references.size());
+    for (auto& cell : references) {
+        if (!cell.cells.empty()) {
+            auto& precedents = precedents_[cell.pos];
+            for (const auto& precedent_pos : cell.cells) {
+                if (precedents.insert(precedent_pos).second) {
+                    dependents_[precedent_pos].insert(cell.pos);
+                }
+            }
+        }
+        if (!cell.ranges.empty()) {
+            auto& range_precedents = range_precedents_[cell.pos];
+            for (const auto& range : cell.ranges) {
+                if (std::find(range_precedents.begin(), range_precedents.end(), range) == range_precedents.end()) {
+                    range_precedents.push_back(range);
+                    AddRangeDependent(range, cell.pos);
+                }
+            }
+        }
+    }
+}
+
+const DependencyGraph::PositionSet& DependencyGraph::GetPrecedents(Position pos) const {
+    auto it = precedents_.find(pos);
+    return it == precedents_.end() ? EMPTY_SET : it->second;
+}
+
+const std::vector<Range>& DependencyGraph::GetRangePrecedents(Position pos) const {
+    auto it = range_precedents_.find(pos);
+    return it == range_precedents_.end() ? EMPTY_RANGES : it->second;
+}
+
+const DependencyGraph::PositionSet& DependencyGraph::GetDependents(Position pos) const {
+    auto it = dependents_.find(pos);
+    return it == dependents_.end() ? EMPTY_SET : it->second;
+}
+
+bool DependencyGraph::HasDependents(Position pos) const {
+    return dependents_.count(pos) != 0;
+}
+
+bool DependencyGraph::HasCircularDependency(Position pos, const std::vector<Position>& precedents,
+    const std::vector<Range>& range_precedents) const {
+    if (precedents.empty() && range_precedents.empty()) {
+        return false;
+    }
+    auto inside_new_range = [&range_precedents](Position cell_pos) {
+        return std::any_of(range_precedents.begin(), range_precedents.end(), [cell_pos](Range range) {
+            return range.Contains(cell_pos);
+        });
+    };
+    // Checked before any shortcut: a cell referencing itself is a cycle even
+    // when nothing else refers to it yet.
+    if (inside_new_range(pos) || std::find(precedents.begin(), precedents.end(), pos) != precedents.end()) {
+        return true;
+    }
+
+    // A new cycle has to pass through pos, so it exists exactly when one of
+    // the new precedents already depends on pos. Everything reachable from pos
+    // is ordered after it, so only precedents ordered after pos are candidates
+    // and the search never leaves the window up to the last of them. The cells
+    // of new ranges are not listed: with ranges the whole order is searched.
+    // A cell outside the order comes before everything, but it can only be
+    // reached through ranges.
+    auto pos_order = order_.find(pos);
+    if (pos_order == order_.end()) {
+        bool inside_range = false;
+        ForEachRangeDependent(pos, [&inside_range](Position) {
+            inside_range = true;
+        });
+        if (!inside_range) {
+            return false;
+        }
+    }
+    const size_t lower_bound = pos_order == order_.end() ? 0 : pos_order->second;
+    PositionSet targets;
+    size_t upper_bound = range_precedents.empty() ? 0 : next_order_;
+    for (const auto& precedent_pos : precedents) {
+        auto precedent_order = order_.find(precedent_pos);
+        if (precedent_order == order_.end() || precedent_order->second < lower_bound) {
+            continue;
+        }
+        targets.insert(precedent_pos);
+        upper_bound = std::max(upper_bound, precedent_order->second);
+    }
+    if (targets.empty() && range_precedents.empty()) {
+        return false;
+    }
+
+    bool found = false;
+    PositionSet visited{ pos };
+    std::vector<Position> to_visit{ pos };
+    while (!to_visit.empty() && !found) {
+        Position current = to_visit.back();
+        to_visit.pop_back();
+        ForEachDependent(current, [&](Position dependent_pos) {
+            if (found) {
+                return;
+            }
+            if (targets.count(dependent_pos) != 0 || inside_new_range(dependent_pos)) {
+                found = true;
+            }
+            else if (order_.at(dependent_pos) < upper_bound && visited.insert(dependent_pos).second) {
+                to_visit.push_back(dependent_pos);
+            }
+        });
+    }
+    return found;
+}
+
+DependencyGraph::PositionSet DependencyGraph::CollectDependents(Position pos) const {
+    return CollectDependents(PositionSet{ pos });
+}
+
+DependencyGraph::PositionSet DependencyGraph::CollectDependents(const PositionSet& sources) const {
+    PositionSet result;
+    std::vector<Position> to_visit{ sources.begin(), sources.end() };
+    while (!to_visit.empty()) {
+        Position current = to_visit.back();
+        to_visit.pop_back();
+        ForEachDependent(current, [&](Position dependent_pos) {
+            if (result.insert(dependent_pos).second) {
+                to_visit.push_back(dependent_pos);
+            }
+        });
+    }
+    return result;
+}
+
+std::vector<Position> DependencyGraph::SortTopologically(const PositionSet& cells) const {
+    // Cells outside the order have no precedents and go first: they may be
+    // read through ranges.
+    std::vector<std::pair<size_t, Position>> ordered_cells;
+    ordered_cells.reserve(cells.size());
+    for (const auto& pos : cells) {
+        auto it = order_.find(pos);
+        ordered_cells.emplace_back(it == order_.end() ? 0 : it->second + 1, pos);
+    }
+    std::sort(ordered_cells.begin(), ordered_cells.end());
+
+    std::vector<Position> result;
+    result.reserve(ordered_cells.size());
+    for (const auto& [order, pos] : ordered_cells) {
+        result.push_back(pos);
+    }
+    return result;
+}
+
+void DependencyGraph::AddRangeDependent(Range range, Position pos) {
+    auto [range_edges, inserted] = range_dependents_.try_emplace(range);
+    range_edges->second.insert(pos);
+    if (inserted) {
+        for (const auto& block : GetRangeBlocks(range)) {
+            range_blocks_[block].push_back(&*range_edges);
+        }
+    }
+}
+
+void DependencyGraph::RemoveRangeDependent(Range range, Position pos) {
+    auto range_edges = range_dependents_.find(range);
+    range_edges->second.erase(pos);
+    if (!range_edges->second.empty()) {
+        return;
+    }
+    for (const auto& block : GetRangeBlocks(range)) {
+        auto block_ranges = range_blocks_.find(block);
+        auto& ranges = block_ranges->second;
+        *std::find(ranges.begin(), ranges.end(), &*range_edges) = ranges.back();
+        ranges.pop_back();
+        if (ranges.empty()) {
+            range_blocks_.erase(block_ranges);
+        }
+    }
+    range_dependents_.erase(range_edges);
+}
+
+std::vector<Position> DependencyGraph::GetRangeBlocks(Range range) const {
+    std::vector<Position> blocks;
+    for (int row = range.from.row / RANGE_BLOCK_SIZE; row <= range.to.row / RANGE_BLOCK_SIZE; ++row) {
+        for (int col = range.from.col / RANGE_BLOCK_SIZE; col <= range.to.col / RANGE_BLOCK_SIZE; ++col) {
+            blocks.push_back({ row, col });
+        }
+    }
+    return blocks;
+}
+
+size_t DependencyGraph::AssignOrder(Position pos) {
+    auto [it, inserted] = order_.emplace(pos, next_order_);
+    if (!inserted) {
+        return it->second;
+    }
+    ++next_order_;
+
+    // Formulas reading a range around the new cell have to follow it.
+    std::vector<Position> readers;
+    ForEachRangeDependent(pos, [&readers](Position dependent_pos) {
+        readers.push_back(dependent_pos);
+    });
+    for (const auto& reader_pos : readers) {
+        if (order_.at(reader_pos) < order_.at(pos)) {
+            Reorder(pos, reader_pos);
+        }
+    }
+    return order_.at(pos);
+}
+
+void DependencyGraph::ReleaseOrder(Position pos) {
+    if (precedents_.count(pos) == 0 && dependents_.count(pos) == 0 && range_precedents_.count(pos) == 0) {
+        order_.erase(pos);
+    }
+}
+
+void DependencyGraph::Reorder(Position precedent, Position dependent) {
+    const size_t lower_bound = order_.at(dependent);
+    const size_t upper_bound = order_.at(precedent);
+
+    // Cells reachable from the dependent that are still ordered before the
+    // precedent have to move behind it...
+    std::vector<Position> forward{ dependent };
+    PositionSet visited{ dependent };
+    for (size_t i = 0; i < forward.size(); ++i) {
+        ForEachDependent(forward[i], [&](Position dependent_pos) {
+            if (order_.at(dependent_pos) < upper_bound && visited.insert(dependent_pos).second) {
+                forward.push_back(dependent_pos);
+            }
+        });
+    }
+
+    // ...and cells reaching the precedent that are ordered after the
+    // dependent have to move in front of it.
+    std::vector<Position> backward{ precedent };
+    visited.insert(precedent);
+    auto visit_precedent = [&](Position precedent_pos, size_t order) {
+        if (order > lower_bound && visited.insert(precedent_pos).second) {
+            backward.push_back(precedent_pos);
+        }
+    };
+    for (size_t i = 0; i < backward.size(); ++i) {
+        Position current = backward[i];
+        for (const auto& precedent_pos : GetPrecedents(current)) {
+            visit_precedent(precedent_pos, order_.at(precedent_pos));
+        }
+        for (const auto& range : GetRangePrecedents(current)) {
+            ForEachEntryInRange(order_, range, visit_precedent);
+        }
+    }
+
+    // Both groups keep their relative order and reuse the freed indices,
+    // the backward group taking the smaller ones.
+    auto by_order = [this](Position lhs, Position rhs) {
+        return order_.at(lhs) < order_.at(rhs);
+    };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+
+    std::vector<size_t> indices;
+    indices.reserve(forward.size() + backward.size());
+    for (const auto& pos : backward) {
+        indices.push_back(order_.at(pos));
+    }
+    for (const auto& pos : forward) {
+        indices.push_back(order_.at(pos));
+    }
+    std::sort(indices.begin(), indices.end());
+
+    size_t next_index = 0;
+    for (const auto& pos : backward) {
+        order_[pos] = indices[next_index++];
+    }
+    for (const auto& pos : forward) {
+        order_[pos] = indices[next_index++];
+    }
+}
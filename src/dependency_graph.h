@@ -0,0 +1,160 @@
+#pragma once
+
+#include "common.h"
+
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Calls f(pos, value) for every entry of a map keyed by position that lies
+// inside range. Probes every position of the range or walks the whole map,
+// whichever is shorter.
+template <class Map, class F>
+void ForEachEntryInRange(const Map& cells, Range range, F&& f) {
+    Size size = range.GetSize();
+    if (static_cast<size_t>(size.rows) * static_cast<size_t>(size.cols) <= cells.size()) {
+        for (int row = range.from.row; row <= range.to.row; ++row) {
+            for (int col = range.from.col; col <= range.to.col; ++col) {
+                auto it = cells.find({ row, col });
+                if (it != cells.end()) {
+                    f(it->first, it->second);
+                }
+            }
+        }
+        return;
+    }
+    for (const auto& [pos, value] : cells) {
+        if (range.Contains(pos)) {
+            f(pos, value);
+        }
+    }
+}
+
+// Graph of references between cells. Only direct edges are stored: for every
+// formula cell the cells it references (precedents) and, in reverse, the
+// formula cells referencing a cell (dependents). Memory is proportional to the
+// number of references; transitive questions are answered by traversal.
+//
+// A formula reading a range depends on every cell inside it, yet the range is
+// stored as a single edge. The ranges containing a cell are found through an
+// index of the ranges overlapping each block of the sheet; the cells of a
+// range are only listed when the order below has to be repaired.
+//
+// The graph also maintains a topological order of its cells with the dynamic
+// algorithm of Pearce and Kelly: inserting an edge that already agrees with
+// the order costs nothing, otherwise only the cells whose order lies between
+// the two ends of the edge are visited and renumbered. The same bounds prune
+// cycle checks. Cells without edges of their own stay out of the order even
+// inside a range: they depend on nothing, so they may come first.
+class DependencyGraph {
+public:
+    using PositionSet = std::unordered_set<Position, PositionHasher, PostionEqual>;
+
+    struct CellReferences {
+        Position pos;
+        std::vector<Position> cells;
+        std::vector<Range> ranges;
+    };
+
+    // Replaces the cells and ranges referenced by pos with the given ones.
+    void SetPrecedents(Position pos, const std::vector<Position>& precedents,
+        const std::vector<Range>& range_precedents = {});
+
+    // Fills an empty graph with the references of many cells at once. All
+    // edges are inserted first and the order is then computed in one pass
+    // with Kahn's algorithm instead of being repaired edge by edge. If the
+    // cells form a cycle, the graph is left empty and a cell on the cycle is
+    // returned.
+    std::optional<Position> Build(std::vector<CellReferences> references);
+    // Fills an empty graph with the references of many cells and an order
+    // of its cells saved by GetOrder. Returns false, leaving the graph empty,
+    // if the order does not list exactly the cells with edges or lists a
+    // cell before one of its precedents.
+    bool Restore(std::vector<CellReferences> references, const Position* order, size_t count);
+    // Cells with edges, each after all of its precedents.
+    std::vector<Position> GetOrder() const;
+
+    // Cells referenced by pos one by one.
+    const PositionSet& GetPrecedents(Position pos) const;
+    const std::vector<Range>& GetRangePrecedents(Position pos) const;
+    // Cells referencing pos one by one.
+    const PositionSet& GetDependents(Position pos) const;
+    bool HasDependents(Position pos) const;
+
+    // Calls f for every cell depending directly on pos, through a reference
+    // to pos or to a range containing it. A cell may be visited more than
+    // once.
+    template <class F>
+    void ForEachDependent(Position pos, F&& f) const {
+        for (const auto& dependent_pos : GetDependents(pos)) {
+            f(dependent_pos);
+        }
+        ForEachRangeDependent(pos, f);
+    }
+
+    // Returns true if making pos reference the given cells and ranges would
+    // close a cycle.
+    bool HasCircularDependency(Position pos, const std::vector<Position>& precedents,
+        const std::vector<Range>& range_precedents = {}) const;
+
+    // Returns every cell that transitively depends on pos, pos excluded.
+    PositionSet CollectDependents(Position pos) const;
+    // Returns every cell that transitively depends on one of the sources.
+    PositionSet CollectDependents(const PositionSet& sources) const;
+
+    // Orders the cells so that each one follows all of its precedents from the
+    // same set.
+    std::vector<Position> SortTopologically(const PositionSet& cells) const;
+
+private:
+    using Edges = std::unordered_map<Position, PositionSet, PositionHasher, PostionEqual>;
+    using RangeEdges = std::unordered_map<Range, PositionSet, RangeHasher>;
+    using Order = std::unordered_map<Position, size_t, PositionHasher, PostionEqual>;
+
+    static const int RANGE_BLOCK_SIZE = 64;
+
+    Edges precedents_;
+    Edges dependents_;
+    std::unordered_map<Position, std::vector<Range>, PositionHasher, PostionEqual> range_precedents_;
+    // the formula cells reading each range
+    RangeEdges range_dependents_;
+    // Ranges overlapping each RANGE_BLOCK_SIZE x RANGE_BLOCK_SIZE block of
+    // the sheet, keyed by the row and column of the block.
+    std::unordered_map<Position, std::vector<const RangeEdges::value_type*>, PositionHasher, PostionEqual> range_blocks_;
+    // Every precedent has a smaller index than its dependents.
+    Order order_;
+    size_t next_order_ = 0;
+
+    template <class F>
+    void ForEachRangeDependent(Position pos, F&& f) const {
+        if (range_blocks_.empty()) {
+            return;
+        }
+        auto block = range_blocks_.find({ pos.row / RANGE_BLOCK_SIZE, pos.col / RANGE_BLOCK_SIZE });
+        if (block == range_blocks_.end()) {
+            return;
+        }
+        for (const auto* range_edges : block->second) {
+            if (range_edges->first.Contains(pos)) {
+                for (const auto& dependent_pos : range_edges->second) {
+                    f(dependent_pos);
+                }
+            }
+        }
+    }
+
+    void InsertEdges(std::vector<CellReferences> references);
+    void AddRangeDependent(Range range, Position pos);
+    void RemoveRangeDependent(Range range, Position pos);
+    std::vector<Position> GetRangeBlocks(Range range) const;
+
+    size_t AssignOrder(Position pos);
+    void ReleaseOrder(Position pos);
+    // Restores the order after inserting an edge from precedent to dependent
+    // that points backwards in it.
+    void Reorder(Position precedent, Position dependent);
+
+    static const PositionSet EMPTY_SET;
+    static const std::vector<Range> EMPTY_RANGES;
+};
@@ -5,6 +5,8 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <charconv>
+#include <optional>
 #include <sstream>
 #include <utility>
 
@@ -21,78 +23,179 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
     return output << "#REF!";
 }
 
-Formula::Formula(std::string expr) try : ast_(ParseFormulaAST(std::move(expr))) {
+Formula::Formula(std::string expr, std::pmr::memory_resource* resource) try
+    : ast_(std::allocate_shared<FormulaAST>(std::pmr::polymorphic_allocator<FormulaAST>(resource),
+        ParseFormulaAST(expr, resource))) {
 
 } catch (...) {
     using namespace std::literals;
     throw FormulaException("Incorrect expression"s);
 }
 
+Formula::Formula(std::shared_ptr<const FormulaAST> ast, Position offset)
+    : ast_(std::move(ast))
+    , offset_(offset) {
+}
+
+namespace {
+    // most formulas reference a handful of cells; their values are gathered
+    // without touching the heap
+    const size_t INLINE_VALUES_COUNT = 16;
+}
+
 FormulaInterface::Value Formula::Evaluate(const SheetInterface& sheet) const {
-    auto values_to_referenced_cells = GetValuesOfReferencedCells(sheet);
-    return ast_.Execute(values_to_referenced_cells);
+    return Evaluate(sheet, nullptr);
+}
+
+FormulaInterface::Value Formula::Evaluate(const SheetInterface& sheet, const ColumnarValueStore& values) const {
+    return Evaluate(sheet, &values);
+}
+
+FormulaInterface::Value Formula::Evaluate(const SheetInterface& sheet, const ColumnarValueStore* store) const {
+    const size_t cells_count = ast_->GetProgram().cells.size();
+    double inline_values[INLINE_VALUES_COUNT];
+    std::vector<double> heap_values;
+    double* values = inline_values;
+    if (cells_count > INLINE_VALUES_COUNT) {
+        heap_values.resize(cells_count);
+        values = heap_values.data();
+    }
+
+    if (auto error = GetValuesOfReferencedCells(sheet, values)) {
+        return *error;
+    }
+
+    if (ast_->GetProgram().ranges.empty()) {
+        return ast_->Execute(values);
+    }
+    std::vector<Aggregate> range_values;
+    if (auto error = AggregateReferencedRanges(sheet, store, range_values)) {
+        return *error;
+    }
+    return ast_->Execute(values, range_values.data());
 }
 
 std::string Formula::GetExpression() const {
     std::ostringstream os;
-    ast_.PrintFormula(os);
+    PrintExpression(os);
     return os.str();
 }
 
+void Formula::PrintExpression(std::ostream& out) const {
+    ast_->PrintFormula(out, offset_);
+}
+
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
 }
 
 
-std::unordered_map<Position, double, PositionHasher> Formula::GetValuesOfReferencedCells(const SheetInterface& sheet) const {
+std::optional<FormulaError> Formula::GetValuesOfReferencedCells(const SheetInterface& sheet, double* values) const {
 
-    std::unordered_map<Position, double, PositionHasher> result;
-    const auto& incoming_cells = ast_.GetCells();
-
-    for (const auto& cell_pos : incoming_cells) {
-        const auto cell = sheet.GetCell(cell_pos);
+    for (const auto& cell_pos : ast_->GetProgram().cells) {
+        double& result = *values++;
+        const auto cell = sheet.GetCell({ cell_pos.row + offset_.row, cell_pos.col + offset_.col });
         if (!cell) {
-            result.insert({ cell_pos, 0 });
+            result = 0;
             continue;
         }
         auto cell_value = cell->GetValue();
         if (std::holds_alternative<double>(cell_value)) {
-            result.insert({ cell_pos, std::get<double>(cell_value) });
+            result = std::get<double>(cell_value);
             continue;
         }
         else if (std::holds_alternative<std::string>(cell_value)) {
-            std::string str_value = std::get<std::string>(cell_value);
-            try {
-                if (!IsValidStr(str_value)) {
-                    throw std::invalid_argument("Can't transform str to double");
-                }
-                double num_str_val = std::stod(str_value);
-                result.insert({cell_pos, num_str_val});
+            auto number = ParseNumber(std::get<std::string>(cell_value));
+            if (!number) {
+                return FormulaError(FormulaError::Category::Value);
             }
-            catch (std::invalid_argument&) {
-                if (str_value.empty()) {
-                    result.insert({ cell_pos, 0 });
-                    continue; 
+            result = *number;
+            continue;
+        }
+        return std::get<FormulaError>(cell_value);
+    }
+    return std::nullopt;
+}
+
+namespace {
+    // Reads the cells of range one by one, column after column, with the
+    // rules of ColumnarValueStore::Accumulate.
+    std::optional<FormulaError> AccumulateCells(const SheetInterface& sheet, Range range, Aggregate& aggregate) {
+        for (int col = range.from.col; col <= range.to.col; ++col) {
+            for (int row = range.from.row; row <= range.to.row; ++row) {
+                const auto cell = sheet.GetCell({ row, col });
+                if (!cell) {
+                    continue;
+                }
+                auto cell_value = cell->GetValue();
+                if (std::holds_alternative<double>(cell_value)) {
+                    aggregate.Add(std::get<double>(cell_value));
+                }
+                else if (std::holds_alternative<std::string>(cell_value)) {
+                    const auto& text = std::get<std::string>(cell_value);
+                    if (auto number = text.empty() ? std::nullopt : ParseNumber(text)) {
+                        aggregate.Add(*number);
+                    }
+                }
+                else if (std::holds_alternative<FormulaError>(cell_value)
+                    && aggregate.GetFunction() != AggregateFunction::Count) {
+                    return std::get<FormulaError>(cell_value);
                 }
-                throw FormulaError(FormulaError::Category::Value);
             }
-            catch (std::out_of_range&) {
-                throw FormulaError(FormulaError::Category::Value);
+        }
+        return std::nullopt;
+    }
+}
+
+std::optional<FormulaError> Formula::AggregateReferencedRanges(const SheetInterface& sheet,
+    const ColumnarValueStore* values, std::vector<Aggregate>& range_values) const {
+    const auto& program = ast_->GetProgram();
+    range_values.assign(program.ranges.size(), Aggregate(AggregateFunction::Sum));
+    for (const auto& call : program.calls) {
+        for (std::uint32_t i = call.first_range; i < call.first_range + call.range_count; ++i) {
+            Aggregate& aggregate = range_values[i] = Aggregate(call.function);
+            Range range = Shift(program.ranges[i]);
+            if (!range.IsValid()) {
+                return FormulaError(FormulaError::Category::Ref);
+            }
+            auto error = values ? values->Accumulate(range, aggregate) : AccumulateCells(sheet, range, aggregate);
+            if (error) {
+                return error;
             }
-            continue;
         }
-        auto error = std::get<FormulaError>(cell_value);
-        throw FormulaError(error.GetCategory());
     }
+    return std::nullopt;
+}
 
-    return result;
+Range Formula::Shift(Range range) const {
+    return { { range.from.row + offset_.row, range.from.col + offset_.col },
+        { range.to.row + offset_.row, range.to.col + offset_.col } };
+}
+
+std::vector<Range> Formula::GetReferencedRanges() const {
+    std::vector<Range> ranges;
+    for (const auto& range : ast_->GetProgram().ranges) {
+        Range shifted = Shift(range);
+        if (shifted.IsValid() && std::find(ranges.begin(), ranges.end(), shifted) == ranges.end()) {
+            ranges.push_back(shifted);
+        }
+    }
+    return ranges;
 }
 
 std::vector<Position> Formula::GetReferencedCells() const {
-    const auto& referenced_cells = ast_.GetCells();
-    std::set<Position> unique_cells{ referenced_cells.begin(), referenced_cells.end() };
-    return { unique_cells.begin(), unique_cells.end() };
+    // a shift keeps the cells sorted
+    std::vector<Position> cells;
+    cells.reserve(ast_->GetProgram().cells.size());
+    for (const auto& cell_pos : ast_->GetProgram().cells) {
+        cells.push_back({ cell_pos.row + offset_.row, cell_pos.col + offset_.col });
+    }
+    return cells;
+}
+
+const std::shared_ptr<const FormulaAST>& Formula::GetAST() const {
+    return ast_;
 }
 
 
@@ -103,4 +206,28 @@ bool IsValidStr(const std::string& str) {
         }
     }
     return true;
-}
\ No newline at end of file
+}
+
+// Same result as std::stod over the characters IsValidStr admits, but
+// reports failure instead of throwing: a formula that reads a non-numeric
+// text cell is an ordinary outcome, not an exceptional one.
+std::optional<double> ParseNumber(const std::string& str) {
+    if (str.empty()) {
+        return 0.0;
+    }
+    if (!IsValidStr(str)) {
+        return std::nullopt;
+    }
+    const char* first = str.data();
+    const char* last = str.data() + str.size();
+    // from_chars does not accept the leading plus stod does
+    if (*first == '+' && first + 1 != last && first[1] != '+' && first[1] != '-') {
+        ++first;
+    }
+    double result = 0.0;
+    auto [ptr, ec] = std::from_chars(first, last, result);
+    if (ec != std::errc()) {
+        return std::nullopt;
+    }
+    return result;
+}
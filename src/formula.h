@@ -2,8 +2,10 @@
 
 #include "common.h"
 #include "FormulaAST.h"
+#include "value_store.h"
 
 #include <memory>
+#include <optional>
 #include <vector>
 
 // ,      .
@@ -43,17 +45,46 @@ std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
 
 class Formula : public FormulaInterface {
 public:
-    explicit Formula(std::string expression);
+    explicit Formula(std::string expression,
+        std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    // A formula sharing the compiled tree of another one that sits offset
+    // cells away: every reference of the tree is read moved by offset.
+    Formula(std::shared_ptr<const FormulaAST> ast, Position offset);
 
     Value Evaluate(const SheetInterface& sheet) const override;
+    // Aggregates ranges straight from the computed values of the sheet,
+    // which have to be up to date for every cell of the ranges. The other
+    // overload reads the cells of a range one by one.
+    Value Evaluate(const SheetInterface& sheet, const ColumnarValueStore& values) const;
 
     std::string GetExpression() const override;
+    // Writes what GetExpression returns without building a string.
+    void PrintExpression(std::ostream& out) const;
 
+    // Cells referenced one by one; the cells of ranges are not listed.
     std::vector<Position> GetReferencedCells() const override;
+    // Ranges passed to functions, without repetitions.
+    std::vector<Range> GetReferencedRanges() const;
+
+    const std::shared_ptr<const FormulaAST>& GetAST() const;
 
 private:
-    FormulaAST ast_;
-    std::unordered_map<Position, double, PositionHasher> GetValuesOfReferencedCells(const SheetInterface& sheet) const;
+    std::shared_ptr<const FormulaAST> ast_;
+    Position offset_ = { 0, 0 };
+
+    Value Evaluate(const SheetInterface& sheet, const ColumnarValueStore* values) const;
+
+    // Writes the value of every referenced cell to its slot of the compiled
+    // program. Returns the error of the first cell that has no numeric value.
+    std::optional<FormulaError> GetValuesOfReferencedCells(const SheetInterface& sheet, double* values) const;
+    // Writes the aggregate of every range of the compiled program to its
+    // slot. Returns the first error found in a range instead.
+    std::optional<FormulaError> AggregateReferencedRanges(const SheetInterface& sheet,
+        const ColumnarValueStore* values, std::vector<Aggregate>& range_values) const;
+    Range Shift(Range range) const;
 };
 
-bool IsValidStr(const std::string& str);
\ No newline at end of file
+bool IsValidStr(const std::string& str);
+// Reads the text of a cell as a formula operand: empty text is zero. Returns
+// nullopt for text that is not a number.
+std::optional<double> ParseNumber(const std::string& str);
\ No newline at end of file
@@ -0,0 +1,136 @@
+#include "formula_table.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+
+namespace {
+    bool IsDigit(char ch) {
+        return ch >= '0' && ch <= '9';
+    }
+
+    bool IsUpper(char ch) {
+        return ch >= 'A' && ch <= 'Z';
+    }
+
+    // Operators, punctuation and white space of the formula grammar.
+    bool IsSymbol(char ch) {
+        return std::string_view("+-*/(),: \t\n\r").find(ch) != std::string_view::npos;
+    }
+}
+
+void FormulaTable::EntryDeleter::operator()(const FormulaAST* ast) const {
+    // the key lives in the entry, so it is looked up before anything is freed
+    table->entries_.erase(table->entries_.find(*key));
+    destroy(const_cast<FormulaAST*>(ast));
+}
+
+FormulaTable::FormulaTable(std::pmr::memory_resource* resource)
+    : resource_(resource) {
+}
+
+Formula FormulaTable::Get(std::string_view expression, Position pos) {
+    auto key = MakeRelativeKey(expression, pos);
+    if (!key) {
+        return Formula(std::string(expression), resource_);
+    }
+
+    auto found = entries_.find(*key);
+    if (found != entries_.end()) {
+        const Entry& entry = found->second;
+        return Formula(entry.ast.lock(), { pos.row - entry.anchor.row, pos.col - entry.anchor.col });
+    }
+
+    ArenaPtr<FormulaAST> ast;
+    try {
+        ast = MakeArenaPtr<FormulaAST>(resource_, ParseFormulaAST(expression, resource_));
+    }
+    catch (...) {
+        using namespace std::literals;
+        throw FormulaException("Incorrect expression"s);
+    }
+
+    return Add(std::move(*key), std::move(ast), pos);
+}
+
+Formula FormulaTable::Add(std::string key, ArenaPtr<FormulaAST> ast, Position anchor) {
+    auto [entry, inserted] = entries_.try_emplace(std::move(key));
+    assert(inserted);
+    ArenaDeleter destroy = ast.get_deleter();
+    std::shared_ptr<const FormulaAST> shared_ast(ast.release(), EntryDeleter{ this, &entry->first, destroy },
+        std::pmr::polymorphic_allocator<std::byte>(resource_));
+    entry->second.ast = shared_ast;
+    entry->second.anchor = anchor;
+    return Formula(std::move(shared_ast), { 0, 0 });
+}
+
+size_t FormulaTable::GetSize() const {
+    return entries_.size();
+}
+
+std::optional<std::string> FormulaTable::MakeRelativeKey(std::string_view expression, Position pos) {
+    // Tokens are delimited as the formula lexer does, so that the digits
+    // and exponent of a number are never taken for a reference.
+    std::string key;
+    key.reserve(expression.size() + 8);
+    size_t i = 0;
+    while (i < expression.size()) {
+        char ch = expression[i];
+        size_t end = i;
+        if (IsDigit(ch) || ch == '.') {
+            while (end < expression.size() && IsDigit(expression[end])) {
+                ++end;
+            }
+            if (end + 1 < expression.size() && expression[end] == '.' && IsDigit(expression[end + 1])) {
+                for (++end; end < expression.size() && IsDigit(expression[end]); ++end) {
+                }
+            }
+            if (end < expression.size() && (expression[end] == 'e' || expression[end] == 'E')) {
+                size_t exponent = end + 1;
+                if (exponent < expression.size() && (expression[exponent] == '+' || expression[exponent] == '-')) {
+                    ++exponent;
+                }
+                if (exponent < expression.size() && IsDigit(expression[exponent])) {
+                    for (end = exponent; end < expression.size() && IsDigit(expression[end]); ++end) {
+                    }
+                }
+            }
+            end = std::max(end, i + 1);
+            key.append(expression.substr(i, end - i));
+        }
+        else if (IsUpper(ch)) {
+            while (end < expression.size() && IsUpper(expression[end])) {
+                ++end;
+            }
+            size_t letters_end = end;
+            while (end < expression.size() && IsDigit(expression[end])) {
+                ++end;
+            }
+            if (end == letters_end) {
+                key.append(expression.substr(i, end - i));
+            }
+            else {
+                auto cell = Position::FromString(expression.substr(i, end - i));
+                if (!cell.IsValid()) {
+                    return std::nullopt;
+                }
+                key += '{';
+                key += std::to_string(cell.row - pos.row);
+                key += ',';
+                key += std::to_string(cell.col - pos.col);
+                key += '}';
+            }
+        }
+        else if (IsSymbol(ch)) {
+            end = i + 1;
+            key += ch;
+        }
+        else {
+            // Anything else, the braces of a key included, is left to the
+            // parser to reject, so no text shares a key with another.
+            return std::nullopt;
+        }
+        i = end;
+    }
+    return key;
+}
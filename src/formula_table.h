@@ -0,0 +1,70 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Compiled formulas of one sheet, shared between cells whose formulas differ
+// only by where they are. A formula filled down a column, =A2*B2 in C2, =A3*B3
+// in C3 and so on, has one text once every reference is written relative to
+// its own cell. The first such formula is parsed; the others reuse its tree,
+// read with their distance from that first cell added to every reference.
+// Not thread-safe.
+class FormulaTable {
+public:
+    explicit FormulaTable(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    FormulaTable(const FormulaTable&) = delete;
+    FormulaTable& operator=(const FormulaTable&) = delete;
+
+    // Returns the formula with the given expression (without the leading
+    // sign) for the cell at pos. Throws FormulaException as Formula does.
+    // The table must outlive the formulas it returns.
+    Formula Get(std::string_view expression, Position pos);
+    // Shares a tree parsed for the cell at anchor under its relative key,
+    // which no entry may hold yet, and returns the formula of the anchor.
+    Formula Add(std::string key, ArenaPtr<FormulaAST> ast, Position anchor);
+
+    // Number of distinct compiled formulas in use.
+    size_t GetSize() const;
+
+    // Calls f(key, anchor, ast) for every shared tree.
+    template <class F>
+    void ForEachEntry(F&& f) const {
+        for (const auto& [key, entry] : entries_) {
+            if (auto ast = entry.ast.lock()) {
+                f(std::string_view(key), entry.anchor, *ast);
+            }
+        }
+    }
+
+    // Writes every cell reference as its offset from pos; other characters
+    // are kept as they are. Formulas with the same key share a tree. Returns
+    // nothing if a reference is invalid or a character is not in the formula
+    // grammar, which the parser reports instead.
+    static std::optional<std::string> MakeRelativeKey(std::string_view expression, Position pos);
+
+private:
+    struct Entry {
+        std::weak_ptr<const FormulaAST> ast;
+        // the cell the tree was parsed for
+        Position anchor;
+    };
+
+    // Frees a shared tree and forgets its entry once no formula uses it.
+    struct EntryDeleter {
+        FormulaTable* table;
+        const std::string* key;
+        ArenaDeleter destroy;
+
+        void operator()(const FormulaAST* ast) const;
+    };
+
+    std::pmr::memory_resource* resource_;
+    std::unordered_map<std::string, Entry> entries_;
+};
@@ -1,7 +1,16 @@
+#include "benchmark_p.h"
 #include "common.h"
 #include "formula.h"
+#include "occupancy_counter.h"
+#include "sheet.h"
 #include "test_runner_p.h"
 
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <random>
+#include <system_error>
+
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
@@ -32,6 +41,8 @@ namespace {
         auto testSingle = [](Position pos, std::string_view str) {
             ASSERT_EQUAL(pos.ToString(), str);
             ASSERT_EQUAL(Position::FromString(str), pos);
+            char buffer[Position::MAX_POSITION_LENGTH];
+            ASSERT_EQUAL(std::string_view(buffer, pos.ToChars(buffer) - buffer), str);
         };
 
         for (int i = 0; i < 25; ++i) {
@@ -58,6 +69,8 @@ namespace {
         ASSERT_EQUAL((Position{ -1, -1 }).ToString(), "");
         ASSERT_EQUAL((Position{ -10, 0 }).ToString(), "");
         ASSERT_EQUAL((Position{ 1, -3 }).ToString(), "");
+        char buffer[Position::MAX_POSITION_LENGTH];
+        ASSERT((Position{ Position::MAX_ROWS, 0 }).ToChars(buffer) == buffer);
     }
 
     void TestStringToPositionInvalid() {
@@ -74,6 +87,11 @@ namespace {
         ASSERT(!Position::FromString("XFE16384").IsValid());
         ASSERT(!Position::FromString("A1234567890123456789").IsValid());
         ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
+        ASSERT(!Position::FromString("a1").IsValid());
+        ASSERT(!Position::FromString("A1 ").IsValid());
+        ASSERT(!Position::FromString("A 1").IsValid());
+        ASSERT(!Position::FromString("A1.5").IsValid());
+        ASSERT_EQUAL(Position::FromString("B007"), (Position{ 6, 1 }));
     }
 
     void TestEmpty() {
@@ -362,6 +380,43 @@ namespace {
         ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
     }
 
+    void TestSelfReferenceOnFreshSheet() {
+        for (const char* text : { "=A1", "=A1+1", "=B1+A1", "=SUM(A1:B2)" }) {
+            Sheet sheet;
+            try {
+                sheet.SetCell("A1"_pos, text);
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException&) {
+            }
+            ASSERT(std::as_const(sheet).GetCell("A1"_pos) == nullptr);
+
+            try {
+                sheet.ApplyBatch({ { "A1"_pos, text } });
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException&) {
+            }
+            ASSERT(std::as_const(sheet).GetCell("A1"_pos) == nullptr);
+        }
+    }
+
+    void TestSetPlaceholderCell() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=A1");
+        sheet.GetCell("A1"_pos);
+        sheet.SetCell("A1"_pos, "");
+        sheet.ClearCell("B1"_pos);
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 1, 1 }));
+
+        Sheet batch_sheet;
+        batch_sheet.SetCell("B1"_pos, "=A1");
+        batch_sheet.GetCell("A1"_pos);
+        batch_sheet.ApplyBatch({ { "A1"_pos, "" } });
+        batch_sheet.ClearCell("B1"_pos);
+        ASSERT_EQUAL(batch_sheet.GetPrintableSize(), (Size{ 1, 1 }));
+    }
+
     void Test_01() {
         auto sheet = CreateSheet();
         sheet->SetCell("A1"_pos, "=(1+2)*3");
@@ -409,9 +464,1708 @@ namespace {
         }
     }
 
+    void TestPrintableAreaTracking() {
+        const int rows = Position::MAX_ROWS;
+        OccupancyCounter<Position::MAX_ROWS> counter;
+        ASSERT_EQUAL(counter.GetEnd(), 0);
+        counter.Add(rows - 1);
+        counter.Add(4095);
+        counter.Add(4095);
+        counter.Add(0);
+        ASSERT_EQUAL(counter.GetEnd(), rows);
+        counter.Remove(rows - 1);
+        ASSERT_EQUAL(counter.GetEnd(), 4096);
+        counter.Remove(4095);
+        ASSERT_EQUAL(counter.GetEnd(), 4096);
+        counter.Remove(4095);
+        ASSERT_EQUAL(counter.GetEnd(), 1);
+        counter.Remove(0);
+        ASSERT_EQUAL(counter.GetEnd(), 0);
+
+        // Random edits against the area of the cells set and not cleared.
+        Sheet sheet;
+        std::set<std::pair<int, int>> cells;
+        auto expected_size = [&cells] {
+            Size size{ 0, 0 };
+            for (const auto& [row, col] : cells) {
+                size.rows = std::max(size.rows, row + 1);
+                size.cols = std::max(size.cols, col + 1);
+            }
+            return size;
+        };
+        std::mt19937 generator(24);
+        std::uniform_int_distribution<int> coordinate(0, 299);
+        for (int i = 0; i < 3000; ++i) {
+            Position pos{ coordinate(generator), coordinate(generator) };
+            switch (i % 4) {
+            case 0:
+                sheet.ClearCell(pos);
+                cells.erase({ pos.row, pos.col });
+                break;
+            case 1:
+                // Empty cells kept for a dependent are not printed.
+                sheet.SetCell(pos, "=" + Position{ pos.row + 300, pos.col + 300 }.ToString());
+                sheet.GetCell({ pos.row + 300, pos.col + 300 });
+                cells.insert({ pos.row, pos.col });
+                break;
+            default:
+                sheet.SetCell(pos, std::to_string(i));
+                cells.insert({ pos.row, pos.col });
+            }
+            ASSERT_EQUAL(sheet.GetPrintableSize(), expected_size());
+        }
+        sheet.ApplyBatch({ { { 400, 1 }, "1" }, { { 400, 1 }, "2" }, { { 2, 450 }, "3" } });
+        cells.insert({ 400, 1 });
+        cells.insert({ 2, 450 });
+        ASSERT_EQUAL(sheet.GetPrintableSize(), expected_size());
+        for (const auto& [row, col] : std::set<std::pair<int, int>>(cells)) {
+            sheet.ClearCell({ row, col });
+            cells.erase({ row, col });
+            ASSERT_EQUAL(sheet.GetPrintableSize(), expected_size());
+        }
+    }
+
+    void TestRecalculationOrder() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 1; i < 200; ++i) {
+            sheet.SetCell(Position{ i, 0 }, "=" + Position{ i - 1, 0 }.ToString() + "+1");
+            sheet.SetCell(Position{ i, 1 }, "=" + Position{ i, 0 }.ToString() + "+" + Position{ i - 1, 0 }.ToString());
+        }
+
+        sheet.SetCell("A1"_pos, "10");
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 398u);
+        ASSERT_EQUAL(sheet.GetCell("A200"_pos)->GetValue(), CellInterface::Value(209.0));
+        ASSERT_EQUAL(sheet.GetCell("B200"_pos)->GetValue(), CellInterface::Value(417.0));
+
+        sheet.ClearCell("A1"_pos);
+        ASSERT_EQUAL(sheet.GetCell("A200"_pos)->GetValue(), CellInterface::Value(199.0));
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+    }
+
+    void TestDirectDependencies() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=A1*2");
+        sheet.SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+        // A long running total stays cheap to build and to edit at the tail.
+        const int rows = Position::MAX_ROWS;
+        for (int i = 1; i < rows; ++i) {
+            sheet.SetCell(Position{ i, 0 }, "=" + Position{ i - 1, 0 }.ToString() + "+1");
+        }
+        ASSERT_EQUAL(sheet.GetCell(Position{ rows - 1, 0 })->GetValue(), CellInterface::Value(5.0 + rows - 1));
+        sheet.SetCell(Position{ rows - 1, 0 }, "=1");
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 0u);
+
+        // Dropping a reference removes the edge: A1 no longer feeds C1.
+        sheet.SetCell("C1"_pos, "=A1+A2");
+        sheet.SetCell("C1"_pos, "=A2");
+        sheet.SetCell("A1"_pos, "7");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(8.0));
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetValue(), CellInterface::Value(14.0));
+
+        sheet.ClearCell("B1"_pos);
+        bool caught = false;
+        try {
+            sheet.SetCell("A1"_pos, "=C1");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        sheet.SetCell("A1"_pos, "=B1");
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(1.0));
+    }
+
+    void TestIncrementalTopologicalOrder() {
+        Sheet sheet;
+        // Built bottom-up, so every new reference points backwards in the
+        // order the cells were first seen and has to be reordered.
+        for (int i = 99; i > 0; --i) {
+            sheet.SetCell(Position{ i, 0 }, "=" + Position{ i - 1, 0 }.ToString() + "*2");
+        }
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 99u);
+        ASSERT_EQUAL(sheet.GetCell("A11"_pos)->GetValue(), CellInterface::Value(1024.0));
+
+        bool caught = false;
+        try {
+            sheet.SetCell("A1"_pos, "=A100");
+        }
+        catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "1");
+
+        // Rewiring the middle of the chain keeps later edits correctly ordered.
+        sheet.SetCell("A50"_pos, "=B1+1");
+        sheet.SetCell("B1"_pos, "=A10");
+        sheet.SetCell("A1"_pos, "2");
+        ASSERT_EQUAL(sheet.GetCell("A50"_pos)->GetValue(), CellInterface::Value(1025.0));
+        ASSERT_EQUAL(sheet.GetCell("A51"_pos)->GetValue(), CellInterface::Value(2050.0));
+    }
+
+    void TestLazyEvaluation() {
+        Sheet sheet(EvaluationMode::Lazy);
+        sheet.SetCell("A1"_pos, "1");
+        for (int i = 1; i < Position::MAX_ROWS; ++i) {
+            sheet.SetCell(Position{ i, 0 }, "=" + Position{ i - 1, 0 }.ToString() + "+1");
+            ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 0u);
+        }
+        sheet.SetCell("B1"_pos, "=1/0");
+        sheet.SetCell("B2"_pos, "=B1+A2");
+
+        // The first read evaluates the whole dirty chain without deep recursion.
+        ASSERT_EQUAL(sheet.GetCell(Position{ Position::MAX_ROWS - 1, 0 })->GetValue(),
+            CellInterface::Value(1.0 * Position::MAX_ROWS));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(),
+            CellInterface::Value(FormulaError::Category::Div0));
+
+        sheet.SetCell("A1"_pos, "10");
+        sheet.SetCell("B1"_pos, "3");
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(12.0));
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(14.0));
+
+        sheet.SetCell("A1"_pos, "20");
+        sheet.SetEvaluationMode(EvaluationMode::Eager);
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), static_cast<size_t>(Position::MAX_ROWS) + 1);
+        sheet.SetCell("A1"_pos, "0");
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), static_cast<size_t>(Position::MAX_ROWS));
+
+        std::ostringstream values;
+        Sheet small(EvaluationMode::Lazy);
+        small.SetCell("A1"_pos, "=B1*2");
+        small.SetCell("B1"_pos, "21");
+        small.PrintValues(values);
+        ASSERT_EQUAL(values.str(), "42\t21\n");
+    }
+
+    void TestApplyBatch() {
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=B1");
+        sheet.SetCell("C1"_pos, "=A1+B1+A2");
+
+        // A1 and B1 swap roles: cyclic halfway through, acyclic in the end.
+        sheet.ApplyBatch({ { "B1"_pos, "=A1*2" }, { "A1"_pos, "3" }, { "A2"_pos, "4" } });
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 4u);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(13.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 3 }));
+
+        auto expect_rollback = [&](std::vector<CellEdit> edits, bool circular) {
+            try {
+                sheet.ApplyBatch(std::move(edits));
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException&) {
+                ASSERT(circular);
+            }
+            catch (const FormulaException&) {
+                ASSERT(!circular);
+            }
+            ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "3");
+            ASSERT_EQUAL(sheet.GetCell("B1"_pos)->GetText(), "=A1*2");
+            ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(13.0));
+        };
+        expect_rollback({ { "A1"_pos, "5" }, { "B1"_pos, "=C1" } }, true);
+        expect_rollback({ { "A1"_pos, "5" }, { "D1"_pos, "=1+" } }, false);
+
+        // The graph survived the rollback.
+        sheet.ApplyBatch({ { "A1"_pos, "5" }, { "A1"_pos, "6" } });
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 3u);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(22.0));
+
+        Sheet lazy(EvaluationMode::Lazy);
+        lazy.ApplyBatch({ { "A1"_pos, "=B1+1" }, { "B1"_pos, "1" } });
+        ASSERT_EQUAL(lazy.GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+    }
+
+    void TestParallelRecalculation() {
+        // Every column is a chain over the previous one, so each row is a
+        // wave of independent cells.
+        auto fill = [](Sheet& sheet) {
+            const int rows = 40;
+            const int cols = 50;
+            for (int col = 0; col < cols; ++col) {
+                sheet.SetCell(Position{ 0, col }, "=A100+" + std::to_string(col));
+            }
+            for (int row = 1; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    Position up{ row - 1, col };
+                    Position left{ row - 1, col == 0 ? cols - 1 : col - 1 };
+                    sheet.SetCell(Position{ row, col }, "=" + up.ToString() + "*0.5+" + left.ToString() + "/3");
+                }
+            }
+        };
+
+        Sheet sequential;
+        Sheet parallel;
+        parallel.SetRecalculationThreads(4);
+        ASSERT_EQUAL(parallel.GetRecalculationThreads(), 4u);
+        fill(sequential);
+        fill(parallel);
+
+        for (const auto& value : { "1", "2.5", "=1/0", "-7" }) {
+            sequential.SetCell("A100"_pos, value);
+            parallel.SetCell("A100"_pos, value);
+            ASSERT_EQUAL(parallel.GetLastRecalculatedCellsCount(), sequential.GetLastRecalculatedCellsCount());
+
+            std::ostringstream expected;
+            std::ostringstream actual;
+            sequential.PrintValues(expected);
+            parallel.PrintValues(actual);
+            ASSERT_EQUAL(actual.str(), expected.str());
+        }
+
+        parallel.SetRecalculationThreads(1);
+        ASSERT_EQUAL(parallel.GetRecalculationThreads(), 1u);
+    }
+
+    void TestCompiledFormula() {
+        std::unordered_map<Position, double, PositionHasher> values_to_cells{
+            { "A1"_pos, 2 }, { "B2"_pos, -3 }, { "C3"_pos, 0 }, { "D4"_pos, -0.0 },
+        };
+        auto check = [&](const std::string& expression) {
+            auto ast = ParseFormulaAST(expression);
+            std::vector<double> values;
+            for (const auto& pos : ast.GetProgram().cells) {
+                values.push_back(values_to_cells.at(pos));
+            }
+            auto to_string = [](const FormulaAST::Value& value) {
+                if (std::holds_alternative<FormulaError>(value)) {
+                    return std::string(std::get<FormulaError>(value).ToString());
+                }
+                return std::to_string(std::get<double>(value));
+            };
+            ASSERT_EQUAL(to_string(ast.Execute(values.data())), to_string(ast.ExecuteTree(values.data())));
+        };
+
+        check("1");
+        check("-A1");
+        check("+-+B2");
+        check("A1+B2*C3-A1/B2");
+        check("(A1+B2)*(A1-B2)/-(A1*2)");
+        check("A1/C3");
+        check("1e300*1e300-A1");
+        check("A1/(B2+3)");
+        check("1/(1e300*1e300)");
+        check("0/C3+A1");
+
+        // Deeper than the inline stack of the interpreter.
+        std::string nested = "A1";
+        for (int i = 0; i < 100; ++i) {
+            nested = "B2-(" + nested + ")";
+        }
+        check(nested);
+
+        // The optimized program keeps errors and the sign of zero.
+        for (const char* expression : {
+                "(1+2)*3*A1+0", "1+2*3-4/2", "1/0+A1", "A1*(2-2)", "1e300*1e300+A1", "D4+0", "0+D4", "D4-0",
+                "D4+-0", "-0+D4", "D4--0", "(D4+1)+0", "(D4-1)+0", "D4*D4+0", "D4*1", "1*D4", "D4/1", "D4*-1",
+                "-1*D4", "D4/-1", "C3*-1", "--A1", "---A1", "+-+-A1", "A1--B2", "A1+-B2", "-A1-(-B2)",
+                "-(-(A1+B2))*1/1-0", "MAX(1,2)*A1", "SUM(D4,-0)+0", "MIN(-A1,--B2)/-1", "0/0*A1", "A1/(1-1)",
+            }) {
+            check(expression);
+        }
+        auto code_size = [](const std::string& expression) {
+            return ParseFormulaAST(expression).GetProgram().code.size();
+        };
+        ASSERT_EQUAL(code_size("1+2*3-4/2"), 1u);
+        ASSERT_EQUAL(code_size("+-+-A1*1"), 1u);
+        ASSERT_EQUAL(code_size("A1+-B2"), 3u);
+        ASSERT_EQUAL(code_size("(1+2)*3*A1"), 3u);
+        ASSERT_EQUAL(code_size("(A1+1)+0"), 3u);
+        // 9*A1 is -0 when A1 is, and -0+0 is +0
+        ASSERT_EQUAL(code_size("(1+2)*3*A1+0"), 5u);
+        ASSERT_EQUAL(ParseFormulaAST("1+2*3").GetProgram().numbers.size(), 1u);
+
+        auto ast = ParseFormulaAST("A1*A1+B2");
+        const auto& program = ast.GetProgram();
+        ASSERT_EQUAL(program.code.size(), 5u);
+        ASSERT_EQUAL(std::vector(program.cells.begin(), program.cells.end()), (std::vector{ "A1"_pos, "B2"_pos }));
+        ASSERT_EQUAL(program.max_stack_depth, 2u);
+
+        // Formulas are still printed as typed.
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "=(1+2)*3*B1+0--C1*1");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), std::string("=(1+2)*3*B1+0--C1*1"));
+    }
+
+    void TestTextOperands() {
+        auto sheet = CreateSheet();
+        auto evaluate = [&](const std::string& text) {
+            sheet->SetCell("A1"_pos, text);
+            sheet->SetCell("B1"_pos, "=A1*2");
+            return sheet->GetCell("B1"_pos)->GetValue();
+        };
+
+        ASSERT_EQUAL(evaluate("1.5"), CellInterface::Value(3.0));
+        ASSERT_EQUAL(evaluate("+4"), CellInterface::Value(8.0));
+        ASSERT_EQUAL(evaluate("-.5"), CellInterface::Value(-1.0));
+        ASSERT_EQUAL(evaluate("2e3"), CellInterface::Value(4000.0));
+        ASSERT_EQUAL(evaluate("'"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(evaluate("+-4"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(evaluate("+"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(evaluate("1e999"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        ASSERT_EQUAL(evaluate("abc"), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+        sheet->SetCell("A1"_pos, "=1/0");
+        sheet->SetCell("C1"_pos, "=B1+1");
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Div0)));
+    }
+
+    void TestTiledGrid() {
+        const int tile = TiledGrid<int>::TILE_SIZE;
+        TiledGrid<int> grid;
+        ASSERT(grid.Find({ 0, 0 }) == nullptr);
+        ASSERT(grid.Find({ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }) == nullptr);
+
+        const Position positions[] = {
+            { 0, 0 }, { tile - 1, tile - 1 }, { tile, tile - 1 }, { tile - 1, tile },
+            { Position::MAX_ROWS - 1, 0 }, { 0, Position::MAX_COLS - 1 },
+        };
+        int value = 0;
+        for (const auto& pos : positions) {
+            grid.Emplace(pos, value++);
+        }
+        ASSERT_EQUAL(grid.Size(), 6u);
+        value = 0;
+        for (const auto& pos : positions) {
+            ASSERT(grid.Find(pos) != nullptr);
+            ASSERT_EQUAL(*grid.Find(pos), value++);
+        }
+        ASSERT(grid.Find({ tile, tile }) == nullptr);
+
+        const int* stable = grid.Find({ 0, 0 });
+        for (int col = 1; col < tile; ++col) {
+            grid.Emplace({ 0, col }, col);
+        }
+        ASSERT_EQUAL(grid.Find({ 0, 0 }), stable);
+        grid.Emplace({ 0, 0 }, 42);
+        ASSERT_EQUAL(*stable, 42);
+
+        ASSERT(grid.Erase({ tile, tile - 1 }));
+        ASSERT(!grid.Erase({ tile, tile - 1 }));
+        ASSERT(!grid.Erase({ 2 * tile, 2 * tile }));
+        ASSERT(grid.Find({ tile, tile - 1 }) == nullptr);
+        ASSERT_EQUAL(grid.Size(), 5u + tile - 1);
+
+        // A value in every tile of a 64 x 32 lattice, the size of a cell each:
+        // a tile costs its indices and occupancy bits, some 17 KB, and not a
+        // slot of the value type for each of its 4096 positions.
+        TiledGrid<std::array<char, sizeof(Cell)>> sparse;
+        size_t stored = 0;
+        for (int row = 0; row < Position::MAX_ROWS; row += 4 * tile) {
+            for (int col = 0; col < Position::MAX_COLS; col += 8 * tile) {
+                sparse.Emplace({ row, col });
+                ++stored;
+            }
+        }
+        ASSERT_EQUAL(stored, 2048u);
+        ASSERT(sparse.GetReservedBytes() < stored * 20 * 1024);
+        ASSERT(sparse.GetReservedBytes() > stored * tile * tile * sizeof(uint32_t));
+
+        // Cells straddling tile borders behave like any other.
+        Sheet sheet;
+        sheet.SetCell({ tile - 1, tile - 1 }, "1");
+        sheet.SetCell({ tile, tile }, "=" + Position{ tile - 1, tile - 1 }.ToString() + "+1");
+        ASSERT_EQUAL(sheet.GetCell({ tile, tile })->GetValue(), CellInterface::Value(2.0));
+        sheet.ClearCell({ tile - 1, tile - 1 });
+        ASSERT(std::as_const(sheet).GetCell({ tile - 1, tile - 1 }) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell({ tile, tile })->GetValue(), CellInterface::Value(1.0));
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ tile + 1, tile + 1 }));
+    }
+
+    void TestForEachCell() {
+        Sheet sheet;
+        // Kept in row-major order, as ForEachCell visits them.
+        std::map<std::pair<int, int>, std::string> expected;
+        auto set = [&](Position pos, const std::string& text) {
+            sheet.SetCell(pos, text);
+            expected[{ pos.row, pos.col }] = text;
+        };
+        auto visit = [&sheet](Range range) {
+            std::vector<std::pair<Position, std::string>> visited;
+            sheet.ForEachCell(range, [&visited](Position pos, const CellInterface& cell) {
+                visited.emplace_back(pos, cell.GetText());
+            });
+            return visited;
+        };
+        auto expect = [&expected](Range range) {
+            std::vector<std::pair<Position, std::string>> cells;
+            for (const auto& [pos, text] : expected) {
+                if (range.Contains({ pos.first, pos.second })) {
+                    cells.emplace_back(Position{ pos.first, pos.second }, text);
+                }
+            }
+            return cells;
+        };
+
+        const Range everything{ { 0, 0 }, { Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } };
+        ASSERT(visit(everything).empty());
+        set({ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, "far");
+        ASSERT(visit(everything) == expect(everything));
+
+        std::mt19937 generator(7);
+        std::uniform_int_distribution<int> coordinate(0, 199);
+        for (int i = 0; i < 2000; ++i) {
+            Position pos{ coordinate(generator), coordinate(generator) };
+            if (i % 5 == 0) {
+                sheet.ClearCell(pos);
+                expected.erase({ pos.row, pos.col });
+            }
+            else {
+                set(pos, std::to_string(i));
+            }
+        }
+        // Borders of the tiles, where rows of two tiles meet.
+        for (int col : { 0, 63, 64, 127, 128 }) {
+            set({ 64, col }, "border");
+        }
+        ASSERT(visit(everything) == expect(everything));
+        for (int i = 0; i < 200; ++i) {
+            int rows[] = { coordinate(generator), coordinate(generator) };
+            int cols[] = { coordinate(generator), coordinate(generator) };
+            Range range{ { std::min(rows[0], rows[1]), std::min(cols[0], cols[1]) },
+                { std::max(rows[0], rows[1]), std::max(cols[0], cols[1]) } };
+            ASSERT(visit(range) == expect(range));
+        }
+
+        for (Range invalid : { Range{ { 2, 0 }, { 1, 0 } }, Range{ { 0, 0 }, { 0, Position::MAX_COLS } } }) {
+            try {
+                visit(invalid);
+                ASSERT(false);
+            }
+            catch (const InvalidPositionException&) {
+            }
+        }
+    }
+
+    void TestColumnarValueStore() {
+        using Tag = ColumnarValueStore::Tag;
+        ColumnarValueStore store;
+        ASSERT(store.FindColumn(0) == nullptr);
+        ASSERT(store.GetTag("C10"_pos) == Tag::Empty);
+
+        store.Set("C10"_pos, 2.5);
+        store.Set("C3"_pos, std::string("text"));
+        store.Set("C4"_pos, FormulaError(FormulaError::Category::Div0));
+        store.Set("A1"_pos, FormulaError(FormulaError::Category::Ref));
+        ASSERT(store.GetTag("C10"_pos) == Tag::Number);
+        ASSERT_EQUAL(store.GetNumber("C10"_pos), 2.5);
+        ASSERT(store.GetTag("C3"_pos) == Tag::Text);
+        ASSERT(store.GetTag("C4"_pos) == Tag::Div0Error);
+        ASSERT(store.GetError("C4"_pos) == FormulaError(FormulaError::Category::Div0));
+        ASSERT(store.GetError("A1"_pos) == FormulaError(FormulaError::Category::Ref));
+        ASSERT(store.GetTag("C5"_pos) == Tag::Empty);
+        ASSERT(store.GetTag("B1"_pos) == Tag::Empty);
+
+        const auto* column = store.FindColumn(2);
+        ASSERT(column != nullptr);
+        ASSERT_EQUAL(column->numbers.size(), 10u);
+        ASSERT_EQUAL(column->tags.size(), 10u);
+        ASSERT_EQUAL(column->numbers[9], 2.5);
+
+        store.Set("C10"_pos, std::string("again"));
+        ASSERT(store.GetTag("C10"_pos) == Tag::Text);
+        store.Set("C11"_pos, std::string("-1.5"));
+        ASSERT(store.GetTag("C11"_pos) == Tag::NumericText);
+        ASSERT_EQUAL(store.GetNumber("C11"_pos), -1.5);
+        store.Erase("C4"_pos);
+        store.Erase("Z100"_pos);
+        ASSERT(store.GetTag("C4"_pos) == Tag::Empty);
+
+        // Text values are read back from the cell that holds them.
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "'=escaped");
+        sheet.SetCell("A2"_pos, "=A1");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(std::string("=escaped")));
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+        sheet.SetCell("A1"_pos, "3");
+        ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(std::string("3")));
+        ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(3.0));
+    }
+
+    void TestValueStoreSummaries() {
+        using Tag = ColumnarValueStore::Tag;
+        ColumnarValueStore store;
+        std::mt19937 generator(18);
+        auto random_int = [&](int from, int to) {
+            return std::uniform_int_distribution<int>(from, to)(generator);
+        };
+        const int rows = 700;
+        const int cols = 3;
+
+        // The summaries must agree with a plain scan of the slots.
+        auto check = [&](Range range) {
+            for (auto function : { AggregateFunction::Sum, AggregateFunction::Min, AggregateFunction::Max,
+                     AggregateFunction::Count }) {
+                Aggregate expected(function);
+                std::optional<FormulaError> expected_error;
+                std::vector<Position> expected_pending;
+                for (int col = range.from.col; col <= range.to.col; ++col) {
+                    for (int row = range.from.row; row <= range.to.row; ++row) {
+                        Tag tag = store.GetTag({ row, col });
+                        if (tag == Tag::Number || tag == Tag::NumericText) {
+                            expected.Add(store.GetNumber({ row, col }));
+                        }
+                        else if (tag >= Tag::RefError && !expected_error && function != AggregateFunction::Count) {
+                            expected_error = store.GetError({ row, col });
+                        }
+                        else if (tag == Tag::Pending) {
+                            expected_pending.push_back({ row, col });
+                        }
+                    }
+                }
+                Aggregate actual(function);
+                auto error = store.Accumulate(range, actual);
+                ASSERT_EQUAL(error.has_value(), expected_error.has_value());
+                if (error) {
+                    ASSERT(*error == *expected_error);
+                }
+                else {
+                    ASSERT_EQUAL(actual.GetResult(), expected.GetResult());
+                }
+                auto pending = store.FindPending(range);
+                std::sort(pending.begin(), pending.end());
+                std::sort(expected_pending.begin(), expected_pending.end());
+                ASSERT(pending == expected_pending);
+            }
+        };
+
+        for (int step = 0; step < 3000; ++step) {
+            Position pos{ random_int(0, rows - 1), random_int(0, cols - 1) };
+            switch (random_int(0, 9)) {
+            case 0:
+                store.Set(pos, std::string("text"));
+                break;
+            case 1:
+                store.Set(pos, std::to_string(random_int(-9, 9)));
+                break;
+            case 2:
+                store.Set(pos, FormulaError(random_int(0, 1) ? FormulaError::Category::Div0 : FormulaError::Category::Ref));
+                break;
+            case 3:
+                store.SetPending(pos);
+                break;
+            case 4:
+                store.Erase(pos);
+                break;
+            default:
+                store.Set(pos, static_cast<double>(random_int(-1000, 1000)));
+            }
+            if (step % 10 == 0) {
+                Position from{ random_int(0, rows), random_int(0, cols - 1) };
+                Position to{ random_int(from.row, rows + 50), random_int(from.col, cols) };
+                check({ from, to });
+            }
+        }
+        check({ { 0, 0 }, { rows - 1, cols - 1 } });
+        check({ { 64, 0 }, { 127, 0 } });
+    }
+
+    void TestUnchangedEdit() {
+        Sheet sheet;
+        sheet.SetCell("B1"_pos, "=A1+1");
+        sheet.SetCell("C1"_pos, "=B1*2");
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 2u);
+
+        // Setting the text a cell already has is a no-op.
+        const CellInterface* formula = sheet.GetCell("B1"_pos);
+        sheet.SetCell("B1"_pos, "=A1+1");
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 2u);
+        sheet.SetCell("A1"_pos, "1");
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 2u);
+
+        // Formulas compare by their printed form.
+        sheet.SetCell("B1"_pos, "=(A1)+1");
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 1u);
+        ASSERT_EQUAL(sheet.GetCell("B1"_pos), formula);
+        ASSERT_EQUAL(formula->GetText(), std::string("=A1+1"));
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+
+        sheet.ApplyBatch({ { "A1"_pos, "1" }, { "B1"_pos, "=A1+1" } });
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 0u);
+        sheet.ApplyBatch({ { "A1"_pos, "1" }, { "B1"_pos, "=A1+2" } });
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 2u);
+        ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+    }
+
+    void TestSheetArena() {
+        Sheet sheet;
+        ASSERT_EQUAL(sheet.GetAllocatorStats().objects_in_use, 0u);
+
+        const int rows = 1000;
+        auto fill = [&] {
+            for (int row = 1; row < rows; ++row) {
+                // distinct constants keep the formulas from sharing a tree
+                sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "*" + std::to_string(row) + "+1");
+                sheet.SetCell(Position{ row, 1 }, "text");
+            }
+        };
+        fill();
+        auto loaded = sheet.GetAllocatorStats();
+        ASSERT(loaded.objects_in_use > 2 * (rows - 1));
+        ASSERT(loaded.bytes_in_use > 0);
+        ASSERT(loaded.chunks * 100 < loaded.objects_in_use);
+        ASSERT(loaded.bytes_reserved >= loaded.bytes_in_use);
+
+        for (int row = 1; row < rows; ++row) {
+            sheet.ClearCell(Position{ row, 0 });
+            sheet.ClearCell(Position{ row, 1 });
+        }
+        auto cleared = sheet.GetAllocatorStats();
+        ASSERT_EQUAL(cleared.objects_in_use, 0u);
+        ASSERT_EQUAL(cleared.bytes_in_use, 0u);
+        ASSERT_EQUAL(cleared.allocations, loaded.allocations);
+
+        // Freed blocks are reused before new chunks are taken.
+        fill();
+        ASSERT_EQUAL(sheet.GetAllocatorStats().objects_in_use, loaded.objects_in_use);
+        ASSERT_EQUAL(sheet.GetAllocatorStats().chunks, loaded.chunks);
+        ASSERT_EQUAL(sheet.GetCell("A3"_pos)->GetValue(), CellInterface::Value(3.0));
+    }
+
+    void TestStringPool() {
+        {
+            StringPool pool;
+            auto first = pool.Intern("label");
+            auto second = pool.Intern(std::string("lab") + "el");
+            ASSERT_EQUAL(first.GetText().data(), second.GetText().data());
+            ASSERT_EQUAL(pool.GetSize(), 1u);
+
+            auto escaped = pool.Intern("'=1+2");
+            ASSERT_EQUAL(escaped.GetText(), std::string_view("'=1+2"));
+            ASSERT_EQUAL(escaped.GetValue(), std::string_view("=1+2"));
+            ASSERT_EQUAL(pool.GetSize(), 2u);
+
+            StringPool::Handle copy = escaped;
+            escaped = StringPool::Handle();
+            ASSERT_EQUAL(pool.GetSize(), 2u);
+            ASSERT(escaped.GetValue().empty());
+            copy = first;
+            ASSERT_EQUAL(pool.GetSize(), 1u);
+        }
+
+        Sheet sheet;
+        for (int row = 0; row < 100; ++row) {
+            sheet.SetCell(Position{ row, 0 }, "total");
+            sheet.SetCell(Position{ row, 1 }, "'total");
+        }
+        ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 2u);
+        ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetText(), std::string("'total"));
+        ASSERT_EQUAL(sheet.GetCell("B7"_pos)->GetValue(), CellInterface::Value(std::string("total")));
+
+        std::ostringstream values;
+        sheet.PrintValues(values);
+        ASSERT_EQUAL(values.str().substr(0, 12), std::string("total\ttotal\n"));
+
+        sheet.SetCell("A1"_pos, "other");
+        ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 3u);
+        for (int row = 0; row < 100; ++row) {
+            sheet.ClearCell(Position{ row, 1 });
+        }
+        ASSERT_EQUAL(sheet.GetStringPool().GetSize(), 2u);
+    }
+
+    void TestSharedFormulas() {
+        Sheet sheet;
+        const int rows = 1000;
+        for (int row = 0; row < rows; ++row) {
+            std::string n = std::to_string(row + 1);
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+            sheet.SetCell(Position{ row, 1 }, "2");
+            sheet.SetCell(Position{ row, 2 }, "=A" + n + "*B" + n + "+1");
+        }
+        const auto& formulas = sheet.GetFormulaTable();
+        ASSERT_EQUAL(formulas.GetSize(), 1u);
+        ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetText(), std::string("=A500*B500+1"));
+        ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetValue(), CellInterface::Value(999.0));
+        ASSERT_EQUAL(sheet.GetCell("C500"_pos)->GetReferencedCells(), (std::vector{ "A500"_pos, "B500"_pos }));
+
+        // The shared tree is evaluated with each cell's own references.
+        sheet.SetCell("B10"_pos, "3");
+        ASSERT_EQUAL(sheet.GetCell("C10"_pos)->GetValue(), CellInterface::Value(28.0));
+        ASSERT_EQUAL(sheet.GetCell("C11"_pos)->GetValue(), CellInterface::Value(21.0));
+
+        // Absolute positions make formulas differ; so do other spellings.
+        sheet.SetCell("D1"_pos, "=A1+B1");
+        sheet.SetCell("D2"_pos, "=A1+B2");
+        sheet.SetCell("D3"_pos, "=A3 + B3");
+        sheet.SetCell("D4"_pos, "=A4+B4");
+        ASSERT_EQUAL(formulas.GetSize(), 4u);
+        ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetText(), std::string("=A4+B4"));
+        ASSERT_EQUAL(sheet.GetCell("D4"_pos)->GetValue(), CellInterface::Value(5.0));
+
+        // Numbers with exponents are not taken for references.
+        sheet.SetCell("E1"_pos, "=1E2+A1");
+        sheet.SetCell("E2"_pos, "=1E2+A2");
+        ASSERT_EQUAL(formulas.GetSize(), 5u);
+        ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetValue(), CellInterface::Value(101.0));
+
+        // Shifting may not make a reference invalid: such formulas fail alone.
+        bool thrown = false;
+        try {
+            sheet.SetCell("F1"_pos, "=A0");
+        }
+        catch (const FormulaException&) {
+            thrown = true;
+        }
+        ASSERT(thrown);
+
+        // Text spelling a key, here that of G1 =F1, is parsed and rejected.
+        sheet.SetCell("G1"_pos, "=F1");
+        for (const std::string text : { "={0,-1}", "=A1+{0,-1}", "=a1" }) {
+            thrown = false;
+            try {
+                sheet.SetCell("H1"_pos, text);
+            }
+            catch (const FormulaException&) {
+                thrown = true;
+            }
+            ASSERT(thrown);
+            ASSERT(sheet.GetCell("H1"_pos) == nullptr);
+
+            Sheet imported;
+            thrown = false;
+            try {
+                imported.ImportTexts("\t=A1\t" + text + "\n");
+            }
+            catch (const FormulaException&) {
+                thrown = true;
+            }
+            ASSERT(thrown);
+            ASSERT_EQUAL(imported.GetPrintableSize(), (Size{ 0, 0 }));
+        }
+        sheet.ClearCell("G1"_pos);
+
+        // Entries go away with the last cell using them.
+        for (int row = 0; row < rows; ++row) {
+            sheet.ClearCell(Position{ row, 2 });
+        }
+        ASSERT_EQUAL(formulas.GetSize(), 4u);
+    }
+
+    void TestRangeFunctions() {
+        auto expect_formula_error = [](const std::string& expression) {
+            Sheet sheet;
+            try {
+                sheet.SetCell("Z1"_pos, expression);
+                AssertEqual(true, false, "formula: " + expression);
+            }
+            catch (const FormulaException&) {
+            }
+        };
+        expect_formula_error("=A1:B2");
+        expect_formula_error("=SUM()");
+        expect_formula_error("=FOO(1)");
+        expect_formula_error("=-A1:A2");
+        expect_formula_error("=SUM(A1:A2)+A3:A4");
+
+        Sheet sheet;
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "2");
+        sheet.SetCell("A3"_pos, "text");
+        sheet.SetCell("A4"_pos, "'=1");
+        sheet.SetCell("B1"_pos, "4");
+        sheet.SetCell("B3"_pos, "=A1*10");
+        auto value = [&](const std::string& expression) {
+            sheet.SetCell("D1"_pos, expression);
+            return sheet.GetCell("D1"_pos)->GetValue();
+        };
+
+        // Numbers typed into cells count, other text and empty cells inside a
+        // range are skipped; plain arguments count as numbers.
+        ASSERT_EQUAL(value("=SUM( B4 : A1 , 3 )"), CellInterface::Value(20.0));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), std::string("=SUM(A1:B4,3)"));
+        ASSERT(sheet.GetCell("D1"_pos)->GetReferencedCells().empty());
+        ASSERT_EQUAL(value("=AVERAGE(A1:B4)"), CellInterface::Value(4.25));
+        ASSERT_EQUAL(value("=MIN(A1:B4)"), CellInterface::Value(1.0));
+        ASSERT_EQUAL(value("=MAX(A1:B4,-1)"), CellInterface::Value(10.0));
+        ASSERT_EQUAL(value("=COUNT(A1:B4)"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(value("=MAX(C1:C9)"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value("=AVERAGE(C1:C9)"), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(value("=SUM(A1:A2,MAX(B1:B3)*2)-1"), CellInterface::Value(22.0));
+        ASSERT_EQUAL(value("=SUM(A1:A2,A1:A2)"), CellInterface::Value(6.0));
+
+        // Errors spoil every function but COUNT.
+        sheet.SetCell("B2"_pos, "=1/0");
+        ASSERT_EQUAL(value("=SUM(A1:B4)"), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(value("=MIN(A1:B4)"), CellInterface::Value(FormulaError::Category::Div0));
+        ASSERT_EQUAL(value("=COUNT(A1:B4)"), CellInterface::Value(4.0));
+        ASSERT_EQUAL(value("=SUM(A1:A4)"), CellInterface::Value(3.0));
+
+        // A formula evaluated apart from the sheet storage reads cells one by
+        // one, with the same result.
+        auto formula = ParseFormula("AVERAGE(A1:A4,B1)");
+        ASSERT_EQUAL(std::get<double>(formula->Evaluate(sheet)), 7.0 / 3);
+        ASSERT_EQUAL(std::get<FormulaError>(ParseFormula("MAX(A1:B2)")->Evaluate(sheet)),
+            FormulaError(FormulaError::Category::Div0));
+    }
+
+    void TestRangeRecalculation() {
+        for (auto mode : { EvaluationMode::Eager, EvaluationMode::Lazy }) {
+            Sheet sheet(mode);
+            sheet.SetCell("C1"_pos, "=SUM(A1:B3)");
+            sheet.SetCell("C2"_pos, "=C1*2");
+            ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(0.0));
+
+            // New, changed and cleared cells inside the range.
+            sheet.SetCell("A1"_pos, "1");
+            sheet.SetCell("B3"_pos, "2");
+            ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(6.0));
+            sheet.SetCell("A1"_pos, "5");
+            ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(7.0));
+            sheet.ClearCell("B3"_pos);
+            ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(10.0));
+
+            // Formulas inside the range, including ones set after the reader.
+            sheet.SetCell("B1"_pos, "=A1+D1");
+            sheet.SetCell("D1"_pos, "3");
+            ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(26.0));
+            sheet.SetCell("A2"_pos, "=E1");
+            sheet.SetCell("E1"_pos, "=SUM(D1:D2)*10");
+            ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(43.0));
+
+            // A range around the formula itself, or around its dependents,
+            // closes a cycle.
+            for (const auto& [pos, text] : { std::pair{ "A3"_pos, "=SUM(A1:A3)" }, std::pair{ "B2"_pos, "=C2" },
+                     std::pair{ "D2"_pos, "=MAX(A1:C3)" } }) {
+                try {
+                    sheet.SetCell(pos, text);
+                    AssertEqual(true, false, text);
+                }
+                catch (const CircularDependencyException&) {
+                }
+            }
+            ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetValue(), CellInterface::Value(43.0));
+        }
+
+        // Filled down, a range formula shares one compiled tree.
+        Sheet sheet;
+        const int rows = 100;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Position{ row, 0 }, std::to_string(row));
+        }
+        for (int row = 2; row < rows; ++row) {
+            std::string n = std::to_string(row + 1);
+            sheet.SetCell(Position{ row, 1 }, "=SUM(A" + std::to_string(row - 1) + ":A" + n + ")");
+        }
+        ASSERT_EQUAL(sheet.GetFormulaTable().GetSize(), 1u);
+        ASSERT_EQUAL(sheet.GetCell("B50"_pos)->GetValue(), CellInterface::Value(144.0));
+        sheet.SetCell("A49"_pos, "0");
+        ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 3u);
+        ASSERT_EQUAL(sheet.GetCell("B50"_pos)->GetValue(), CellInterface::Value(96.0));
+
+        // Waves of range readers in parallel.
+        auto fill = [](Sheet& sheet) {
+            for (int col = 0; col < 20; ++col) {
+                sheet.SetCell(Position{ 0, col }, "=A100+" + std::to_string(col));
+                for (int row = 1; row < 30; ++row) {
+                    Position from{ row - 1, std::max(col - 1, 0) };
+                    Position to{ row - 1, col + 1 };
+                    sheet.SetCell(Position{ row, col }, "=AVERAGE(" + from.ToString() + ":" + to.ToString() + ")+1");
+                }
+            }
+        };
+        Sheet sequential;
+        Sheet parallel;
+        parallel.SetRecalculationThreads(4);
+        fill(sequential);
+        fill(parallel);
+        for (const auto& value : { "1", "=1/0", "-7" }) {
+            sequential.SetCell("A100"_pos, value);
+            parallel.SetCell("A100"_pos, value);
+            std::ostringstream expected;
+            std::ostringstream actual;
+            sequential.PrintValues(expected);
+            parallel.PrintValues(actual);
+            ASSERT_EQUAL(actual.str(), expected.str());
+        }
+    }
+
+    void TestImportTexts() {
+        // Forward and backward references, shared formulas, ranges, errors,
+        // escaped and numeric texts, and holes.
+        auto fill = [](Sheet& sheet) {
+            sheet.SetCell("A1"_pos, "=C5*2");
+            sheet.SetCell("B1"_pos, "'=not a formula");
+            sheet.SetCell("C1"_pos, "12");
+            sheet.SetCell("E1"_pos, "=SUM(C1:C5)+COUNT(A2:A6)");
+            for (int row = 1; row < 6; ++row) {
+                sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+C" + std::to_string(row + 1));
+                sheet.SetCell(Position{ row, 2 }, std::to_string(row * 1.5));
+            }
+            sheet.SetCell("B3"_pos, "=1/0");
+            sheet.SetCell("B4"_pos, "=B3+1");
+            sheet.SetCell("D7"_pos, "text");
+        };
+        auto print = [](const Sheet& sheet) {
+            std::ostringstream output;
+            sheet.PrintTexts(output);
+            output << "--\n";
+            sheet.PrintValues(output);
+            return output.str();
+        };
+
+        Sheet expected;
+        fill(expected);
+        std::ostringstream texts;
+        expected.PrintTexts(texts);
+        for (auto mode : { EvaluationMode::Eager, EvaluationMode::Lazy }) {
+            for (size_t threads : { 1, 4 }) {
+                Sheet sheet(mode);
+                sheet.SetRecalculationThreads(threads);
+                sheet.ImportTexts(texts.str());
+                ASSERT_EQUAL(sheet.GetPrintableSize(), expected.GetPrintableSize());
+                ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), mode == EvaluationMode::Eager ? 9u : 0u);
+                ASSERT_EQUAL(print(sheet), print(expected));
+                // A2:A6 is one formula filled down.
+                ASSERT_EQUAL(sheet.GetFormulaTable().GetSize(), 5u);
+
+                sheet.SetCell("C6"_pos, "1");
+                expected.SetCell("C6"_pos, "1");
+                ASSERT_EQUAL(print(sheet), print(expected));
+                expected.SetCell("C6"_pos, std::to_string(5 * 1.5));
+            }
+        }
+
+        // Larger than a chunk, so rows are numbered across several of them.
+        std::string large;
+        for (int row = 0; row < 14000; ++row) {
+            for (int col = 0; col < 8; ++col) {
+                large += col == 0 ? std::to_string(row) : "=" + Position{ row, col - 1 }.ToString() + "+1";
+                large += col == 7 ? '\n' : '\t';
+            }
+        }
+        Sheet large_sheet;
+        large_sheet.SetRecalculationThreads(4);
+        large_sheet.ImportTexts(large);
+        ASSERT_EQUAL(large_sheet.GetPrintableSize(), (Size{ 14000, 8 }));
+        ASSERT_EQUAL(large_sheet.GetCell("H14000"_pos)->GetValue(), CellInterface::Value(14006.0));
+        std::ostringstream large_texts;
+        large_sheet.PrintTexts(large_texts);
+        ASSERT_EQUAL(large_texts.str(), large);
+
+        // The parsed trees go away with the formulas, and their arenas with them.
+        const auto imported = large_sheet.GetAllocatorStats();
+        for (int row = 0; row < 14000; ++row) {
+            for (int col = 1; col < 8; ++col) {
+                large_sheet.ClearCell(Position{ row, col });
+            }
+        }
+        const auto cleared = large_sheet.GetAllocatorStats();
+        ASSERT_EQUAL(large_sheet.GetFormulaTable().GetSize(), 0u);
+        ASSERT(cleared.chunks < imported.chunks);
+        ASSERT(cleared.bytes_reserved < imported.bytes_reserved);
+
+        auto expect_failure = [](Sheet& sheet, const std::string& texts, bool circular) {
+            try {
+                sheet.ImportTexts(texts);
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException&) {
+                ASSERT(circular);
+            }
+            catch (const FormulaException&) {
+                ASSERT(!circular);
+            }
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+            ASSERT_EQUAL(sheet.GetFormulaTable().GetSize(), 0u);
+        };
+        Sheet failed;
+        expect_failure(failed, "1\t=A1+\n", false);
+        expect_failure(failed, "=ZZZZ1\n", false);
+        expect_failure(failed, "=B2\t1\n\t=A1\n", true);
+        expect_failure(failed, "1\n=SUM(A1:A3)\n", true);
+        failed.ImportTexts("1\n=SUM(A1:A1)\n");
+        ASSERT_EQUAL(failed.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+
+        try {
+            failed.ImportTexts("2\n");
+            ASSERT(false);
+        }
+        catch (const std::logic_error&) {
+        }
+
+        const std::string path = "spreadsheet_import_test.txt";
+        {
+            std::ofstream file(path, std::ios::binary);
+            file << texts.str();
+        }
+        Sheet loaded;
+        loaded.LoadTexts(path);
+        std::remove(path.c_str());
+        ASSERT_EQUAL(print(loaded), print(expected));
+        try {
+            Sheet().LoadTexts(path);
+            ASSERT(false);
+        }
+        catch (const std::system_error&) {
+        }
+    }
+
+    void TestSnapshot() {
+        auto fill = [](Sheet& sheet) {
+            sheet.SetCell("A1"_pos, "=C5*2");
+            sheet.SetCell("B1"_pos, "'=not a formula");
+            sheet.SetCell("C1"_pos, "12");
+            sheet.SetCell("E1"_pos, "=SUM(C1:C5)+COUNT(A2:A6)");
+            for (int row = 1; row < 6; ++row) {
+                sheet.SetCell(Position{ row, 0 }, "=A" + std::to_string(row) + "+C" + std::to_string(row + 1));
+                sheet.SetCell(Position{ row, 2 }, std::to_string(row * 1.5));
+            }
+            sheet.SetCell("B3"_pos, "=1/0");
+            sheet.SetCell("B4"_pos, "=B3+1");
+            // F9 exists only as a referenced empty cell.
+            sheet.SetCell("D7"_pos, "=F9+1");
+            sheet.SetCell("E7"_pos, "text");
+        };
+        auto print = [](const Sheet& sheet) {
+            std::ostringstream output;
+            sheet.PrintTexts(output);
+            output << "--\n";
+            sheet.PrintValues(output);
+            return output.str();
+        };
+        auto pending = [](const Sheet& sheet) {
+            std::string result;
+            for (int row = 0; row < 10; ++row) {
+                for (int col = 0; col < 6; ++col) {
+                    result += sheet.GetValueStore().GetTag({ row, col }) == ColumnarValueStore::Tag::Pending ? '1' : '0';
+                }
+            }
+            return result;
+        };
+
+        for (auto mode : { EvaluationMode::Eager, EvaluationMode::Lazy }) {
+            Sheet original(mode);
+            fill(original);
+            // Leaves some cells of a lazy sheet evaluated and others dirty.
+            original.GetCell("A3"_pos)->GetValue();
+            std::ostringstream snapshot;
+            original.WriteSnapshot(snapshot);
+
+            Sheet sheet(mode);
+            sheet.ReadSnapshot(snapshot.str());
+            ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), 0u);
+            ASSERT_EQUAL(sheet.GetPrintableSize(), original.GetPrintableSize());
+            ASSERT_EQUAL(sheet.GetFormulaTable().GetSize(), original.GetFormulaTable().GetSize());
+            ASSERT_EQUAL(pending(sheet), pending(original));
+            ASSERT(sheet.GetCell("F9"_pos) != nullptr);
+            ASSERT_EQUAL(print(sheet), print(original));
+
+            // The restored graph recalculates like the one it was saved from.
+            const std::pair<Position, std::string> edits[] = { { "C6"_pos, "1" }, { "C1"_pos, "=B4" }, { "F9"_pos, "3" } };
+            for (const auto& [pos, text] : edits) {
+                sheet.SetCell(pos, text);
+                original.SetCell(pos, text);
+                ASSERT_EQUAL(sheet.GetLastRecalculatedCellsCount(), original.GetLastRecalculatedCellsCount());
+                ASSERT_EQUAL(print(sheet), print(original));
+            }
+            try {
+                sheet.SetCell("C5"_pos, "=A1");
+                ASSERT(false);
+            }
+            catch (const CircularDependencyException&) {
+            }
+        }
+
+        // Cells a lazy sheet left dirty, texts included, are evaluated on
+        // reading into an eager one.
+        Sheet lazy(EvaluationMode::Lazy);
+        fill(lazy);
+        std::ostringstream lazy_snapshot;
+        lazy.WriteSnapshot(lazy_snapshot);
+        Sheet eager;
+        eager.ReadSnapshot(lazy_snapshot.str());
+        ASSERT_EQUAL(eager.GetLastRecalculatedCellsCount(), 18u);
+        ASSERT_EQUAL(pending(eager), std::string(60, '0'));
+        ASSERT_EQUAL(print(eager), print(lazy));
+
+        Sheet empty;
+        std::ostringstream empty_snapshot;
+        empty.WriteSnapshot(empty_snapshot);
+        Sheet empty_copy;
+        empty_copy.ReadSnapshot(empty_snapshot.str());
+        ASSERT_EQUAL(empty_copy.GetPrintableSize(), (Size{ 0, 0 }));
+
+        const std::string valid = lazy_snapshot.str();
+        auto expect_failure = [](const std::string& snapshot) {
+            Sheet sheet;
+            try {
+                sheet.ReadSnapshot(snapshot);
+                ASSERT(false);
+            }
+            catch (const SnapshotError&) {
+            }
+            ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+            ASSERT_EQUAL(sheet.GetFormulaTable().GetSize(), 0u);
+            ASSERT(sheet.GetCell("A1"_pos) == nullptr);
+        };
+        std::string corrupted = valid;
+        corrupted[0] = 'X';
+        expect_failure(corrupted);
+        // The version follows the eight bytes of the magic.
+        corrupted = valid;
+        ++corrupted[8];
+        expect_failure(corrupted);
+        expect_failure(valid.substr(0, valid.size() / 2));
+        expect_failure(valid.substr(0, 4));
+        // Flip bytes from the end: the values, the order, cells...
+        for (size_t i = 1; i <= 512 && i < valid.size(); i += 7) {
+            corrupted = valid;
+            corrupted[valid.size() - i] = '\xff';
+            Sheet sheet;
+            try {
+                sheet.ReadSnapshot(corrupted);
+            }
+            catch (const SnapshotError&) {
+                ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+            }
+        }
+
+        // A cycle the sheet would never let in: the text of B1 becomes a
+        // formula with the tree of B2, so A1 =B1 and B1 =A1.
+        Sheet acyclic;
+        acyclic.SetCell("A1"_pos, "=B1");
+        acyclic.SetCell("B1"_pos, "5");
+        acyclic.SetCell("B2"_pos, "=A2");
+        std::ostringstream acyclic_snapshot;
+        acyclic.WriteSnapshot(acyclic_snapshot);
+        std::string cyclic = acyclic_snapshot.str();
+        SnapshotReader reader(cyclic);
+        const auto trees = reader.GetSection<SnapshotTree>(SnapshotSection::Trees);
+        const auto tree = std::find_if(trees.begin(), trees.end(), [](const SnapshotTree& tree) {
+            return tree.anchor_row == 1 && tree.anchor_col == 1;
+        });
+        const auto records = reader.GetSection<SnapshotCell>(SnapshotSection::Cells);
+        const auto record = std::find_if(records.begin(), records.end(), [](const SnapshotCell& record) {
+            return record.row == 0 && record.col == 1;
+        });
+        ASSERT(tree != trees.end() && record != records.end() && record->kind == SnapshotCell::Text);
+        SnapshotCell patched = *record;
+        patched.kind = SnapshotCell::Formula;
+        patched.index = static_cast<std::uint32_t>(tree - trees.begin());
+        std::copy_n(reinterpret_cast<const char*>(&patched), sizeof(patched),
+            cyclic.begin() + (reinterpret_cast<const char*>(record) - cyclic.data()));
+        expect_failure(cyclic);
+
+        try {
+            eager.ReadSnapshot(valid);
+            ASSERT(false);
+        }
+        catch (const std::logic_error&) {
+        }
+
+        const std::string path = "spreadsheet_snapshot_test.bin";
+        lazy.SaveSnapshot(path);
+        Sheet loaded(EvaluationMode::Lazy);
+        loaded.LoadSnapshot(path);
+        std::remove(path.c_str());
+        ASSERT_EQUAL(pending(loaded), pending(lazy));
+        ASSERT_EQUAL(print(loaded), print(lazy));
+    }
+
+    void TestPrintingMatchesStreams() {
+        // What PrintValues and PrintTexts wrote cell by cell through a stream.
+        auto print_slowly = [](const Sheet& sheet, bool values) {
+            std::ostringstream output;
+            Size size = sheet.GetPrintableSize();
+            for (int row = 0; row < size.rows; ++row) {
+                for (int col = 0; col < size.cols; ++col) {
+                    if (const CellInterface* cell = sheet.GetCell({ row, col })) {
+                        if (values) {
+                            output << cell->GetValue();
+                        }
+                        else {
+                            output << cell->GetText();
+                        }
+                    }
+                    output << (col == size.cols - 1 ? '\n' : '\t');
+                }
+            }
+            return output.str();
+        };
+
+        for (auto mode : { EvaluationMode::Eager, EvaluationMode::Lazy }) {
+            for (size_t threads : { 1, 4 }) {
+                Sheet sheet(mode);
+                sheet.SetRecalculationThreads(threads);
+                const char* formulas[] = { "=1/3", "=123456789", "=1234567", "=123456", "=1E-7", "=0.0001",
+                    "=-0", "=1E300*10", "=-2.5", "=1E15+0.3", "=B1/0" };
+                int row = 0;
+                for (const char* formula : formulas) {
+                    sheet.SetCell(Position{ row++, 1 }, formula);
+                }
+                sheet.SetCell("A1"_pos, "'=text");
+                sheet.SetCell("A2"_pos, "12.50");
+                sheet.SetCell("A3"_pos, "=A1+1");
+                sheet.SetCell("D3"_pos, "=SUM(A1:B12)+F20");
+                // Wider than a chunk, spanning several of them, with holes.
+                for (int r = 0; r < 2000; r += 3) {
+                    for (int c = 0; c < 40; c += 1 + r % 5) {
+                        sheet.SetCell(Position{ 20 + r, c }, (r + c) % 4 == 0 ? "=" + Position{ 19 + r, c }.ToString() + "/7" : std::to_string(r * c));
+                    }
+                }
+
+                std::ostringstream values;
+                sheet.PrintValues(values);
+                ASSERT_EQUAL(values.str(), print_slowly(sheet, true));
+                std::ostringstream texts;
+                sheet.PrintTexts(texts);
+                ASSERT_EQUAL(texts.str(), print_slowly(sheet, false));
+            }
+        }
+
+        Sheet empty;
+        std::ostringstream output;
+        empty.PrintValues(output);
+        empty.PrintTexts(output);
+        ASSERT(output.str().empty());
+    }
+
+    void TestPrattParserMatchesAntlr() {
+        enum class Outcome { Parsed, InvalidPosition, SyntaxError };
+        auto parse = [](auto parser, const std::string& expression, std::string& tree) {
+            try {
+                auto ast = parser(expression);
+                std::ostringstream out;
+                ast.Print(out);
+                out << " | ";
+                ast.PrintFormula(out);
+                out << " | ";
+                ast.PrintCells(out);
+                tree = out.str();
+                return Outcome::Parsed;
+            }
+            catch (const FormulaException&) {
+                return Outcome::InvalidPosition;
+            }
+            catch (...) {
+                return Outcome::SyntaxError;
+            }
+        };
+        size_t parsed_count = 0;
+        auto check = [&](const std::string& expression) {
+            std::string expected_tree;
+            std::string tree;
+            auto expected = parse([](const std::string& in) { return ParseFormulaASTWithAntlr(in); }, expression, expected_tree);
+            auto outcome = parse([](const std::string& in) { return ParseFormulaAST(in); }, expression, tree);
+            AssertEqual(static_cast<int>(outcome), static_cast<int>(expected), "formula: " + expression);
+            AssertEqual(tree, expected_tree, "formula: " + expression);
+            parsed_count += outcome == Outcome::Parsed;
+        };
+
+        for (const char* expression : {
+                "1", "1.5", ".5", "1e5", "1E-5", "2.5e+3", "1.", "1e", "1e+", "1.e5", "..5", "1e999", "1e-400",
+                "A1", "ZZ99", "a1", "A", "1A", "A1B2", "X0", "A123456", "XFD16384", "XFD16385",
+                "-A1*2", "--1", "+-+B2", "-(1+2)", "1--2", "1-+-2", "1 - 2 - 3", "8/4/2", "2*3+4*5",
+                "(1+2)*(3-4)/5", "((((1))))", "((1)", "(1))", "()", "", " ", " \t1 +\r\n2 ", "1 2", "1+", "*1",
+                "2+4-", "A0++", "3X", "1 % 2", "1+2;",
+                "SUM(A1:B2)", "SUM( B2 : A1 ,3)", "A1:B2", "SUM()", "FOO(1)", "sum(A1)", "SUM(A0:B1)", "SUM((A1:A2))",
+                "SUM(A1:A2+1)", "-SUM(A1:A2)*2", "MAX(SUM(A1:A3),2)", "A1:", "A1:B", "SUM(A1:B2", "SUM(1,)", "SUM 1",
+                "AVERAGE(A1:XFD16384)", "COUNT(A1:B2:C3)",
+            }) {
+            check(expression);
+        }
+
+        std::mt19937 generator(2024);
+        auto random_index = [&](size_t size) {
+            return std::uniform_int_distribution<size_t>(0, size - 1)(generator);
+        };
+
+        // Well-formed formulas with random structure and spacing.
+        const std::string atoms[] = { "1", "0.25", ".5", "3e2", "7E-1", "A1", "B12", "AA7", "XFD16384", "SUM(A1:B2)",
+            "MIN(C3,B1:B12)" };
+        const std::string spaces[] = { "", "", " ", "\t" };
+        std::function<std::string(int)> make_formula = [&](int depth) -> std::string {
+            switch (depth == 0 ? 0 : random_index(4)) {
+            case 0:
+                return atoms[random_index(std::size(atoms))];
+            case 1:
+                return std::string(1, "+-"[random_index(2)]) + spaces[random_index(4)] + make_formula(depth - 1);
+            case 2:
+                return "(" + make_formula(depth - 1) + ")";
+            default:
+                return make_formula(depth - 1) + spaces[random_index(4)] + "+-*/"[random_index(4)]
+                    + spaces[random_index(4)] + make_formula(depth - 1);
+            }
+        };
+        for (int i = 0; i < 500; ++i) {
+            check(make_formula(5));
+        }
+
+        // Mostly malformed ones.
+        const std::string alphabet = "019.eE+-*/() AZ:,";
+        for (int i = 0; i < 2000; ++i) {
+            std::string expression;
+            for (size_t length = random_index(10) + 1; length > 0; --length) {
+                expression += alphabet[random_index(alphabet.size())];
+            }
+            check(expression);
+        }
+        ASSERT(parsed_count > 500);
+    }
+
 }  // namespace
 
-int main() {
+namespace {
+    // Formula evaluation with cell values already collected: the tree walker
+    // against the compiled program on a long chain, a deeply nested formula,
+    // a short typical one and one with constant parts the compiler folds.
+    void BenchmarkFormulaExecution(BenchmarkRunner& br) {
+        std::unordered_map<Position, double, PositionHasher> values_to_cells;
+        std::string wide;
+        std::string deep = "A1";
+        for (int i = 0; i < 64; ++i) {
+            Position lhs{ i, 0 };
+            Position rhs{ i, 1 };
+            values_to_cells[lhs] = i + 1;
+            values_to_cells[rhs] = 1.0 / (i + 1);
+            wide += (i == 0 ? "" : "+") + lhs.ToString() + "*" + rhs.ToString();
+            deep = rhs.ToString() + "-(" + deep + ")*" + lhs.ToString() + "/64";
+        }
+
+        const std::pair<std::string, std::string> formulas[] = {
+            { "wide", wide },
+            { "deep", deep },
+            { "small", "(A1+B1)*2/A2" },
+            { "generated", "(1+2)*3*A1+4*5-(-(-B1))*1/1+0*2" },
+        };
+        for (const auto& [name, expression] : formulas) {
+            auto ast = ParseFormulaAST(expression);
+            std::vector<double> values;
+            for (const auto& pos : ast.GetProgram().cells) {
+                values.push_back(values_to_cells.at(pos));
+            }
+
+            const size_t iterations = 2'000'000 / ast.GetProgram().code.size();
+            br.Measure("tree/" + name, iterations, [&] {
+                DoNotOptimize(ast.ExecuteTree(values.data()));
+            });
+            br.Measure("bytecode/" + name, iterations, [&] {
+                DoNotOptimize(ast.Execute(values.data()));
+            });
+        }
+    }
+
+    // Recalculation of a column of formulas that read one cell, switching it
+    // between a number and an error; the error case used to unwind once per
+    // formula.
+    void BenchmarkErrorPropagation(BenchmarkRunner& br) {
+        const int rows = 4096;
+        auto sheet = CreateSheet();
+        for (int row = 1; row < rows; ++row) {
+            sheet->SetCell(Position{ row, 0 }, "=A1*2+" + std::to_string(row));
+        }
+
+        for (const auto& [name, source] : { std::pair{ "number", "=1+1" }, std::pair{ "error", "=1/0" } }) {
+            br.Measure(std::string("recalculate/") + name, 100, [&] {
+                sheet->ClearCell("A1"_pos);
+                sheet->SetCell("A1"_pos, source);
+            });
+        }
+    }
+
+    // Row-major walks over a dense block: cell lookups one by one and the
+    // text printer.
+    void BenchmarkSheetScan(BenchmarkRunner& br) {
+        const int rows = 512;
+        const int cols = 64;
+        auto sheet = CreateSheet();
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                sheet->SetCell(Position{ row, col }, std::to_string(row * cols + col));
+            }
+        }
+
+        br.Measure("lookup", 200, [&] {
+            const SheetInterface& view = *sheet;
+            for (int row = 0; row < rows; ++row) {
+                for (int col = 0; col < cols; ++col) {
+                    DoNotOptimize(view.GetCell(Position{ row, col }));
+                }
+            }
+        });
+        br.Measure("print texts", 20, [&] {
+            std::ostringstream output;
+            sheet->PrintTexts(output);
+            DoNotOptimize(output.str().size());
+        });
+    }
+
+    // Filling a sheet with formulas and destroying it, which is dominated by
+    // allocating and freeing cell contents and formula trees.
+    void BenchmarkSheetLifetime(BenchmarkRunner& br) {
+        const int rows = 8192;
+        std::vector<std::string> formulas;
+        for (int row = 1; row < rows; ++row) {
+            formulas.push_back("=(A" + std::to_string(row) + "+B" + std::to_string(row) + ")*2-1");
+        }
+
+        br.Measure("load and destroy", 10, [&] {
+            auto sheet = std::make_unique<Sheet>(EvaluationMode::Lazy);
+            for (int row = 1; row < rows; ++row) {
+                sheet->SetCell(Position{ row, 0 }, formulas[row - 1]);
+            }
+            DoNotOptimize(sheet->GetAllocatorStats().chunks);
+        });
+    }
+
+    // Formulas parsed per second by the hand-written parser and by the
+    // ANTLR-generated one.
+    void BenchmarkFormulaParsing(BenchmarkRunner& br) {
+        std::vector<std::string> formulas;
+        for (int i = 1; i <= 1000; ++i) {
+            std::string row = std::to_string(i);
+            formulas.push_back("A" + row + "*2+B" + row);
+            formulas.push_back("(C" + row + "-D" + row + ")/(1.5e2+" + row + ")");
+            formulas.push_back("-E" + row + "*(F" + row + "+G" + row + "+H" + row + ")/4-0.25");
+        }
+
+        br.Measure("pratt", 20, [&] {
+            for (const auto& formula : formulas) {
+                DoNotOptimize(ParseFormulaAST(formula).GetProgram().code.size());
+            }
+        });
+        br.Measure("antlr", 20, [&] {
+            for (const auto& formula : formulas) {
+                DoNotOptimize(ParseFormulaASTWithAntlr(formula).GetProgram().code.size());
+            }
+        });
+    }
+
+    // Recalculation after a single edit under SUM and MAX over a block of a
+    // million numbers, which reads O(log n) stored summaries per column,
+    // against the same edit under a sum spelled as a chain of additions over
+    // a thousand cells.
+    void BenchmarkRangeSum(BenchmarkRunner& br) {
+        const int rows = 16384;
+        const int cols = 64;
+        Sheet sheet;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                sheet.SetCell(Position{ row, col }, std::to_string((row + col) % 100));
+            }
+        }
+        sheet.SetCell(Position{ 0, cols }, "=SUM(A1:" + Position{ rows - 1, cols - 1 }.ToString() + ")");
+
+        int value = 0;
+        br.Measure("sum of 1M cells", 1000, [&] {
+            sheet.SetCell("A1"_pos, std::to_string(++value));
+        });
+
+        Sheet lazy(EvaluationMode::Lazy);
+        lazy.SetCell(Position{ 0, cols }, "=SUM(A1:" + Position{ rows - 1, cols - 1 }.ToString() + ")");
+        lazy.SetCell(Position{ 1, cols }, "=MAX(A1:" + Position{ rows - 1, cols - 1 }.ToString() + ")");
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                lazy.SetCell(Position{ row, col }, std::to_string((row + col) % 100));
+            }
+        }
+        const SheetInterface& view = lazy;
+        DoNotOptimize(view.GetCell(Position{ 0, cols })->GetValue());
+        br.Measure("lazy sum and max of 1M cells", 1000, [&] {
+            lazy.SetCell("A1"_pos, std::to_string(++value));
+            DoNotOptimize(view.GetCell(Position{ 0, cols })->GetValue());
+            DoNotOptimize(view.GetCell(Position{ 1, cols })->GetValue());
+        });
+
+        sheet.ClearCell(Position{ 0, cols });
+        std::string chain = "=A1";
+        for (int row = 1; row < 1000; ++row) {
+            chain += "+A" + std::to_string(row + 1);
+        }
+        sheet.SetCell(Position{ 0, cols }, chain);
+        br.Measure("chain of 1000 cells", 2000, [&] {
+            sheet.SetCell("A1"_pos, std::to_string(++value));
+        });
+    }
+
+    // PrintTexts of 1M cells: half numbers, half formulas over them, with a
+    // range per row.
+    std::string MakeBenchmarkTexts() {
+        const int rows = 16384;
+        const int cols = 64;
+        std::string texts;
+        for (int row = 0; row < rows; ++row) {
+            for (int col = 0; col < cols; ++col) {
+                if (col < cols / 2) {
+                    texts += std::to_string((row * 7 + col) % 1000);
+                }
+                else if (col == cols - 1) {
+                    texts += "=SUM(" + Position{ row, 0 }.ToString() + ":" + Position{ row, cols - 2 }.ToString() + ")";
+                }
+                else {
+                    texts += "=" + Position{ row, col - cols / 2 }.ToString() + "*2+" + Position{ row, col - 1 }.ToString();
+                }
+                texts += col == cols - 1 ? '\n' : '\t';
+            }
+        }
+        return texts;
+    }
+
+    void BenchmarkTextImport(BenchmarkRunner& br) {
+        const std::string texts = MakeBenchmarkTexts();
+
+        // Sheets are destroyed outside of the measurements.
+        std::unique_ptr<Sheet> sheet;
+        br.Measure("import of 1M cells", 1, [&] {
+            sheet = std::make_unique<Sheet>();
+            sheet->ImportTexts(texts);
+        });
+        sheet.reset();
+        br.Measure("import of 1M cells on 4 threads", 1, [&] {
+            sheet = std::make_unique<Sheet>();
+            sheet->SetRecalculationThreads(4);
+            sheet->ImportTexts(texts);
+        });
+        sheet.reset();
+        br.Measure("SetCell of 1M cells", 1, [&] {
+            sheet = std::make_unique<Sheet>();
+            std::istringstream input(texts);
+            std::string line;
+            for (int row = 0; std::getline(input, line); ++row) {
+                std::istringstream cells(line);
+                std::string text;
+                for (int col = 0; std::getline(cells, text, '\t'); ++col) {
+                    sheet->SetCell(Position{ row, col }, text);
+                }
+            }
+        });
+    }
+
+    void BenchmarkPrinting(BenchmarkRunner& br) {
+        Sheet sheet;
+        sheet.ImportTexts(MakeBenchmarkTexts());
+        for (size_t threads : { 1, 4 }) {
+            sheet.SetRecalculationThreads(threads);
+            const std::string suffix = " of 1M cells on " + std::to_string(threads) + " threads";
+            br.Measure("PrintValues" + suffix, 1, [&] {
+                std::ostringstream output;
+                sheet.PrintValues(output);
+            });
+            br.Measure("PrintTexts" + suffix, 1, [&] {
+                std::ostringstream output;
+                sheet.PrintTexts(output);
+            });
+        }
+    }
+
+    void BenchmarkSparseIteration(BenchmarkRunner& br) {
+        // 10K cells scattered over the whole sheet, a few per occupied tile.
+        Sheet sheet;
+        std::mt19937 generator(5);
+        std::uniform_int_distribution<int> rows(0, Position::MAX_ROWS - 1);
+        std::uniform_int_distribution<int> cols(0, Position::MAX_COLS - 1);
+        for (int i = 0; i < 10000; ++i) {
+            sheet.SetCell({ rows(generator), cols(generator) }, std::to_string(i));
+        }
+        const Range everything{ { 0, 0 }, { Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } };
+        size_t visited = 0;
+        br.Measure("ForEachCell over a sparse sheet", 100, [&] {
+            sheet.ForEachCell(everything, [&visited](Position, const CellInterface&) {
+                ++visited;
+            });
+        });
+        ASSERT_EQUAL(visited, 100 * 10000u);
+    }
+
+    void BenchmarkClearing(BenchmarkRunner& br) {
+        // Cleared from the bottom right, so the area shrinks with every row.
+        std::string texts;
+        for (int row = 0; row < 1000; ++row) {
+            for (int col = 0; col < 1000; ++col) {
+                texts += std::to_string(col);
+                texts += col == 999 ? '\n' : '\t';
+            }
+        }
+        Sheet sheet;
+        sheet.ImportTexts(texts);
+        br.Measure("ClearCell of 1M cells", 1, [&] {
+            for (int row = 999; row >= 0; --row) {
+                for (int col = 999; col >= 0; --col) {
+                    sheet.ClearCell({ row, col });
+                }
+            }
+        });
+        ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 0, 0 }));
+    }
+
+    void BenchmarkPositionConversion(BenchmarkRunner& br) {
+        // 1M references spread over the whole sheet, converted both ways
+        // once per run.
+        const size_t count = 1 << 20;
+        std::mt19937 generator(25);
+        std::uniform_int_distribution<int> rows(0, Position::MAX_ROWS - 1);
+        std::uniform_int_distribution<int> cols(0, Position::MAX_COLS - 1);
+        std::vector<Position> positions(count);
+        std::vector<std::string> names(count);
+        for (size_t i = 0; i < count; ++i) {
+            positions[i] = { rows(generator), cols(generator) };
+            names[i] = positions[i].ToString();
+        }
+
+        size_t checksum = 0;
+        br.Measure("FromString of 1M references", 4, [&] {
+            for (const auto& name : names) {
+                checksum += Position::FromString(name).col;
+            }
+        });
+        br.Measure("ToString of 1M references", 4, [&] {
+            for (const auto& pos : positions) {
+                checksum += pos.ToString().size();
+            }
+        });
+        br.Measure("ToChars of 1M references", 4, [&] {
+            char buffer[Position::MAX_POSITION_LENGTH];
+            for (const auto& pos : positions) {
+                checksum += pos.ToChars(buffer) - buffer;
+            }
+        });
+        ASSERT(checksum != 0);
+    }
+
+    void BenchmarkSnapshot(BenchmarkRunner& br) {
+        Sheet original;
+        original.ImportTexts(MakeBenchmarkTexts());
+        std::string snapshot;
+        br.Measure("snapshot of 1M cells", 1, [&] {
+            std::ostringstream output;
+            original.WriteSnapshot(output);
+            snapshot = output.str();
+        });
+
+        std::unique_ptr<Sheet> sheet;
+        br.Measure("reading a snapshot of 1M cells", 1, [&] {
+            sheet = std::make_unique<Sheet>();
+            sheet->ReadSnapshot(snapshot);
+        });
+    }
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string_view(argv[1]) == "--bench") {
+        BenchmarkRunner br;
+        RUN_BENCHMARK(br, BenchmarkFormulaExecution);
+        RUN_BENCHMARK(br, BenchmarkErrorPropagation);
+        RUN_BENCHMARK(br, BenchmarkSheetScan);
+        RUN_BENCHMARK(br, BenchmarkSheetLifetime);
+        RUN_BENCHMARK(br, BenchmarkFormulaParsing);
+        RUN_BENCHMARK(br, BenchmarkRangeSum);
+        RUN_BENCHMARK(br, BenchmarkTextImport);
+        RUN_BENCHMARK(br, BenchmarkSnapshot);
+        RUN_BENCHMARK(br, BenchmarkPrinting);
+        RUN_BENCHMARK(br, BenchmarkSparseIteration);
+        RUN_BENCHMARK(br, BenchmarkClearing);
+        RUN_BENCHMARK(br, BenchmarkPositionConversion);
+        return 0;
+    }
+
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
@@ -432,7 +2186,32 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestSelfReferenceOnFreshSheet);
+    RUN_TEST(tr, TestSetPlaceholderCell);
     RUN_TEST(tr, Test_01);
     RUN_TEST(tr, TestClearPrint);
+    RUN_TEST(tr, TestPrintableAreaTracking);
+    RUN_TEST(tr, TestRecalculationOrder);
+    RUN_TEST(tr, TestDirectDependencies);
+    RUN_TEST(tr, TestIncrementalTopologicalOrder);
+    RUN_TEST(tr, TestLazyEvaluation);
+    RUN_TEST(tr, TestApplyBatch);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestCompiledFormula);
+    RUN_TEST(tr, TestTextOperands);
+    RUN_TEST(tr, TestTiledGrid);
+    RUN_TEST(tr, TestForEachCell);
+    RUN_TEST(tr, TestColumnarValueStore);
+    RUN_TEST(tr, TestValueStoreSummaries);
+    RUN_TEST(tr, TestUnchangedEdit);
+    RUN_TEST(tr, TestSheetArena);
+    RUN_TEST(tr, TestStringPool);
+    RUN_TEST(tr, TestPrattParserMatchesAntlr);
+    RUN_TEST(tr, TestSharedFormulas);
+    RUN_TEST(tr, TestRangeFunctions);
+    RUN_TEST(tr, TestRangeRecalculation);
+    RUN_TEST(tr, TestImportTexts);
+    RUN_TEST(tr, TestSnapshot);
+    RUN_TEST(tr, TestPrintingMatchesStreams);
     return 0;
 }
\ No newline at end of file
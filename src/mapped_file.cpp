@@ -0,0 +1,105 @@
+#include "mapped_file.h"
+
+#include <system_error>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+namespace {
+    [[noreturn]] void ThrowLastError(const std::string& what) {
+        throw std::system_error(static_cast<int>(GetLastError()), std::system_category(), what);
+    }
+}
+
+MappedFile::MappedFile(const std::string& path) {
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) {
+        file_ = nullptr;
+        ThrowLastError("Cannot open " + path);
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size)) {
+        CloseHandle(file_);
+        ThrowLastError("Cannot read the size of " + path);
+    }
+    size_ = static_cast<size_t>(size.QuadPart);
+    // An empty file cannot be mapped; it is read as empty data.
+    if (size_ == 0) {
+        return;
+    }
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_) {
+        CloseHandle(file_);
+        ThrowLastError("Cannot map " + path);
+    }
+    data_ = static_cast<const char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+    if (!data_) {
+        CloseHandle(mapping_);
+        CloseHandle(file_);
+        ThrowLastError("Cannot map " + path);
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        UnmapViewOfFile(data_);
+    }
+    if (mapping_) {
+        CloseHandle(mapping_);
+    }
+    CloseHandle(file_);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        throw std::system_error(errno, std::generic_category(), "Cannot open " + path);
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+        int error = errno;
+        close(fd);
+        throw std::system_error(error, std::generic_category(), "Cannot read the size of " + path);
+    }
+    size_ = static_cast<size_t>(file_stat.st_size);
+    // An empty file cannot be mapped; it is read as empty data.
+    if (size_ != 0) {
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            int error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), "Cannot map " + path);
+        }
+        data_ = static_cast<const char*>(data);
+        // The file is read front to back, a part per thread.
+        madvise(data, size_, MADV_SEQUENTIAL);
+    }
+    // The mapping keeps the file alive on its own.
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+#endif
+
+std::string_view MappedFile::GetData() const {
+    return { data_, size_ };
+}
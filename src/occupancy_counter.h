@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Counts of cells at indices 0 to SIZE - 1, e.g. per row of a sheet, that
+// keep track of the highest index with any cell. Every index has a bit that
+// is set while its count is not zero, and every 64 such bits a bit of their
+// own, so the highest index is found by reading a few words whatever cells
+// were added or removed before.
+template <int SIZE>
+class OccupancyCounter {
+public:
+    void Add(int index) {
+        assert(index >= 0 && index < SIZE);
+        if (static_cast<size_t>(index) >= counts_.size()) {
+            counts_.resize(index + 1, 0);
+        }
+        if (counts_[index]++ == 0) {
+            words_[index / 64] |= uint64_t{ 1 } << index % 64;
+            summary_[index / 64 / 64] |= uint64_t{ 1 } << index / 64 % 64;
+        }
+    }
+
+    void Remove(int index) {
+        assert(static_cast<size_t>(index) < counts_.size() && counts_[index] > 0);
+        if (--counts_[index] == 0) {
+            uint64_t& word = words_[index / 64];
+            word &= ~(uint64_t{ 1 } << index % 64);
+            if (word == 0) {
+                summary_[index / 64 / 64] &= ~(uint64_t{ 1 } << index / 64 % 64);
+            }
+        }
+    }
+
+    // One past the highest index with a count, zero if there is none.
+    int GetEnd() const {
+        for (size_t i = summary_.size(); i-- > 0;) {
+            if (summary_[i] != 0) {
+                const size_t word = i * 64 + HighestBit(summary_[i]);
+                return static_cast<int>(word * 64 + HighestBit(words_[word])) + 1;
+            }
+        }
+        return 0;
+    }
+
+private:
+    static const int WORDS = (SIZE + 63) / 64;
+
+    // Grown up to the highest index ever added.
+    std::vector<uint32_t> counts_;
+    // a bit per index
+    std::array<uint64_t, WORDS> words_{};
+    // a bit per word of words_
+    std::array<uint64_t, (WORDS + 63) / 64> summary_{};
+
+    // The index of the highest set bit of a non-zero mask.
+    static int HighestBit(uint64_t mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanReverse64(&index, mask);
+        return static_cast<int>(index);
+#else
+        return 63 - __builtin_clzll(mask);
+#endif
+    }
+};
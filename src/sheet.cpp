@@ -1,11 +1,118 @@
 #include "sheet.h"
 
+#include "mapped_file.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <fstream>
 #include <iostream>
+#include <iterator>
 #include <optional>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std::literals;
 
-Sheet::Sheet() {
+namespace {
+    const Range WHOLE_SHEET{ { 0, 0 }, { Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } };
+
+    // Smaller recalculations are not worth waking up the workers.
+    const size_t PARALLEL_RECALCULATION_MIN_CELLS = 256;
+    const size_t PARALLEL_RECALCULATION_GRAIN = 64;
+
+    // Imported texts are split into chunks of at least this size that end
+    // with a line break, each tokenized by one task.
+    const size_t IMPORT_CHUNK_BYTES = size_t{ 1 } << 20;
+    const size_t IMPORT_GRAIN = 1024;
+    // Formulas are parsed by a few tasks per thread, so that threads done
+    // early take over the rest.
+    const size_t IMPORT_TASKS_PER_THREAD = 4;
+
+    // Printed rows are formatted in chunks of about this many cells, a few
+    // chunks per thread at a time.
+    const size_t PRINT_CHUNK_CELLS = size_t{ 1 } << 16;
+    const size_t PRINT_TASKS_PER_THREAD = 4;
+
+    struct ImportedCell {
+        Position pos;
+        std::string_view text;
+        bool is_formula = false;
+    };
+
+    std::vector<std::string_view> SplitIntoChunks(std::string_view texts) {
+        std::vector<std::string_view> chunks;
+        while (!texts.empty()) {
+            size_t end = texts.find('\n', std::min(IMPORT_CHUNK_BYTES, texts.size()) - 1);
+            end = end == std::string_view::npos ? texts.size() : end + 1;
+            chunks.push_back(texts.substr(0, end));
+            texts.remove_prefix(end);
+        }
+        return chunks;
+    }
+
+    // Appends the non-empty cells of a chunk, numbering its rows from zero.
+    // Returns the number of rows.
+    int SplitIntoCells(std::string_view chunk, std::vector<ImportedCell>& cells) {
+        int row = 0;
+        while (!chunk.empty()) {
+            size_t line_end = std::min(chunk.find('\n'), chunk.size());
+            std::string_view line = chunk.substr(0, line_end);
+            for (int col = 0;; ++col) {
+                size_t cell_end = std::min(line.find('\t'), line.size());
+                if (cell_end != 0) {
+                    std::string_view text = line.substr(0, cell_end);
+                    cells.push_back({ { row, col }, text, Cell::IsFormulaText(text) });
+                }
+                if (cell_end == line.size()) {
+                    break;
+                }
+                line.remove_prefix(cell_end + 1);
+            }
+            chunk.remove_prefix(std::min(line_end + 1, chunk.size()));
+            ++row;
+        }
+        return row;
+    }
+
+    // A stream buffer appending everything written through it to a string.
+    class StringAppender : public std::streambuf {
+    public:
+        explicit StringAppender(std::string& target)
+            : target_(target) {
+        }
+
+    protected:
+        int_type overflow(int_type ch) override {
+            if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+                target_ += traits_type::to_char_type(ch);
+            }
+            return traits_type::not_eof(ch);
+        }
+
+        std::streamsize xsputn(const char* data, std::streamsize size) override {
+            target_.append(data, static_cast<size_t>(size));
+            return size;
+        }
+
+    private:
+        std::string& target_;
+    };
+
+    // Formats a number as std::ostream does with its default flags and the
+    // classic locale, that is %g with six significant digits.
+    void AppendNumber(std::string& buffer, double number) {
+        char digits[32];
+        auto result = std::to_chars(std::begin(digits), std::end(digits), number, std::chars_format::general, 6);
+        buffer.append(digits, result.ptr);
+    }
+}
+
+Sheet::Sheet(EvaluationMode mode)
+    : strings_(arena_.GetResource())
+    , formulas_(arena_.GetResource())
+    , evaluation_mode_(mode) {
 
 }
 
@@ -14,155 +121,562 @@ Sheet::~Sheet() {}
 void Sheet::SetCell(Position pos, std::string text) {
 
     CheckPosValidity(pos);
-    int row_id = pos.row;
-    int col_id = pos.col;
-
 
-    if (cache_.count(pos) != 0) {
-		const std::string& prev_expr = cache_.at(pos).first;
-		if (text == prev_expr) {
+    // The empty cell kept for dependents is not active yet: setting it,
+    // even to nothing, still brings it into the printable area.
+    if (const Cell* cell = main_sheet_.Find(pos)) {
+		if (cell->IsActive() && text == cell->GetText()) {
 			return;
 		}
-        
-        auto new_cell = std::make_unique<Cell>(*this);
-        new_cell->Set(pos, text);
-        auto referenced_cells = new_cell->GetReferencedCells();
-        for (const Position& cell : referenced_cells) {
-            if (HasCircularDependecies(pos, cell)) {
-                throw CircularDependencyException("There is a circular dependency in this expression"s);
-            }
+    }
+
+    CreateNewCell(pos, std::move(text));
+    ReleaseImportArenas();
+}
+
+void Sheet::ApplyBatch(std::vector<CellEdit> edits) {
+    struct PreparedEdit {
+        Position pos;
+        std::string text;
+        std::unique_ptr<Cell> cell;
+        std::vector<Position> referenced_cells;
+        std::vector<Range> referenced_ranges;
+    };
+
+    std::vector<PreparedEdit> prepared_edits;
+    std::unordered_map<Position, size_t, PositionHasher, PostionEqual> edit_ids;
+    for (auto& edit : edits) {
+        CheckPosValidity(edit.pos);
+        auto cell = std::make_unique<Cell>(*this);
+        cell->Set(edit.pos, edit.text);
+        auto referenced_cells = cell->GetReferencedCells();
+        auto referenced_ranges = cell->GetReferencedRanges();
+        PreparedEdit prepared{ edit.pos, std::move(edit.text), std::move(cell), std::move(referenced_cells),
+            std::move(referenced_ranges) };
+
+        auto [edit_id, inserted] = edit_ids.emplace(edit.pos, prepared_edits.size());
+        if (inserted) {
+            prepared_edits.push_back(std::move(prepared));
         }
-        
-        try {
-            auto old_dependencies = main_sheet_[row_id][col_id]->GetReferencedCells();
-            auto cell_value = new_cell->CalculateValue();
-            UpdateCache(pos, std::move(text), cell_value);
-            CountDependentCells(pos);
-            UpdateDependencies(old_dependencies, new_cell->GetReferencedCells(), pos);
-            main_sheet_[row_id][col_id].reset(new_cell.release());
+        else {
+            prepared_edits[edit_id->second] = std::move(prepared);
         }
-        catch (FormulaError& er) {
-            throw er;
+    }
+    prepared_edits.erase(std::remove_if(prepared_edits.begin(), prepared_edits.end(),
+        [this](const PreparedEdit& edit) {
+            const Cell* cell = main_sheet_.Find(edit.pos);
+            return cell && cell->IsActive() && cell->GetText() == edit.text;
+        }), prepared_edits.end());
+
+    // Cycles are checked against the final graph: references of every edited
+    // cell are dropped first and the new ones are added back one cell at a time.
+    std::vector<std::vector<Position>> old_precedents;
+    std::vector<std::vector<Range>> old_range_precedents;
+    old_precedents.reserve(prepared_edits.size());
+    old_range_precedents.reserve(prepared_edits.size());
+    for (const auto& edit : prepared_edits) {
+        const auto& precedents = dependencies_.GetPrecedents(edit.pos);
+        old_precedents.emplace_back(precedents.begin(), precedents.end());
+        old_range_precedents.push_back(dependencies_.GetRangePrecedents(edit.pos));
+        dependencies_.SetPrecedents(edit.pos, {});
+    }
+    for (const auto& edit : prepared_edits) {
+        if (dependencies_.HasCircularDependency(edit.pos, edit.referenced_cells, edit.referenced_ranges)) {
+            for (const auto& edit_to_revert : prepared_edits) {
+                dependencies_.SetPrecedents(edit_to_revert.pos, {});
+            }
+            for (size_t i = 0; i < prepared_edits.size(); ++i) {
+                dependencies_.SetPrecedents(prepared_edits[i].pos, old_precedents[i], old_range_precedents[i]);
+            }
+            throw CircularDependencyException("There is a circular dependency in this expression"s);
         }
+        dependencies_.SetPrecedents(edit.pos, edit.referenced_cells, edit.referenced_ranges);
+    }
+
+    PositionSet edited_cells;
+    for (auto& edit : prepared_edits) {
+        values_.SetPending(edit.pos);
+        ActivePosition(edit.pos, *edit.cell);
+        main_sheet_.Emplace(edit.pos, std::move(*edit.cell)).SetDirty(true);
+        edited_cells.insert(edit.pos);
+    }
+    ReleaseImportArenas();
+
+    if (evaluation_mode_ == EvaluationMode::Lazy) {
+        for (const auto& pos : edited_cells) {
+            InvalidateDependentCells(pos);
+        }
+        last_recalculated_cells_ = 0;
         return;
     }
+    auto dirty_cells = dependencies_.CollectDependents(edited_cells);
+    dirty_cells.insert(edited_cells.begin(), edited_cells.end());
+    last_recalculated_cells_ = EvaluateCells(dirty_cells);
+}
+
+void Sheet::ImportTexts(std::string_view texts) {
+    if (main_sheet_.Size() != 0) {
+        throw std::logic_error("Texts can only be imported into an empty sheet"s);
+    }
 
-    CreateNewCell(pos, text);
-    
+    // Chunks are tokenized independently; the rows of a chunk are numbered
+    // once the rows of the chunks before it are counted.
+    auto chunks = SplitIntoChunks(texts);
+    std::vector<std::vector<ImportedCell>> chunk_cells(chunks.size());
+    std::vector<size_t> first_rows(chunks.size() + 1);
+    RunInParallel(chunks.size(), 1, [&](size_t i) {
+        first_rows[i + 1] = SplitIntoCells(chunks[i], chunk_cells[i]);
+    });
+    std::vector<size_t> first_cells(chunks.size() + 1);
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        first_rows[i + 1] += first_rows[i];
+        first_cells[i + 1] = first_cells[i] + chunk_cells[i].size();
+    }
+    std::vector<ImportedCell> cells(first_cells.back());
+    RunInParallel(chunks.size(), 1, [&](size_t i) {
+        auto out = cells.begin() + first_cells[i];
+        for (auto cell : chunk_cells[i]) {
+            if (first_rows[i] + cell.pos.row >= static_cast<size_t>(Position::MAX_ROWS)) {
+                throw InvalidPositionException("Invalid id of row or column"s);
+            }
+            cell.pos.row += static_cast<int>(first_rows[i]);
+            CheckPosValidity(cell.pos);
+            *out++ = cell;
+        }
+        chunk_cells[i] = {};
+    });
+
+    // Formulas with the same relative key share a tree, parsed once for the
+    // first of them in row-major order, so errors are reported for the same
+    // cell as if the texts were set one by one.
+    std::vector<size_t> formula_cells;
+    for (size_t i = 0; i < cells.size(); ++i) {
+        if (cells[i].is_formula) {
+            formula_cells.push_back(i);
+        }
+    }
+    std::vector<std::optional<std::string>> keys(formula_cells.size());
+    RunInParallel(formula_cells.size(), IMPORT_GRAIN, [&](size_t i) {
+        const auto& cell = cells[formula_cells[i]];
+        keys[i] = FormulaTable::MakeRelativeKey(cell.text.substr(1), cell.pos);
+    });
+    std::vector<size_t> tree_ids(formula_cells.size());
+    // the formula of the first cell of every tree
+    std::vector<size_t> anchors;
+    {
+        std::unordered_map<std::string_view, size_t> tree_ids_by_key;
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (!keys[i]) {
+                throw FormulaException("Incorrect expression in "s + cells[formula_cells[i]].pos.ToString());
+            }
+            auto [tree_id, inserted] = tree_ids_by_key.emplace(*keys[i], anchors.size());
+            if (inserted) {
+                anchors.push_back(i);
+            }
+            tree_ids[i] = tree_id->second;
+        }
+    }
+
+    // Arenas are not thread-safe: every task parses into one of its own.
+    const size_t tasks = std::min(anchors.size(), GetRecalculationThreads() * IMPORT_TASKS_PER_THREAD);
+    std::vector<std::unique_ptr<Arena>> arenas(tasks);
+    std::vector<ArenaPtr<FormulaAST>> trees(anchors.size());
+    RunInParallel(tasks, 1, [&](size_t task) {
+        arenas[task] = std::make_unique<Arena>();
+        auto* resource = arenas[task]->GetResource();
+        for (size_t i = anchors.size() * task / tasks; i < anchors.size() * (task + 1) / tasks; ++i) {
+            std::string_view expression = cells[formula_cells[anchors[i]]].text.substr(1);
+            try {
+                trees[i] = MakeArenaPtr<FormulaAST>(resource, ParseFormulaAST(expression, resource));
+            }
+            catch (...) {
+                // reported below, for the first such cell
+            }
+        }
+    });
+    std::vector<std::optional<Formula>> anchor_formulas(anchors.size());
+    for (size_t i = 0; i < anchors.size(); ++i) {
+        Position anchor = cells[formula_cells[anchors[i]]].pos;
+        if (!trees[i]) {
+            throw FormulaException("Incorrect expression in "s + anchor.ToString());
+        }
+        anchor_formulas[i] = formulas_.Add(std::move(*keys[anchors[i]]), std::move(trees[i]), anchor);
+    }
+    keys = {};
+
+    std::vector<std::optional<Formula>> formulas(formula_cells.size());
+    std::vector<DependencyGraph::CellReferences> references(formula_cells.size());
+    RunInParallel(formula_cells.size(), IMPORT_GRAIN, [&](size_t i) {
+        size_t tree_id = tree_ids[i];
+        Position pos = cells[formula_cells[i]].pos;
+        Position anchor = cells[formula_cells[anchors[tree_id]]].pos;
+        const auto& formula = formulas[i].emplace(anchor_formulas[tree_id]->GetAST(),
+            Position{ pos.row - anchor.row, pos.col - anchor.col });
+        references[i] = { pos, formula.GetReferencedCells(), formula.GetReferencedRanges() };
+    });
+
+    DependencyGraph dependencies;
+    if (auto cycle = dependencies.Build(std::move(references))) {
+        throw CircularDependencyException("There is a circular dependency through "s + cycle->ToString());
+    }
+
+    // Nothing can fail from here on.
+    dependencies_ = std::move(dependencies);
+    std::move(arenas.begin(), arenas.end(), std::back_inserter(import_arenas_));
+    PositionSet formula_positions;
+    size_t formula_id = 0;
+    for (const auto& imported : cells) {
+        Cell& cell = main_sheet_.Emplace(imported.pos, *this);
+        if (imported.is_formula) {
+            cell.Set(imported.pos, std::move(*formulas[formula_id++]));
+        }
+        else {
+            cell.Set(imported.pos, std::string(imported.text));
+        }
+        ActivePosition(imported.pos, cell);
+        if (evaluation_mode_ == EvaluationMode::Lazy || imported.is_formula) {
+            values_.SetPending(imported.pos);
+            cell.SetDirty(true);
+        }
+        else {
+            values_.Set(imported.pos, cell.CalculateValue());
+        }
+        if (evaluation_mode_ == EvaluationMode::Eager && imported.is_formula) {
+            formula_positions.insert(imported.pos);
+        }
+    }
+    last_recalculated_cells_ = EvaluateCells(formula_positions);
 }
 
-const CellInterface* Sheet::GetCell(Position pos) const {
-    CheckPosValidity(pos);
-    if (main_sheet_.count(pos.row) == 0) {
-        return nullptr;
+void Sheet::LoadTexts(const std::string& path) {
+    MappedFile file(path);
+    ImportTexts(file.GetData());
+}
+
+void Sheet::WriteSnapshot(std::ostream& output) const {
+    // Texts and keys are stored once each; the views point into the string
+    // pool and the formula table, which outlive the writer.
+    std::vector<std::uint64_t> string_offsets{ 0 };
+    std::string string_data;
+    std::unordered_map<std::string_view, std::uint32_t> string_ids;
+    auto add_string = [&](std::string_view text) {
+        auto [it, inserted] = string_ids.emplace(text, static_cast<std::uint32_t>(string_offsets.size() - 1));
+        if (inserted) {
+            string_data += text;
+            string_offsets.push_back(string_data.size());
+        }
+        return it->second;
+    };
+
+    std::unordered_map<const FormulaAST*, std::pair<std::string_view, Position>> entries;
+    formulas_.ForEachEntry([&](std::string_view key, Position anchor, const FormulaAST& ast) {
+        entries.emplace(&ast, std::pair{ key, anchor });
+    });
+    std::unordered_map<const FormulaAST*, std::uint32_t> tree_ids;
+    std::vector<SnapshotTree> trees;
+    std::vector<FormulaAST::Node> nodes;
+
+    std::vector<SnapshotCell> cells;
+    cells.reserve(main_sheet_.Size());
+    ForEachCell(WHOLE_SHEET, [&](Position pos, const Cell& cell) {
+        SnapshotCell record;
+        record.row = pos.row;
+        record.col = pos.col;
+        if (cell.IsDirty()) {
+            record.flags |= SnapshotCell::Dirty;
+        }
+        if (cell.IsActive()) {
+            record.flags |= SnapshotCell::Active;
+        }
+        if (const Formula* formula = cell.GetFormula()) {
+            const FormulaAST* ast = formula->GetAST().get();
+            auto [it, inserted] = tree_ids.emplace(ast, static_cast<std::uint32_t>(trees.size()));
+            if (inserted) {
+                const auto& [key, anchor] = entries.at(ast);
+                SnapshotTree tree;
+                tree.anchor_row = anchor.row;
+                tree.anchor_col = anchor.col;
+                tree.key = add_string(key);
+                tree.first_node = nodes.size();
+                ast->Flatten(nodes);
+                tree.node_count = static_cast<std::uint32_t>(nodes.size() - tree.first_node);
+                trees.push_back(tree);
+            }
+            record.kind = SnapshotCell::Formula;
+            record.index = it->second;
+        }
+        else if (std::string_view text = cell.GetTextView(); !text.empty()) {
+            record.kind = SnapshotCell::Text;
+            record.index = add_string(text);
+        }
+        cells.push_back(record);
+    });
+    std::vector<Position> order = dependencies_.GetOrder();
+
+    std::vector<SnapshotColumn> columns(values_.GetColumnCount());
+    std::vector<ColumnarValueStore::Tag> tags;
+    std::vector<double> numbers;
+    for (size_t col = 0; col < columns.size(); ++col) {
+        const auto* column = values_.FindColumn(static_cast<int>(col));
+        columns[col].rows = column->tags.size();
+        tags.insert(tags.end(), column->tags.begin(), column->tags.end());
+        numbers.insert(numbers.end(), column->numbers.begin(), column->numbers.end());
+    }
+
+    SnapshotWriter writer;
+    writer.AddSection(SnapshotSection::StringOffsets, string_offsets);
+    writer.AddSection(SnapshotSection::StringData, string_data.data(), string_data.size());
+    writer.AddSection(SnapshotSection::Trees, trees);
+    writer.AddSection(SnapshotSection::TreeNodes, nodes);
+    writer.AddSection(SnapshotSection::Cells, cells);
+    writer.AddSection(SnapshotSection::Order, order);
+    writer.AddSection(SnapshotSection::Columns, columns);
+    writer.AddSection(SnapshotSection::ColumnTags, tags);
+    writer.AddSection(SnapshotSection::ColumnNumbers, numbers);
+    writer.Write(output);
+}
+
+void Sheet::SaveSnapshot(const std::string& path) const {
+    std::ofstream output(path, std::ios::binary);
+    if (!output) {
+        throw SnapshotError("Cannot open "s + path);
+    }
+    WriteSnapshot(output);
+}
+
+void Sheet::ReadSnapshot(std::string_view snapshot) {
+    if (main_sheet_.Size() != 0) {
+        throw std::logic_error("A snapshot can only be read into an empty sheet"s);
+    }
+    SnapshotReader reader(snapshot);
+
+    const auto string_offsets = reader.GetSection<std::uint64_t>(SnapshotSection::StringOffsets);
+    const auto string_data = reader.GetSection<char>(SnapshotSection::StringData);
+    auto get_string = [&](std::uint32_t index) {
+        if (size_t{ index } + 1 >= string_offsets.size) {
+            throw SnapshotError("Malformed snapshot: no text "s + std::to_string(index));
+        }
+        const std::uint64_t begin = string_offsets[index];
+        const std::uint64_t end = string_offsets[index + 1];
+        if (begin > end || end > string_data.size) {
+            throw SnapshotError("Malformed snapshot: text "s + std::to_string(index) + " out of bounds"s);
+        }
+        return std::string_view(string_data.data + begin, end - begin);
+    };
+    auto get_position = [](std::int32_t row, std::int32_t col) {
+        Position pos{ row, col };
+        if (!pos.IsValid()) {
+            throw SnapshotError("Malformed snapshot: invalid position"s);
+        }
+        return pos;
+    };
+
+    // The trees go into the table right away; if anything below fails, the
+    // formulas of their anchors are the last users and take them out again.
+    const auto tree_records = reader.GetSection<SnapshotTree>(SnapshotSection::Trees);
+    const auto nodes = reader.GetSection<FormulaAST::Node>(SnapshotSection::TreeNodes);
+    std::vector<Formula> anchor_formulas;
+    anchor_formulas.reserve(tree_records.size);
+    std::unordered_set<std::string_view> keys;
+    for (const auto& tree : tree_records) {
+        Position anchor = get_position(tree.anchor_row, tree.anchor_col);
+        std::string_view key = get_string(tree.key);
+        if (!keys.insert(key).second) {
+            throw SnapshotError("Malformed snapshot: formula "s + std::string(key) + " stored twice"s);
+        }
+        if (tree.first_node > nodes.size || tree.node_count > nodes.size - tree.first_node) {
+            throw SnapshotError("Malformed snapshot: formula tree out of bounds"s);
+        }
+        auto* resource = arena_.GetResource();
+        ArenaPtr<FormulaAST> ast;
+        try {
+            ast = MakeArenaPtr<FormulaAST>(resource, MakeFormulaAST(nodes.data + tree.first_node, tree.node_count, resource));
+        }
+        catch (const ParsingError& error) {
+            throw SnapshotError("Malformed snapshot: "s + error.what());
+        }
+        anchor_formulas.push_back(formulas_.Add(std::string(key), std::move(ast), anchor));
+    }
+
+    const auto cell_records = reader.GetSection<SnapshotCell>(SnapshotSection::Cells);
+    std::vector<Formula> formulas;
+    std::vector<DependencyGraph::CellReferences> references;
+    std::optional<Position> previous;
+    for (const auto& record : cell_records) {
+        Position pos = get_position(record.row, record.col);
+        // Row-major order rules out a cell stored twice.
+        if (previous && (pos.row < previous->row || (pos.row == previous->row && pos.col <= previous->col))) {
+            throw SnapshotError("Malformed snapshot: cells out of order at "s + pos.ToString());
+        }
+        previous = pos;
+        if (record.kind == SnapshotCell::Formula) {
+            if (record.index >= anchor_formulas.size()) {
+                throw SnapshotError("Malformed snapshot: no formula tree for "s + pos.ToString());
+            }
+            const Position anchor{ tree_records[record.index].anchor_row, tree_records[record.index].anchor_col };
+            const auto& formula = formulas.emplace_back(anchor_formulas[record.index].GetAST(),
+                Position{ pos.row - anchor.row, pos.col - anchor.col });
+            references.push_back({ pos, formula.GetReferencedCells(), formula.GetReferencedRanges() });
+        }
+        else if (record.kind == SnapshotCell::Text) {
+            if (get_string(record.index).empty()) {
+                throw SnapshotError("Malformed snapshot: empty text in "s + pos.ToString());
+            }
+        }
+        else if (record.kind != SnapshotCell::Empty) {
+            throw SnapshotError("Malformed snapshot: unknown kind of "s + pos.ToString());
+        }
     }
-    auto& row = main_sheet_.at(pos.row);
 
-    if (row.count(pos.col) == 0) {
-        return nullptr;
+    const auto order = reader.GetSection<Position>(SnapshotSection::Order);
+    DependencyGraph dependencies;
+    if (!dependencies.Restore(std::move(references), order.data, order.size)) {
+        throw SnapshotError("Malformed snapshot: the dependency order does not match the formulas"s);
     }
 
-    return main_sheet_.at(pos.row).at(pos.col).get();
+    const auto column_records = reader.GetSection<SnapshotColumn>(SnapshotSection::Columns);
+    const auto tags = reader.GetSection<ColumnarValueStore::Tag>(SnapshotSection::ColumnTags);
+    const auto numbers = reader.GetSection<double>(SnapshotSection::ColumnNumbers);
+    if (column_records.size > static_cast<size_t>(Position::MAX_COLS) || tags.size != numbers.size) {
+        throw SnapshotError("Malformed snapshot: invalid value columns"s);
+    }
+    std::vector<ColumnarValueStore::Column> columns(column_records.size);
+    size_t first_row = 0;
+    for (size_t col = 0; col < columns.size(); ++col) {
+        const std::uint64_t rows = column_records[col].rows;
+        if (rows > static_cast<std::uint64_t>(Position::MAX_ROWS) || rows > tags.size - first_row) {
+            throw SnapshotError("Malformed snapshot: value column out of bounds"s);
+        }
+        columns[col].tags.assign(tags.data + first_row, tags.data + first_row + rows);
+        columns[col].numbers.assign(numbers.data + first_row, numbers.data + first_row + rows);
+        first_row += rows;
+    }
+    if (std::any_of(tags.begin(), tags.end(), [](auto tag) { return tag > ColumnarValueStore::Tag::Div0Error; })) {
+        throw SnapshotError("Malformed snapshot: unknown value tag"s);
+    }
+    for (const auto& record : cell_records) {
+        if (static_cast<size_t>(record.col) >= columns.size() || static_cast<size_t>(record.row) >= columns[record.col].tags.size()) {
+            throw SnapshotError("Malformed snapshot: no value for "s + Position{ record.row, record.col }.ToString());
+        }
+    }
+
+    // Nothing can fail from here on.
+    dependencies_ = std::move(dependencies);
+    values_.Restore(std::move(columns));
+    PositionSet dirty_cells;
+    size_t formula_id = 0;
+    for (const auto& record : cell_records) {
+        const Position pos{ record.row, record.col };
+        Cell& cell = main_sheet_.Emplace(pos, *this);
+        if (record.kind == SnapshotCell::Formula) {
+            cell.Set(pos, std::move(formulas[formula_id++]));
+        }
+        else if (record.kind == SnapshotCell::Text) {
+            cell.Set(pos, std::string(get_string(record.index)));
+        }
+        if (record.flags & SnapshotCell::Active) {
+            ActivePosition(pos, cell);
+        }
+        if (record.flags & SnapshotCell::Dirty) {
+            cell.SetDirty(true);
+            dirty_cells.insert(pos);
+        }
+    }
+    last_recalculated_cells_ = 0;
+    if (evaluation_mode_ == EvaluationMode::Eager) {
+        last_recalculated_cells_ = EvaluateCells(dirty_cells);
+    }
+}
+
+void Sheet::LoadSnapshot(const std::string& path) {
+    MappedFile file(path);
+    ReadSnapshot(file.GetData());
+}
+
+const CellInterface* Sheet::GetCell(Position pos) const {
+    CheckPosValidity(pos);
+    return main_sheet_.Find(pos);
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
     CheckPosValidity(pos);
-    auto& result = main_sheet_[pos.row][pos.col];
-    if (!result) {
-        if (dependencies_.count(pos) != 0) {
-            result = std::make_unique<Cell>(*this);
-            result->Set(pos, "");
-        }
+    Cell* result = main_sheet_.Find(pos);
+    if (!result && dependencies_.HasDependents(pos)) {
+        result = &main_sheet_.Emplace(pos, *this);
+        result->Set(pos, "");
+        values_.Set(pos, ""s);
     }
-    return result.get();
+    return result;
 }
 
 void Sheet::ClearCell(Position pos) {
     CheckPosValidity(pos);
-    int row_id = pos.row;
-    int col_id = pos.col;
-    if (main_sheet_.count(row_id) == 0) {
-        return;
-    }
-    auto& row = main_sheet_[row_id];
-    if (row.count(col_id) == 0) {
+    const Cell* cell = main_sheet_.Find(pos);
+    if (!cell) {
         return;
     }
-
-    auto& cell_to_clear = main_sheet_[row_id][col_id];
-    if (cell_to_clear) {
-        cell_to_clear->Clear();
+    if (cell->IsActive()) {
         InactivePosition(pos);
-        cell_to_clear.release();
-        row.erase(col_id);
     }
+    main_sheet_.Erase(pos);
+    dependencies_.SetPrecedents(pos, {});
+    values_.Erase(pos);
+    UpdateDependentCells(pos);
+    ReleaseImportArenas();
 }
 
 Size Sheet::GetPrintableSize() const {
-    return print_area_;
+    return { active_rows_.GetEnd(), active_cols_.GetEnd() };
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    int rows = print_area_.rows;
-    int cols = print_area_.cols;
-    if (rows < 1 || cols < 1) {
+    const Size size = GetPrintableSize();
+    if (size.rows < 1 || size.cols < 1) {
         return;
     }
-    for (int i = 0; i < rows; ++i) {
-        if (main_sheet_.count(i) == 0) {
-            for (int j = 0; j < cols; ++j) {
-                if (j != cols - 1) {
-                    output << '\t';
-                }
-            }
-            output << '\n';
-            continue;
-        }
-        const auto& row = main_sheet_.at(i);
-        for (int j = 0; j < cols; ++j) {
-            if (row.count(j) != 0) {
-                auto& cell = row.at(j);
-                auto val = cell->GetValue();
-                PrintValue(output, val);
-            }
-            if (j != cols - 1) {
-                output << '\t';
-            }
+    // Values are brought up to date first, so that formatting only reads
+    // them and rows can be formatted in parallel.
+    std::vector<Position> dirty_cells;
+    ForEachCell(GetPrintRange(), [&dirty_cells](Position pos, const Cell& cell) {
+        if (cell.IsDirty()) {
+            dirty_cells.push_back(pos);
         }
-        output << '\n';
-    }
-    
+    });
+    EvaluateDirtyCells(dirty_cells);
+
+    PrintRows(output, [this](Position pos, const Cell& cell, std::string& buffer) {
+        switch (values_.GetTag(pos)) {
+        case ColumnarValueStore::Tag::Number:
+            AppendNumber(buffer, values_.GetNumber(pos));
+            break;
+        case ColumnarValueStore::Tag::NumericText:
+        case ColumnarValueStore::Tag::Text:
+            buffer += cell.GetTextValue();
+            break;
+        default:
+            buffer += values_.GetError(pos).ToString();
+            buffer += '!';
+        }
+    });
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
-    int rows = print_area_.rows;
-    int cols = print_area_.cols;
-
-    if (rows < 1 || cols < 1) {
+    const Size size = GetPrintableSize();
+    if (size.rows < 1 || size.cols < 1) {
         return;
     }
-    for (int i = 0; i < rows; ++i) {
-        if (main_sheet_.count(i) == 0) {
-            for (int j = 0; j < cols; ++j) {
-                if (j != cols - 1) {
-                    output << '\t';
-                }
-            }
-            output << '\n';
-            continue;
-        }
-        const auto& row = main_sheet_.at(i);
-        for (int j = 0; j < cols; ++j) {
-            if (row.count(j) != 0) {
-                auto& val = row.at(j);
-                output << val->GetText();
-            }
-            if (j != cols - 1) {
-                output << '\t';
-            }
+    PrintRows(output, [](Position, const Cell& cell, std::string& buffer) {
+        if (const Formula* formula = cell.GetFormula()) {
+            // Printed straight into the buffer rather than through GetText.
+            buffer += FORMULA_SIGN;
+            StringAppender appender(buffer);
+            std::ostream formula_output(&appender);
+            formula->PrintExpression(formula_output);
         }
-        output << '\n';
-    }
+        else {
+            buffer += cell.GetTextView();
+        }
+    });
 }
 
 std::unique_ptr<SheetInterface> CreateSheet() {
@@ -170,29 +684,40 @@ std::unique_ptr<SheetInterface> CreateSheet() {
 }
 
 void Sheet::CreateNewCell(Position pos, std::string text) {
-    int row_id = pos.row;
-    int col_id = pos.col;
+    Cell new_cell(*this);
+    new_cell.Set(pos, std::move(text));
+    auto referenced_cells = new_cell.GetReferencedCells();
+    auto referenced_ranges = new_cell.GetReferencedRanges();
+    if (dependencies_.HasCircularDependency(pos, referenced_cells, referenced_ranges)) {
+        throw CircularDependencyException("There is a circular dependency in this expression"s);
+    }
 
-    auto new_cell = std::make_unique<Cell>(*this);
-    new_cell->Set(pos, text);
-    auto referenced_cells = new_cell->GetReferencedCells();
-    for (const Position& cell : referenced_cells) {
-        if (HasCircularDependecies(pos, cell)) {
-            throw CircularDependencyException("There is a circular dependency in this expression"s);
-        }
+    if (evaluation_mode_ == EvaluationMode::Lazy) {
+        values_.SetPending(pos);
+        new_cell.SetDirty(true);
+    }
+    else {
+        values_.Set(pos, new_cell.CalculateValue());
     }
+    dependencies_.SetPrecedents(pos, referenced_cells, referenced_ranges);
+    ActivePosition(pos, new_cell);
+    main_sheet_.Emplace(pos, std::move(new_cell));
+    UpdateDependentCells(pos);
+}
 
-    try {
-        auto cell_value = new_cell->CalculateValue();
-        UpdateCache(pos, std::move(text), cell_value);
-        AssignDependencies(pos, new_cell->GetReferencedCells());
-        ActivePosition(pos);
-        main_sheet_[row_id][col_id].reset(new_cell.release());
+void Sheet::ReleaseImportArenas() {
+    import_arenas_.erase(std::remove_if(import_arenas_.begin(), import_arenas_.end(),
+        [](const auto& arena) { return arena->GetStats().objects_in_use == 0; }), import_arenas_.end());
+}
+
+void Sheet::RunInParallel(size_t count, size_t grain, const std::function<void(size_t)>& body) const {
+    if (thread_pool_) {
+        thread_pool_->ParallelFor(count, grain, body);
+        return;
     }
-    catch (FormulaError& er) {
-        throw er;
+    for (size_t i = 0; i < count; ++i) {
+        body(i);
     }
-    return;
 }
 
 void Sheet::CheckPosValidity(Position pos) const {
@@ -206,133 +731,268 @@ void Sheet::CheckPosValidity(Position pos) const {
     }
 }
 
-void Sheet::ActivePosition(Position pos) {
-    if (max_row_ < pos.row) {
-        max_row_ = pos.row;
-        print_area_.rows = max_row_ + 1;
+void Sheet::CheckRangeValidity(Range range) const {
+    if (!range.IsValid()) {
+        throw InvalidPositionException("Invalid range"s);
     }
+}
 
-    if (max_col_ < pos.col) {
-        max_col_ = pos.col;
-        print_area_.cols = max_col_ + 1;
+void Sheet::ActivePosition(Position pos, Cell& cell) {
+    const Cell* previous = main_sheet_.Find(pos);
+    const bool was_active = previous && previous->IsActive();
+    cell.SetActive(true);
+    if (!was_active) {
+        active_rows_.Add(pos.row);
+        active_cols_.Add(pos.col);
     }
-
-    active_cells_.insert(pos);
-
 }
 
 void Sheet::InactivePosition(Position pos) {
+    active_rows_.Remove(pos.row);
+    active_cols_.Remove(pos.col);
+}
 
-    active_cells_.erase(pos);
-    max_row_ = -1;
-    max_col_ = -1;
-    print_area_ = GetActualTableArea();
+Range Sheet::GetPrintRange() const {
+    const Size size = GetPrintableSize();
+    return { { 0, 0 }, { size.rows - 1, size.cols - 1 } };
 }
 
-Size Sheet::GetActualTableArea() {
-    
-    for (const auto& pos : active_cells_) {
-        if (pos.row > max_row_) {
-            max_row_ = pos.row;
-        }
-        if (pos.col > max_col_) {
-            max_col_ = pos.col;
+void Sheet::PrintRows(std::ostream& output, const std::function<void(Position, const Cell&, std::string&)>& print_cell) const {
+    const Size size = GetPrintableSize();
+    const int rows = size.rows;
+    const int cols = size.cols;
+    const int chunk_rows = std::max(1, static_cast<int>(PRINT_CHUNK_CELLS / cols));
+    const size_t chunks = (rows + chunk_rows - 1) / chunk_rows;
+    // A batch of chunks is formatted at a time, each into a buffer of its
+    // own, and written out in order; the buffers are reused by the next batch.
+    std::vector<std::string> buffers(std::min(chunks, GetRecalculationThreads() * PRINT_TASKS_PER_THREAD));
+    for (size_t first_chunk = 0; first_chunk < chunks; first_chunk += buffers.size()) {
+        const size_t batch = std::min(buffers.size(), chunks - first_chunk);
+        RunInParallel(batch, 1, [&](size_t i) {
+            std::string& buffer = buffers[i];
+            buffer.clear();
+            const int first_row = static_cast<int>(first_chunk + i) * chunk_rows;
+            const int last_row = std::min(rows, first_row + chunk_rows) - 1;
+            // Separators up to pos, from the cell printed last.
+            int row = first_row;
+            int col = 0;
+            auto move_to = [&](Position pos) {
+                for (; row < pos.row; ++row, col = 0) {
+                    buffer.append(cols - 1 - col, '\t');
+                    buffer += '\n';
+                }
+                buffer.append(pos.col - col, '\t');
+                col = pos.col;
+            };
+            ForEachCell({ { first_row, 0 }, { last_row, cols - 1 } }, [&](Position pos, const Cell& cell) {
+                move_to(pos);
+                print_cell(pos, cell, buffer);
+            });
+            move_to({ last_row + 1, 0 });
+        });
+        for (size_t i = 0; i < batch; ++i) {
+            output.write(buffers[i].data(), buffers[i].size());
         }
     }
-    return { max_row_ + 1, max_col_ + 1};
 }
 
-void Sheet::PrintValue(std::ostream& os, const CellInterface::Value& value) const {
 
-    if (std::holds_alternative<double>(value)) {
-        os << std::get<double>(value);
-    }
-    else if (std::holds_alternative<std::string>(value)) {
-        os << std::get<std::string>(value);
+Sheet::CellValue Sheet::GetCellCache(Position pos) const {
+    const Cell* cell = main_sheet_.Find(pos);
+    if (cell->IsDirty()) {
+        EvaluateDirtyCells({ pos });
     }
-    else if (std::holds_alternative<FormulaError>(value)) {
-        os << std::get<FormulaError>(value);
+    switch (values_.GetTag(pos)) {
+    case ColumnarValueStore::Tag::Number:
+        return values_.GetNumber(pos);
+    case ColumnarValueStore::Tag::NumericText:
+    case ColumnarValueStore::Tag::Text:
+        return cell->CalculateValue();
+    default:
+        return values_.GetError(pos);
     }
 }
 
 
-bool Sheet::CellCacheIsExist(Position pos) const {
-    return cache_.count(pos) == 0;
+size_t Sheet::GetLastRecalculatedCellsCount() const {
+    return last_recalculated_cells_;
 }
 
+EvaluationMode Sheet::GetEvaluationMode() const {
+    return evaluation_mode_;
+}
 
-Sheet::CellValue Sheet::GetCellCache(Position pos) const {
-    return cache_.at(pos).second;
+size_t Sheet::GetRecalculationThreads() const {
+    return thread_pool_ ? thread_pool_->GetThreadCount() : 1;
 }
 
+void Sheet::SetRecalculationThreads(size_t threads) {
+    if (threads == GetRecalculationThreads()) {
+        return;
+    }
+    thread_pool_ = threads > 1 ? std::make_unique<ThreadPool>(threads) : nullptr;
+}
 
-bool Sheet::HasCircularDependecies(Position source_pos, Position ref_pos) const {
+std::pmr::memory_resource* Sheet::GetMemoryResource() {
+    return arena_.GetResource();
+}
 
-    if (source_pos == ref_pos) {
-        return true;
+Arena::Stats Sheet::GetAllocatorStats() const {
+    Arena::Stats stats = arena_.GetStats();
+    for (const auto& arena : import_arenas_) {
+        Arena::Stats import_stats = arena->GetStats();
+        stats.allocations += import_stats.allocations;
+        stats.objects_in_use += import_stats.objects_in_use;
+        stats.bytes_in_use += import_stats.bytes_in_use;
+        stats.chunks += import_stats.chunks;
+        stats.bytes_reserved += import_stats.bytes_reserved;
     }
+    return stats;
+}
 
-    if (dependencies_.count(source_pos) == 0) {
-        return false;
-    }
+StringPool& Sheet::GetStringPool() {
+    return strings_;
+}
 
-    return dependencies_.at(source_pos).count(ref_pos) != 0;
-    return false;
+const StringPool& Sheet::GetStringPool() const {
+    return strings_;
 }
 
+FormulaTable& Sheet::GetFormulaTable() {
+    return formulas_;
+}
 
-void Sheet::UpdateCache(Position& pos, std::string text, const CellValue& new_value) {
-    cache_[pos].second = new_value;
-    cache_[pos].first = std::move(text);
+const FormulaTable& Sheet::GetFormulaTable() const {
+    return formulas_;
 }
 
+const ColumnarValueStore& Sheet::GetValueStore() const {
+    return values_;
+}
 
-void Sheet::AssignDependencies(Position& source_pos, const std::vector<Position>& incoming_positions) {
-    for (const auto& income_pos : incoming_positions) {
-        dependencies_[income_pos].insert(source_pos);
+void Sheet::SetEvaluationMode(EvaluationMode mode) {
+    evaluation_mode_ = mode;
+    if (mode == EvaluationMode::Lazy) {
+        return;
     }
 
-    if (dependencies_.count(source_pos) != 0) {
-		const auto& deep_dependencies = dependencies_.at(source_pos);
-		for (const auto& deep_depend_pos : deep_dependencies) {
-			for (const auto& income_pos : incoming_positions) {
-				dependencies_[income_pos].insert(deep_depend_pos);
-			}
-		}
-    }
+    PositionSet dirty_cells;
+    ForEachCell(WHOLE_SHEET, [&dirty_cells](Position pos, const Cell& cell) {
+        if (cell.IsDirty()) {
+            dirty_cells.insert(pos);
+        }
+    });
+    last_recalculated_cells_ = EvaluateCells(dirty_cells);
+}
+
 
+void Sheet::UpdateDependentCells(const Position& pos) {
+    if (evaluation_mode_ == EvaluationMode::Lazy) {
+        InvalidateDependentCells(pos);
+        last_recalculated_cells_ = 0;
+    }
+    else {
+        RecalculateDependentCells(pos);
+    }
 }
 
-void Sheet::UpdateDependencies(const std::vector<Position>& old_dependencies, const std::vector<Position>& new_dependecies, Position& pos) {
-    //         pos
-    auto& dependent_cells_list = dependencies_[pos];
+size_t Sheet::RecalculateDependentCells(const Position& pos) {
+    last_recalculated_cells_ = EvaluateCells(dependencies_.CollectDependents(pos));
+    return last_recalculated_cells_;
+}
 
-    // ,    ,     ,         ,     .
-    for (const auto& old_depend_cell : old_dependencies) {
-        for (const auto& curr_depend_cell : dependent_cells_list) {
-            dependencies_[old_depend_cell].erase(curr_depend_cell);
-        }
-        dependencies_[old_depend_cell].erase(pos);
+void Sheet::InvalidateDependentCells(const Position& pos) {
+    std::vector<Position> to_visit{ pos };
+    while (!to_visit.empty()) {
+        Position current = to_visit.back();
+        to_visit.pop_back();
+        dependencies_.ForEachDependent(current, [&](Position dependent_pos) {
+            const Cell* cell = main_sheet_.Find(dependent_pos);
+            if (!cell->IsDirty()) {
+                cell->SetDirty(true);
+                values_.SetPending(dependent_pos);
+                to_visit.push_back(dependent_pos);
+            }
+        });
     }
+}
 
-    for (const auto& new_depend_cell : new_dependecies) {
-        for (const auto& curr_depend_cell : dependent_cells_list) {
-            dependencies_[new_depend_cell].insert(curr_depend_cell);
-        }
-        dependencies_[new_depend_cell].insert(pos);
+size_t Sheet::EvaluateCells(const PositionSet& cells) const {
+    auto ordered_cells = dependencies_.SortTopologically(cells);
+    if (thread_pool_ && ordered_cells.size() >= PARALLEL_RECALCULATION_MIN_CELLS) {
+        EvaluateCellsInParallel(ordered_cells);
+        return ordered_cells.size();
     }
 
+    for (const auto& dirty_pos : ordered_cells) {
+        EvaluateCell(dirty_pos);
+    }
+    return ordered_cells.size();
 }
 
-void Sheet::CountDependentCells(const Position& pos) {
-
-    if (dependencies_.count(pos) == 0) {
-        return;
+void Sheet::EvaluateCellsInParallel(const std::vector<Position>& ordered_cells) const {
+    // A cell's wave is one past the latest wave among its dirty precedents.
+    // Cells of one wave never read each other, and the values they read are
+    // final, so the result is the same as a sequential pass.
+    std::unordered_map<Position, size_t, PositionHasher, PostionEqual> cell_waves;
+    std::vector<std::vector<Position>> waves;
+    for (const auto& pos : ordered_cells) {
+        size_t wave = 0;
+        for (const auto& precedent_pos : dependencies_.GetPrecedents(pos)) {
+            auto precedent_wave = cell_waves.find(precedent_pos);
+            if (precedent_wave != cell_waves.end()) {
+                wave = std::max(wave, precedent_wave->second + 1);
+            }
+        }
+        for (const auto& range : dependencies_.GetRangePrecedents(pos)) {
+            ForEachEntryInRange(cell_waves, range, [&wave](Position, size_t precedent_wave) {
+                wave = std::max(wave, precedent_wave + 1);
+            });
+        }
+        cell_waves.emplace(pos, wave);
+        if (wave == waves.size()) {
+            waves.emplace_back();
+        }
+        waves[wave].push_back(pos);
     }
 
-    for (const auto& depenedent : dependencies_.at(pos)) {
-        const auto& cell = main_sheet_.at(depenedent.row).at(depenedent.col);
-        cache_.at(depenedent).second = cell->CalculateValue();
+    for (const auto& wave : waves) {
+        thread_pool_->ParallelFor(wave.size(), PARALLEL_RECALCULATION_GRAIN, [this, &wave](size_t i) {
+            EvaluateCell(wave[i]);
+        });
     }
+}
 
-}
\ No newline at end of file
+void Sheet::EvaluateCell(const Position& pos) const {
+    const Cell* cell = main_sheet_.Find(pos);
+    values_.Set(pos, cell->CalculateValue());
+    cell->SetDirty(false);
+}
+
+void Sheet::EvaluateDirtyCells(const std::vector<Position>& cells) const {
+    // Precedents are evaluated first and iteratively, so reading the end of a
+    // long dirty chain does not recurse through the whole chain.
+    PositionSet dirty_cells(cells.begin(), cells.end());
+    std::vector<Position> to_visit = cells;
+    while (!to_visit.empty()) {
+        Position current = to_visit.back();
+        to_visit.pop_back();
+        for (const auto& precedent_pos : dependencies_.GetPrecedents(current)) {
+            const Cell* cell = main_sheet_.Find(precedent_pos);
+            if (cell && cell->IsDirty() && dirty_cells.insert(precedent_pos).second) {
+                to_visit.push_back(precedent_pos);
+            }
+        }
+        // Cells of a range may be dirty without being in the graph at all.
+        // Their values are pending, which the value store finds without
+        // visiting the whole range.
+        for (const auto& range : dependencies_.GetRangePrecedents(current)) {
+            for (const auto& cell_pos : values_.FindPending(range)) {
+                if (dirty_cells.insert(cell_pos).second) {
+                    to_visit.push_back(cell_pos);
+                }
+            }
+        }
+    }
+    EvaluateCells(dirty_cells);
+}
@@ -1,7 +1,16 @@
 #pragma once
 
+#include "arena.h"
 #include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "formula_table.h"
+#include "occupancy_counter.h"
+#include "snapshot.h"
+#include "string_pool.h"
+#include "thread_pool.h"
+#include "tiled_grid.h"
+#include "value_store.h"
 
 #include <algorithm>
 #include <functional>
@@ -11,55 +20,181 @@
 
 class Cell;
 
+// Eager sheets recalculate dependent cells on every edit. Lazy sheets only
+// mark them dirty and evaluate a cell when its value is requested, keeping the
+// result until one of its inputs changes.
+enum class EvaluationMode {
+    Eager,
+    Lazy,
+};
+
+struct CellEdit {
+    Position pos;
+    std::string text;
+};
+
 class Sheet : public SheetInterface {
 public:
     using CellValue = CellInterface::Value;
+    using PositionSet = DependencyGraph::PositionSet;
 
-    Sheet();
+    explicit Sheet(EvaluationMode mode = EvaluationMode::Eager);
     ~Sheet();
 
     void SetCell(Position pos, std::string text) override;
 
+    // Applies the edits as one transaction. All texts are parsed and cycles are
+    // checked against the resulting graph before anything changes; on error the
+    // sheet is left untouched. Cells affected by several edits are recalculated
+    // once. A later edit of the same cell wins.
+    void ApplyBatch(std::vector<CellEdit> edits);
+
+    // Fills an empty sheet from texts laid out as PrintTexts writes them: a
+    // line per row, cells separated by tabs. Rows are split and formulas
+    // parsed on the recalculation threads; the references of all cells are
+    // then ordered at once and every formula is evaluated in a single pass,
+    // or left dirty in the lazy mode. Throws as SetCell does, and
+    // CircularDependencyException if the cells form any cycle; on error the
+    // sheet stays empty.
+    void ImportTexts(std::string_view texts);
+    // Imports the texts of a file, mapped into memory rather than read.
+    void LoadTexts(const std::string& path);
+
+    // Writes everything the sheet holds as a binary snapshot: the texts,
+    // formula trees, the order of the dependency graph and computed values,
+    // dirty cells staying dirty. Settings such as the evaluation mode are
+    // not part of it.
+    void WriteSnapshot(std::ostream& output) const;
+    void SaveSnapshot(const std::string& path) const;
+    // Fills an empty sheet from a snapshot without parsing or evaluating
+    // anything: trees are rebuilt from their nodes, the graph takes the
+    // saved order and values are copied column by column. Only an eager
+    // sheet evaluates the cells that were dirty when saved. Throws
+    // SnapshotError for a malformed snapshot, leaving the sheet empty.
+    void ReadSnapshot(std::string_view snapshot);
+    // Reads a snapshot file mapped into memory.
+    void LoadSnapshot(const std::string& path);
+
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
 
+    // Calls f(pos, cell) for every cell inside range in row-major order,
+    // empty cells kept for their dependents included. Only the occupied
+    // tiles of the range are visited, so a sparse range costs about as much
+    // as its cells. f must not add or remove cells. Throws
+    // InvalidPositionException for an invalid range.
+    template <class F>
+    void ForEachCell(Range range, F&& f) const {
+        CheckRangeValidity(range);
+        main_sheet_.ForEach(range, std::forward<F>(f));
+    }
+
     void ClearCell(Position pos) override;
 
     Size GetPrintableSize() const override;
 
-    bool CellCacheIsExist(Position pos) const;
+    // Value of the cell at pos, evaluating it first if it is dirty.
     CellValue GetCellCache(Position pos) const;
 
-    bool HasCircularDependecies(Position source_pos, Position ref_pos) const;
-    
+    // Number of cells evaluated by the last recalculation of dependent cells.
+    size_t GetLastRecalculatedCellsCount() const;
+
+    EvaluationMode GetEvaluationMode() const;
+    // Switching to the eager mode evaluates every dirty cell.
+    void SetEvaluationMode(EvaluationMode mode);
+
+    // Number of threads evaluating independent cells of a recalculation
+    // concurrently. With a single thread (the default) cells are evaluated
+    // one by one; results do not depend on the setting.
+    size_t GetRecalculationThreads() const;
+    void SetRecalculationThreads(size_t threads);
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    // Cell contents and formula trees of this sheet are allocated here and
+    // released together with the sheet.
+    std::pmr::memory_resource* GetMemoryResource();
+    Arena::Stats GetAllocatorStats() const;
+
+    // Texts of the text cells, each distinct one stored once.
+    StringPool& GetStringPool();
+    const StringPool& GetStringPool() const;
+
+    // Compiled formulas, shared by cells holding the same formula relative
+    // to their position.
+    FormulaTable& GetFormulaTable();
+    const FormulaTable& GetFormulaTable() const;
+
+    // Values of the cells as of their last evaluation; formulas aggregate
+    // ranges from here.
+    const ColumnarValueStore& GetValueStore() const;
+
 private:
-    std::unordered_map<int, std::unordered_map<int, std::unique_ptr<Cell>>> main_sheet_;
-    std::unordered_map<Position, std::pair<std::string, CellValue>, PositionHasher, PostionEqual> cache_;
-    std::unordered_map<Position, std::unordered_set<Position, PositionHasher, PostionEqual>, PositionHasher, PostionEqual> dependencies_;
-    std::unordered_set<Position, PositionHasher, PostionEqual> active_cells_;
-
-    Size print_area_ = { 0, 0 };
-    int max_row_ = -1;
-    int max_col_ = -1;
-    
+    // Declared first: everything below may hold memory of the arena.
+    Arena arena_;
+    // Formula trees parsed by ImportTexts, an arena per parsing task. An arena
+    // is freed once edits have replaced every tree allocated in it.
+    std::vector<std::unique_ptr<Arena>> import_arenas_;
+    StringPool strings_;
+    FormulaTable formulas_;
+    TiledGrid<Cell> main_sheet_;
+    // Computed values of the cells in main_sheet_.
+    mutable ColumnarValueStore values_;
+    DependencyGraph dependencies_;
+    // Active cells per row and column; the highest occupied ones bound the
+    // printable area.
+    OccupancyCounter<Position::MAX_ROWS> active_rows_;
+    OccupancyCounter<Position::MAX_COLS> active_cols_;
+
+    size_t last_recalculated_cells_ = 0;
+    EvaluationMode evaluation_mode_;
+    std::unique_ptr<ThreadPool> thread_pool_;
+
     void CreateNewCell(Position pos, std::string text);
+    // Frees the import arenas no formula tree is left in; called after edits.
+    void ReleaseImportArenas();
+
+    // Calls body(i) for every i in [0, count) on the thread pool if there is
+    // one.
+    void RunInParallel(size_t count, size_t grain, const std::function<void(size_t)>& body) const;
 
     void CheckPosValidity(Position pos) const;
+    void CheckRangeValidity(Range range) const;
 
-    void ActivePosition(Position pos);
+    // Marks cell, stored at pos or about to replace the cell there, as
+    // active. The area only grows if the cell at pos was not active before.
+    void ActivePosition(Position pos, Cell& cell);
+    // Takes an active cell that was cleared out of the printable area.
     void InactivePosition(Position pos);
 
-    Size GetActualTableArea();
-    void PrintValue(std::ostream& os, const CellInterface::Value& value) const;
-
-    void UpdateCache(Position& pos, std::string text, const CellValue& new_value);
-    void AssignDependencies(Position& source_pos, const std::vector<Position>& dependent_pos);
-    void UpdateDependencies(const std::vector<Position>& old_dependencies, const std::vector<Position>& new_dependecies, Position& pos);
-    void CountDependentCells(const Position& pos);
+    Range GetPrintRange() const;
+    // Writes the rows of the printable area, tab-separated, with
+    // print_cell(pos, cell, buffer) appending every cell that exists. Rows
+    // are formatted in chunks on the thread pool and written in order.
+    void PrintRows(std::ostream& output, const std::function<void(Position, const Cell&, std::string&)>& print_cell) const;
+
+    // Brings the cells depending on pos up to date according to the
+    // evaluation mode.
+    void UpdateDependentCells(const Position& pos);
+
+    // Marks every cell that depends on pos as dirty and evaluates each of them
+    // exactly once, after all of its dirty precedents. Returns the number of
+    // evaluated cells.
+    size_t RecalculateDependentCells(const Position& pos);
+
+    // Marks the cells depending on pos as dirty without evaluating them. The
+    // walk stops at cells that are dirty already: their dependents are too.
+    void InvalidateDependentCells(const Position& pos);
+
+    // Evaluates the given cells in topological order and marks them clean.
+    size_t EvaluateCells(const PositionSet& cells) const;
+    // Splits the cells into waves whose members only depend on earlier waves
+    // and evaluates every wave on the thread pool.
+    void EvaluateCellsInParallel(const std::vector<Position>& ordered_cells) const;
+    void EvaluateCell(const Position& pos) const;
+    // Evaluates dirty cells together with their dirty precedents.
+    void EvaluateDirtyCells(const std::vector<Position>& cells) const;
 };
 
 
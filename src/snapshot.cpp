@@ -0,0 +1,115 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+#include <string>
+
+namespace {
+    const char MAGIC[8] = { 'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P' };
+    // reads back differently on a machine of the other byte order
+    const std::uint64_t BYTE_ORDER_MARK = 0x0102030405060708;
+    const size_t SECTION_ALIGNMENT = 8;
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version = 0;
+        std::uint32_t section_count = 0;
+        std::uint64_t byte_order = 0;
+    };
+
+    struct SectionEntry {
+        std::uint32_t id = 0;
+        std::uint32_t reserved = 0;
+        std::uint64_t offset = 0;
+        std::uint64_t size = 0;
+    };
+
+    size_t AlignUp(size_t size) {
+        return (size + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+    }
+}
+
+void SnapshotWriter::AddSection(SnapshotSection id, const void* data, size_t size) {
+    sections_.push_back({ id, data, size });
+}
+
+void SnapshotWriter::Write(std::ostream& output) const {
+    Header header;
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.section_count = static_cast<std::uint32_t>(sections_.size());
+    header.byte_order = BYTE_ORDER_MARK;
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    size_t offset = AlignUp(sizeof(Header) + sections_.size() * sizeof(SectionEntry));
+    for (const auto& section : sections_) {
+        SectionEntry entry;
+        entry.id = static_cast<std::uint32_t>(section.id);
+        entry.offset = offset;
+        entry.size = section.size;
+        output.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+        offset += AlignUp(section.size);
+    }
+
+    const char padding[SECTION_ALIGNMENT] = {};
+    auto pad = [&output, &padding](size_t size) {
+        output.write(padding, AlignUp(size) - size);
+    };
+    pad(sizeof(Header) + sections_.size() * sizeof(SectionEntry));
+    for (const auto& section : sections_) {
+        output.write(static_cast<const char*>(section.data), section.size);
+        pad(section.size);
+    }
+    if (!output) {
+        throw SnapshotError("Cannot write the snapshot");
+    }
+}
+
+SnapshotReader::SnapshotReader(std::string_view snapshot)
+    : snapshot_(snapshot) {
+    Header header;
+    if (snapshot.size() < sizeof(header)) {
+        throw SnapshotError("Not a sheet snapshot");
+    }
+    std::memcpy(&header, snapshot.data(), sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        throw SnapshotError("Not a sheet snapshot");
+    }
+    if (header.byte_order != BYTE_ORDER_MARK) {
+        throw SnapshotError("The snapshot was written on a machine of another byte order");
+    }
+    if (header.version != SNAPSHOT_VERSION) {
+        throw SnapshotError("Unsupported snapshot version " + std::to_string(header.version));
+    }
+    if (header.section_count > (snapshot.size() - sizeof(header)) / sizeof(SectionEntry)) {
+        throw SnapshotError("Truncated snapshot");
+    }
+
+    for (std::uint32_t i = 0; i < header.section_count; ++i) {
+        SectionEntry entry;
+        std::memcpy(&entry, snapshot.data() + sizeof(header) + i * sizeof(entry), sizeof(entry));
+        if (entry.offset % SECTION_ALIGNMENT != 0 || entry.offset > snapshot.size()
+            || entry.size > snapshot.size() - entry.offset) {
+            throw SnapshotError("Truncated snapshot");
+        }
+        sections_.emplace_back(static_cast<SnapshotSection>(entry.id), snapshot.substr(entry.offset, entry.size));
+    }
+}
+
+std::string_view SnapshotReader::GetBytes(SnapshotSection id, size_t record_size, size_t alignment) const {
+    auto section = std::find_if(sections_.begin(), sections_.end(), [id](const auto& entry) {
+        return entry.first == id;
+    });
+    if (section == sections_.end()) {
+        return {};
+    }
+    std::string_view bytes = section->second;
+    if (bytes.size() % record_size != 0) {
+        throw SnapshotError("Malformed snapshot section " + std::to_string(static_cast<std::uint32_t>(id)));
+    }
+    if (reinterpret_cast<std::uintptr_t>(bytes.data()) % alignment != 0) {
+        throw SnapshotError("The snapshot is not aligned in memory");
+    }
+    return bytes;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Binary snapshots of a sheet. A snapshot is a header, a table of sections
+// and the sections themselves, each an array of fixed-size records aligned to
+// 8 bytes. Nothing is encoded: records are stored as they lie in memory, so a
+// mapped snapshot is read in place and only the pages actually used are ever
+// loaded. Snapshots are therefore tied to the byte order, which the header
+// records, and to the layout of the records: changing it must bump
+// SNAPSHOT_VERSION. Records spell out their padding as zeroed reserved fields,
+// so no indeterminate bytes are ever written.
+
+class SnapshotError : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+inline constexpr std::uint32_t SNAPSHOT_VERSION = 1;
+
+enum class SnapshotSection : std::uint32_t {
+    // offsets of the texts into StringData, one past the last included
+    StringOffsets = 1,
+    StringData,
+    // SnapshotTree records
+    Trees,
+    // FormulaAST::Node records of all trees one after another
+    TreeNodes,
+    // SnapshotCell records in row-major order
+    Cells,
+    // cells of the dependency graph in topological order
+    Order,
+    // SnapshotColumn records of the value store
+    Columns,
+    // tags and numbers of all columns one after another
+    ColumnTags,
+    ColumnNumbers,
+};
+
+struct SnapshotTree {
+    // the cell the tree was parsed for
+    std::int32_t anchor_row = 0;
+    std::int32_t anchor_col = 0;
+    // the relative key of the formula, a text of StringData
+    std::uint32_t key = 0;
+    std::uint32_t node_count = 0;
+    std::uint64_t first_node = 0;
+};
+static_assert(sizeof(SnapshotTree) == 24);
+
+struct SnapshotCell {
+    enum Kind : std::uint8_t {
+        Empty,
+        Text,
+        Formula,
+    };
+
+    enum Flags : std::uint8_t {
+        Dirty = 1,
+        // counted in the printable area
+        Active = 2,
+    };
+
+    std::int32_t row = 0;
+    std::int32_t col = 0;
+    Kind kind = Empty;
+    std::uint8_t flags = 0;
+    std::uint16_t reserved = 0;
+    // a text of StringData or a tree
+    std::uint32_t index = 0;
+};
+static_assert(sizeof(SnapshotCell) == 16);
+
+struct SnapshotColumn {
+    std::uint64_t rows = 0;
+};
+static_assert(sizeof(SnapshotColumn) == 8);
+
+// Collects sections and writes them out with their table. The data of a
+// section is referenced, not copied, until Write.
+class SnapshotWriter {
+public:
+    template <class T>
+    void AddSection(SnapshotSection id, const std::vector<T>& records) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        AddSection(id, records.data(), records.size() * sizeof(T));
+    }
+
+    void AddSection(SnapshotSection id, const void* data, size_t size);
+    void Write(std::ostream& output) const;
+
+private:
+    struct Section {
+        SnapshotSection id;
+        const void* data;
+        size_t size;
+    };
+
+    std::vector<Section> sections_;
+};
+
+// Checks the header and the section table of a snapshot held in memory and
+// hands out its sections in place. The memory must outlive the reader and
+// what it returns. Throws SnapshotError for anything malformed.
+class SnapshotReader {
+public:
+    template <class T>
+    struct Records {
+        const T* data = nullptr;
+        size_t size = 0;
+
+        const T* begin() const {
+            return data;
+        }
+        const T* end() const {
+            return data + size;
+        }
+        const T& operator[](size_t i) const {
+            return data[i];
+        }
+    };
+
+    explicit SnapshotReader(std::string_view snapshot);
+
+    // A missing section reads as empty.
+    template <class T>
+    Records<T> GetSection(SnapshotSection id) const {
+        static_assert(std::is_trivially_copyable_v<T>);
+        std::string_view bytes = GetBytes(id, sizeof(T), alignof(T));
+        return { reinterpret_cast<const T*>(bytes.data()), bytes.size() / sizeof(T) };
+    }
+
+private:
+    std::string_view snapshot_;
+    std::vector<std::pair<SnapshotSection, std::string_view>> sections_;
+
+    std::string_view GetBytes(SnapshotSection id, size_t record_size, size_t alignment) const;
+};
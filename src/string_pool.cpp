@@ -0,0 +1,79 @@
+#include "string_pool.h"
+
+#include "common.h"
+
+#include <cassert>
+#include <utility>
+
+StringPool::Handle::Handle(Entry* entry)
+    : entry_(entry) {
+    ++entry_->references;
+}
+
+StringPool::Handle::Handle(const Handle& other)
+    : entry_(other.entry_) {
+    if (entry_) {
+        ++entry_->references;
+    }
+}
+
+StringPool::Handle::Handle(Handle&& other) noexcept
+    : entry_(std::exchange(other.entry_, nullptr)) {
+}
+
+StringPool::Handle& StringPool::Handle::operator=(Handle other) noexcept {
+    std::swap(entry_, other.entry_);
+    return *this;
+}
+
+StringPool::Handle::~Handle() {
+    if (entry_ && --entry_->references == 0) {
+        entry_->pool->Release(entry_);
+    }
+}
+
+std::string_view StringPool::Handle::GetText() const {
+    if (!entry_) {
+        return {};
+    }
+    return entry_->text;
+}
+
+std::string_view StringPool::Handle::GetValue() const {
+    return GetText().substr(entry_ ? entry_->value_offset : 0);
+}
+
+StringPool::Entry::Entry(std::string_view text, StringPool* pool)
+    : text(text, pool->resource_)
+    , value_offset(!text.empty() && text[0] == ESCAPE_SIGN ? 1 : 0)
+    , pool(pool) {
+}
+
+StringPool::StringPool(std::pmr::memory_resource* resource)
+    : resource_(resource) {
+}
+
+StringPool::~StringPool() {
+    assert(entries_.empty());
+}
+
+StringPool::Handle StringPool::Intern(std::string_view text) {
+    auto found = entries_.find(text);
+    if (found != entries_.end()) {
+        return Handle(found->second.get());
+    }
+
+    auto entry = MakeArenaPtr<Entry>(resource_, text, this);
+    Entry* raw_entry = entry.get();
+    entries_.emplace(raw_entry->text, std::move(entry));
+    return Handle(raw_entry);
+}
+
+size_t StringPool::GetSize() const {
+    return entries_.size();
+}
+
+void StringPool::Release(Entry* entry) {
+    // the key views the entry, so it is looked up before anything is freed
+    entries_.erase(entries_.find(std::string_view(entry->text)));
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "arena.h"
+
+#include <cstddef>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Sheet-wide set of distinct cell texts. Interning a text that is already
+// present returns a handle to the same entry, so a label repeated in many
+// cells is stored once. Entries are reference counted by their handles and
+// removed with the last one. Not thread-safe.
+class StringPool {
+    struct Entry;
+
+public:
+    // Pointer-sized reference to an interned text.
+    class Handle {
+    public:
+        Handle() = default;
+        Handle(const Handle& other);
+        Handle(Handle&& other) noexcept;
+        Handle& operator=(Handle other) noexcept;
+        ~Handle();
+
+        // The text as it was entered.
+        std::string_view GetText() const;
+        // The text without a leading escape sign.
+        std::string_view GetValue() const;
+
+    private:
+        friend class StringPool;
+
+        explicit Handle(Entry* entry);
+
+        Entry* entry_ = nullptr;
+    };
+
+    explicit StringPool(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+    ~StringPool();
+
+    Handle Intern(std::string_view text);
+
+    // Number of distinct texts currently held.
+    size_t GetSize() const;
+
+private:
+    struct Entry {
+        Entry(std::string_view text, StringPool* pool);
+
+        std::pmr::string text;
+        size_t value_offset = 0;
+        size_t references = 0;
+        StringPool* pool = nullptr;
+    };
+
+    std::pmr::memory_resource* resource_;
+    // Keys view the text of their entry. Entries live in the resource; the
+    // index itself holds one node per distinct text.
+    std::unordered_map<std::string_view, ArenaPtr<Entry>> entries_;
+
+    void Release(Entry* entry);
+};
@@ -1,11 +1,10 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
 #include <algorithm>
+#include <charconv>
+#include <tuple>
 
 const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
 const int MAX_POS_LETTER_COUNT = 3;
 
 const Position Position::NONE = { -1, -1 };
@@ -23,26 +22,29 @@ bool Position::IsValid() const {
 }
 
 std::string Position::ToString() const {
+    char buffer[MAX_POSITION_LENGTH];
+    return std::string(buffer, ToChars(buffer));
+}
+
+char* Position::ToChars(char* buffer) const {
     if (!IsValid()) {
-        return "";
+        return buffer;
     }
 
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
+    // Letters come out last first.
+    char letters[MAX_POS_LETTER_COUNT];
+    int letter_count = 0;
+    for (int c = col; c >= 0; c = c / LETTERS - 1) {
+        letters[letter_count++] = static_cast<char>('A' + c % LETTERS);
     }
+    buffer = std::reverse_copy(letters, letters + letter_count, buffer);
 
-    result += std::to_string(row + 1);
-
-    return result;
+    return std::to_chars(buffer, buffer + MAX_POSITION_LENGTH - letter_count, row + 1).ptr;
 }
 
 Position Position::FromString(std::string_view str) {
     auto it = std::find_if(str.begin(), str.end(), [](const char c) {
-        return !(std::isalpha(c) && std::isupper(c));
+        return c < 'A' || c > 'Z';
         });
     auto letters = str.substr(0, it - str.begin());
     auto digits = str.substr(it - str.begin());
@@ -54,13 +56,14 @@ Position Position::FromString(std::string_view str) {
         return Position::NONE;
     }
 
-    if (!std::isdigit(digits[0])) {
+    if (digits[0] < '0' || digits[0] > '9') {
         return Position::NONE;
     }
 
+    // Too many digits for an int fail like any other malformed row.
     int row;
-    std::istringstream row_in{ std::string{digits} };
-    if (!(row_in >> row) || !row_in.eof()) {
+    auto [end, error] = std::from_chars(digits.data(), digits.data() + digits.size(), row);
+    if (error != std::errc() || end != digits.data() + digits.size()) {
         return Position::NONE;
     }
 
@@ -75,4 +78,20 @@ Position Position::FromString(std::string_view str) {
 
 bool Size::operator==(Size rhs) const {
     return cols == rhs.cols && rows == rhs.rows;
+}
+
+bool Range::operator==(Range rhs) const {
+    return from == rhs.from && to == rhs.to;
+}
+
+bool Range::IsValid() const {
+    return from.IsValid() && to.IsValid() && from.row <= to.row && from.col <= to.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= from.row && pos.row <= to.row && pos.col >= from.col && pos.col <= to.col;
+}
+
+Size Range::GetSize() const {
+    return { to.row - from.row + 1, to.col - from.col + 1 };
 }
\ No newline at end of file
@@ -0,0 +1,135 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(size_t thread_count) {
+    thread_count = std::max<size_t>(thread_count, 1);
+    for (size_t i = 0; i < thread_count; ++i) {
+        queues_.push_back(std::make_unique<TaskQueue>());
+    }
+    // The last queue belongs to the thread calling ParallelFor.
+    for (size_t i = 0; i + 1 < thread_count; ++i) {
+        workers_.emplace_back([this, i] {
+            WorkerLoop(i);
+        });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(sleep_mutex_);
+        stopping_ = true;
+    }
+    wake_up_.notify_all();
+    for (auto& worker : workers_) {
+        worker.join();
+    }
+}
+
+size_t ThreadPool::GetThreadCount() const {
+    return queues_.size();
+}
+
+void ThreadPool::ParallelFor(size_t count, size_t grain, const std::function<void(size_t)>& body) {
+    grain = std::max<size_t>(grain, 1);
+    if (workers_.empty() || count <= grain) {
+        for (size_t i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+
+    std::atomic<size_t> remaining_chunks = (count + grain - 1) / grain;
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    size_t queue_id = 0;
+    for (size_t begin = 0; begin < count; begin += grain) {
+        size_t end = std::min(count, begin + grain);
+        Push(queue_id, [&, begin, end] {
+            try {
+                for (size_t i = begin; i < end; ++i) {
+                    body(i);
+                }
+            }
+            catch (...) {
+                std::lock_guard lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+            remaining_chunks.fetch_sub(1, std::memory_order_acq_rel);
+        });
+        queue_id = (queue_id + 1) % queues_.size();
+    }
+    wake_up_.notify_all();
+
+    const size_t own_queue_id = queues_.size() - 1;
+    Task task;
+    while (remaining_chunks.load(std::memory_order_acquire) != 0) {
+        if (TryTake(own_queue_id, task)) {
+            task();
+        }
+        else {
+            std::this_thread::yield();
+        }
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void ThreadPool::Push(size_t queue_id, Task task) {
+    // Counted before it becomes visible so that the counter never drops
+    // below the number of queued tasks.
+    {
+        std::lock_guard lock(sleep_mutex_);
+        ++queued_tasks_;
+    }
+    auto& queue = *queues_[queue_id];
+    std::lock_guard lock(queue.mutex);
+    queue.tasks.push_back(std::move(task));
+}
+
+bool ThreadPool::TryTake(size_t queue_id, Task& task) {
+    {
+        auto& own_queue = *queues_[queue_id];
+        std::lock_guard lock(own_queue.mutex);
+        if (!own_queue.tasks.empty()) {
+            task = std::move(own_queue.tasks.back());
+            own_queue.tasks.pop_back();
+            --queued_tasks_;
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues_.size(); ++i) {
+        auto& victim = *queues_[(queue_id + i) % queues_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            --queued_tasks_;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerLoop(size_t queue_id) {
+    Task task;
+    while (true) {
+        if (TryTake(queue_id, task)) {
+            task();
+            task = nullptr;
+            continue;
+        }
+        std::unique_lock lock(sleep_mutex_);
+        wake_up_.wait(lock, [this] {
+            return stopping_ || queued_tasks_ > 0;
+        });
+        if (stopping_) {
+            return;
+        }
+    }
+}
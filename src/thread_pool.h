@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed-size pool of worker threads with a task deque per worker. A worker
+// takes its newest task first and, once its own deque is empty, steals the
+// oldest task of another worker. The thread calling ParallelFor works on the
+// batch too instead of blocking.
+class ThreadPool {
+public:
+    // Creates a pool that runs tasks on thread_count threads in total, the
+    // calling thread included.
+    explicit ThreadPool(size_t thread_count);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    size_t GetThreadCount() const;
+
+    // Calls body(i) for every i in [0, count), in chunks of at most grain
+    // indices, and returns once all of them are done. The first exception
+    // thrown by body is rethrown here.
+    void ParallelFor(size_t count, size_t grain, const std::function<void(size_t)>& body);
+
+private:
+    using Task = std::function<void()>;
+
+    struct TaskQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<TaskQueue>> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex sleep_mutex_;
+    std::condition_variable wake_up_;
+    std::atomic<size_t> queued_tasks_ = 0;
+    bool stopping_ = false;
+
+    void Push(size_t queue_id, Task task);
+    // Pops from the given queue or steals from the others.
+    bool TryTake(size_t queue_id, Task& task);
+    void WorkerLoop(size_t queue_id);
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Sparse two-dimensional storage split into TILE_SIZE x TILE_SIZE tiles.
+// A tile is allocated on the first write into it and holds, row by row, a
+// 4-byte index of every value into a pool shared by all tiles, so a sparse
+// grid pays a few kilobytes per tile rather than a slot of T per position.
+// Lookup is index arithmetic; values never move while they are stored.
+template <class T>
+class TiledGrid {
+public:
+    static const int TILE_SIZE = 64;
+
+    const T* Find(Position pos) const {
+        const Tile* tile = FindTile(pos);
+        if (!tile || !IsOccupied(*tile, pos)) {
+            return nullptr;
+        }
+        return &*values_[tile->slots[SlotIndex(pos)]];
+    }
+
+    T* Find(Position pos) {
+        return const_cast<T*>(std::as_const(*this).Find(pos));
+    }
+
+    // Constructs a value at pos, replacing the previous one.
+    template <class... Args>
+    T& Emplace(Position pos, Args&&... args) {
+        Tile& tile = GetOrCreateTile(pos);
+        uint32_t& slot = tile.slots[SlotIndex(pos)];
+        if (!IsOccupied(tile, pos)) {
+            slot = AllocateValue();
+            tile.occupied[pos.row % TILE_SIZE] |= uint64_t{ 1 } << pos.col % TILE_SIZE;
+            ++tile.size;
+            ++size_;
+        }
+        return values_[slot].emplace(std::forward<Args>(args)...);
+    }
+
+    // Removes the value at pos. A tile is released with its last value.
+    bool Erase(Position pos) {
+        Tile* tile = FindTile(pos);
+        if (!tile || !IsOccupied(*tile, pos)) {
+            return false;
+        }
+        const uint32_t slot = tile->slots[SlotIndex(pos)];
+        values_[slot].reset();
+        free_values_.push_back(slot);
+        tile->occupied[pos.row % TILE_SIZE] &= ~(uint64_t{ 1 } << pos.col % TILE_SIZE);
+        --size_;
+        if (--tile->size == 0) {
+            tiles_[pos.row / TILE_SIZE][pos.col / TILE_SIZE].reset();
+        }
+        return true;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // Bytes held by the grid itself: its tiles and the pool of values, not
+    // counting memory the values own.
+    size_t GetReservedBytes() const {
+        size_t bytes = tiles_.capacity() * sizeof(tiles_[0]);
+        for (const auto& row : tiles_) {
+            bytes += row.capacity() * sizeof(row[0]);
+            bytes += std::count_if(row.begin(), row.end(), [](const auto& tile) { return tile != nullptr; }) * sizeof(Tile);
+        }
+        return bytes + values_.size() * sizeof(values_[0]) + free_values_.capacity() * sizeof(free_values_[0]);
+    }
+
+    // Calls f(pos, value) for every value inside range, in row-major order.
+    // Tiles that were never written are skipped, and within a tile only the
+    // occupied slots of a row are visited, so the cost follows the number of
+    // values and tiles rather than the area of range.
+    template <class F>
+    void ForEach(Range range, F&& f) const {
+        // Tiles of the current tile row that overlap range, by column.
+        std::vector<std::pair<int, const Tile*>> row_tiles;
+        const size_t last_tile_row = std::min(static_cast<size_t>(range.to.row / TILE_SIZE) + 1, tiles_.size());
+        for (size_t tile_row = range.from.row / TILE_SIZE; tile_row < last_tile_row; ++tile_row) {
+            const auto& tiles = tiles_[tile_row];
+            const size_t last_tile_col = std::min(static_cast<size_t>(range.to.col / TILE_SIZE) + 1, tiles.size());
+            row_tiles.clear();
+            for (size_t tile_col = range.from.col / TILE_SIZE; tile_col < last_tile_col; ++tile_col) {
+                if (tiles[tile_col]) {
+                    row_tiles.emplace_back(static_cast<int>(tile_col) * TILE_SIZE, tiles[tile_col].get());
+                }
+            }
+            if (row_tiles.empty()) {
+                continue;
+            }
+            const int first_row = std::max<int>(range.from.row, tile_row * TILE_SIZE);
+            const int last_row = std::min<int>(range.to.row, (tile_row + 1) * TILE_SIZE - 1);
+            for (int row = first_row; row <= last_row; ++row) {
+                for (const auto& [first_tile_col, tile] : row_tiles) {
+                    const int first_col = std::max(range.from.col, first_tile_col) - first_tile_col;
+                    const int last_col = std::min(range.to.col, first_tile_col + TILE_SIZE - 1) - first_tile_col;
+                    uint64_t columns = tile->occupied[row % TILE_SIZE] & ColumnMask(first_col, last_col);
+                    for (; columns != 0; columns &= columns - 1) {
+                        const int col = first_tile_col + CountTrailingZeros(columns);
+                        f(Position{ row, col }, *values_[tile->slots[SlotIndex({ row, col })]]);
+                    }
+                }
+            }
+        }
+    }
+
+private:
+    static const int TILE_CELLS = TILE_SIZE * TILE_SIZE;
+    static_assert(TILE_SIZE == 64, "a row of a tile is tracked by the bits of a uint64_t");
+
+    struct Tile {
+        // indices into values_, meaningful where occupied has a bit set
+        std::array<uint32_t, TILE_CELLS> slots;
+        // a bit per column of every row, set where a slot holds a value
+        std::array<uint64_t, TILE_SIZE> occupied{};
+        size_t size = 0;
+    };
+
+    // Tile rows, each as long as the rightmost tile written into it.
+    std::vector<std::vector<std::unique_ptr<Tile>>> tiles_;
+    // Values of all tiles. A deque never moves its elements as it grows, and
+    // erased values leave empty entries for the next ones to reuse, so the
+    // pool is as long as the most values ever stored at once.
+    std::deque<std::optional<T>> values_;
+    std::vector<uint32_t> free_values_;
+    size_t size_ = 0;
+
+    uint32_t AllocateValue() {
+        if (!free_values_.empty()) {
+            const uint32_t index = free_values_.back();
+            free_values_.pop_back();
+            return index;
+        }
+        values_.emplace_back();
+        return static_cast<uint32_t>(values_.size() - 1);
+    }
+
+    static bool IsOccupied(const Tile& tile, Position pos) {
+        return (tile.occupied[pos.row % TILE_SIZE] >> pos.col % TILE_SIZE & 1) != 0;
+    }
+
+    // Bits first to last of a row, both included.
+    static uint64_t ColumnMask(int first, int last) {
+        return (~uint64_t{ 0 } >> (TILE_SIZE - 1 - last)) & (~uint64_t{ 0 } << first);
+    }
+
+    // The index of the lowest set bit of a non-zero mask.
+    static int CountTrailingZeros(uint64_t mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, mask);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctzll(mask);
+#endif
+    }
+
+    static size_t SlotIndex(Position pos) {
+        return static_cast<size_t>(pos.row % TILE_SIZE) * TILE_SIZE + pos.col % TILE_SIZE;
+    }
+
+    const Tile* FindTile(Position pos) const {
+        assert(pos.row >= 0 && pos.col >= 0);
+        size_t tile_row = pos.row / TILE_SIZE;
+        size_t tile_col = pos.col / TILE_SIZE;
+        if (tile_row >= tiles_.size() || tile_col >= tiles_[tile_row].size()) {
+            return nullptr;
+        }
+        return tiles_[tile_row][tile_col].get();
+    }
+
+    Tile* FindTile(Position pos) {
+        return const_cast<Tile*>(std::as_const(*this).FindTile(pos));
+    }
+
+    Tile& GetOrCreateTile(Position pos) {
+        size_t tile_row = pos.row / TILE_SIZE;
+        size_t tile_col = pos.col / TILE_SIZE;
+        if (tile_row >= tiles_.size()) {
+            tiles_.resize(tile_row + 1);
+        }
+        auto& row = tiles_[tile_row];
+        if (tile_col >= row.size()) {
+            row.resize(tile_col + 1);
+        }
+        if (!row[tile_col]) {
+            row[tile_col] = std::make_unique<Tile>();
+        }
+        return *row[tile_col];
+    }
+};
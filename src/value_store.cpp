@@ -0,0 +1,446 @@
+#include "value_store.h"
+
+#include "formula.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+#include <limits>
+
+namespace {
+    using Tag = ColumnarValueStore::Tag;
+
+    ColumnarValueStore::Tag ErrorTag(FormulaError error) {
+        switch (error.GetCategory()) {
+        case FormulaError::Category::Ref:
+            return ColumnarValueStore::Tag::RefError;
+        case FormulaError::Category::Value:
+            return ColumnarValueStore::Tag::ValueError;
+        default:
+            return ColumnarValueStore::Tag::Div0Error;
+        }
+    }
+
+    bool IsNumber(Tag tag) {
+        return tag == Tag::Number || tag == Tag::NumericText;
+    }
+
+    bool IsError(Tag tag) {
+        return tag >= Tag::RefError;
+    }
+
+    FormulaError TagError(Tag tag) {
+        switch (tag) {
+        case Tag::RefError:
+            return FormulaError::Category::Ref;
+        case Tag::ValueError:
+            return FormulaError::Category::Value;
+        default:
+            assert(tag == Tag::Div0Error);
+            return FormulaError::Category::Div0;
+        }
+    }
+
+    // The kernels below keep LANES independent accumulators, which the
+    // compiler maps onto vector registers; with a single accumulator every
+    // step would wait for the previous one.
+    const size_t LANES = 8;
+
+    struct TagSummary {
+        uint32_t numbers = 0;
+        uint32_t pending = 0;
+        bool has_errors = false;
+    };
+
+    TagSummary ScanTags(const Tag* tags, size_t count) {
+        uint32_t numbers[LANES] = {};
+        uint32_t pending[LANES] = {};
+        bool errors[LANES] = {};
+        size_t i = 0;
+        for (; i + LANES <= count; i += LANES) {
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                numbers[lane] += IsNumber(tags[i + lane]);
+                pending[lane] += tags[i + lane] == Tag::Pending;
+                errors[lane] |= IsError(tags[i + lane]);
+            }
+        }
+
+        TagSummary summary;
+        for (; i < count; ++i) {
+            summary.numbers += IsNumber(tags[i]);
+            summary.pending += tags[i] == Tag::Pending;
+            summary.has_errors |= IsError(tags[i]);
+        }
+        for (size_t lane = 0; lane < LANES; ++lane) {
+            summary.numbers += numbers[lane];
+            summary.pending += pending[lane];
+            summary.has_errors |= errors[lane];
+        }
+        return summary;
+    }
+
+    // Folds every slot; with masked set, slots that hold no number are read
+    // as initial instead.
+    template <bool masked, class Combine>
+    double Reduce(const double* numbers, const Tag* tags, size_t count, double initial, Combine combine) {
+        double lanes[LANES];
+        std::fill(std::begin(lanes), std::end(lanes), initial);
+        auto read = [&](size_t i) {
+            if constexpr (masked) {
+                return IsNumber(tags[i]) ? numbers[i] : initial;
+            }
+            else {
+                return numbers[i];
+            }
+        };
+
+        size_t i = 0;
+        for (; i + LANES <= count; i += LANES) {
+            for (size_t lane = 0; lane < LANES; ++lane) {
+                lanes[lane] = combine(lanes[lane], read(i + lane));
+            }
+        }
+
+        double result = initial;
+        for (; i < count; ++i) {
+            result = combine(result, read(i));
+        }
+        for (double lane : lanes) {
+            result = combine(result, lane);
+        }
+        return result;
+    }
+
+    template <class Combine>
+    double ReduceNumbers(const double* numbers, const Tag* tags, size_t count, uint32_t numbers_count,
+        double initial, Combine combine) {
+        if (numbers_count == count) {
+            return Reduce<false>(numbers, tags, count, initial, combine);
+        }
+        return Reduce<true>(numbers, tags, count, initial, combine);
+    }
+}
+
+ColumnarValueStore::Node::Node(const Node& other)
+    : summary(other.summary)
+    , stale(other.stale.load(std::memory_order_relaxed)) {
+}
+
+void ColumnarValueStore::Set(Position pos, const CellInterface::Value& value) {
+    Column& column = GetOrCreateSlot(pos);
+    if (std::holds_alternative<double>(value)) {
+        column.numbers[pos.row] = std::get<double>(value);
+        column.tags[pos.row] = Tag::Number;
+    }
+    else if (std::holds_alternative<std::string>(value)) {
+        const auto& text = std::get<std::string>(value);
+        auto number = text.empty() ? std::nullopt : ParseNumber(text);
+        column.numbers[pos.row] = number.value_or(0);
+        column.tags[pos.row] = number ? Tag::NumericText : Tag::Text;
+    }
+    else {
+        column.numbers[pos.row] = 0;
+        column.tags[pos.row] = ErrorTag(std::get<FormulaError>(value));
+    }
+    MarkStale(pos);
+}
+
+void ColumnarValueStore::SetPending(Position pos) {
+    Column& column = GetOrCreateSlot(pos);
+    column.numbers[pos.row] = 0;
+    column.tags[pos.row] = Tag::Pending;
+    MarkStale(pos);
+}
+
+void ColumnarValueStore::Erase(Position pos) {
+    if (static_cast<size_t>(pos.col) >= columns_.size()) {
+        return;
+    }
+    Column& column = columns_[pos.col];
+    if (static_cast<size_t>(pos.row) >= column.tags.size()) {
+        return;
+    }
+    column.numbers[pos.row] = 0;
+    column.tags[pos.row] = Tag::Empty;
+    MarkStale(pos);
+}
+
+ColumnarValueStore::Tag ColumnarValueStore::GetTag(Position pos) const {
+    const Column* column = FindColumn(pos.col);
+    if (!column || static_cast<size_t>(pos.row) >= column->tags.size()) {
+        return Tag::Empty;
+    }
+    return column->tags[pos.row];
+}
+
+double ColumnarValueStore::GetNumber(Position pos) const {
+    assert(IsNumber(GetTag(pos)));
+    return columns_[pos.col].numbers[pos.row];
+}
+
+bool ColumnarValueStore::IsText(Tag tag) {
+    return tag == Tag::Text || tag == Tag::NumericText;
+}
+
+FormulaError ColumnarValueStore::GetError(Position pos) const {
+    return TagError(GetTag(pos));
+}
+
+const ColumnarValueStore::Column* ColumnarValueStore::FindColumn(int col) const {
+    if (col < 0 || static_cast<size_t>(col) >= columns_.size()) {
+        return nullptr;
+    }
+    return &columns_[col];
+}
+
+size_t ColumnarValueStore::GetColumnCount() const {
+    return columns_.size();
+}
+
+void ColumnarValueStore::Restore(std::vector<Column> columns) {
+    columns_ = std::move(columns);
+    trees_.clear();
+    trees_.resize(columns_.size());
+    for (size_t col = 0; col < columns_.size(); ++col) {
+        if (!columns_[col].tags.empty()) {
+            GrowTree(static_cast<int>(col));
+        }
+    }
+}
+
+std::optional<FormulaError> ColumnarValueStore::Accumulate(Range range, Aggregate& aggregate) const {
+    const AggregateFunction function = aggregate.GetFunction();
+    for (int col = range.from.col; col <= range.to.col; ++col) {
+        const Column* column = FindColumn(col);
+        if (!column) {
+            continue;
+        }
+        const size_t begin = range.from.row;
+        const size_t end = std::min(static_cast<size_t>(range.to.row) + 1, column->tags.size());
+        if (begin >= end) {
+            continue;
+        }
+
+        Summary summary = SummarizeRows(col, begin, end);
+        if (summary.first_error != Tag::Empty && function != AggregateFunction::Count) {
+            return TagError(summary.first_error);
+        }
+        if (summary.numbers == 0) {
+            continue;
+        }
+        double value = summary.sum;
+        if (function == AggregateFunction::Min) {
+            value = summary.min;
+        }
+        else if (function == AggregateFunction::Max) {
+            value = summary.max;
+        }
+        aggregate.Merge(Aggregate(function, value, summary.numbers));
+    }
+    return std::nullopt;
+}
+
+std::vector<Position> ColumnarValueStore::FindPending(Range range) const {
+    std::vector<Position> result;
+    auto scan = [&](int col, size_t begin, size_t end) {
+        const auto& tags = columns_[col].tags;
+        for (size_t row = begin; row < end; ++row) {
+            if (tags[row] == Tag::Pending) {
+                result.push_back({ static_cast<int>(row), col });
+            }
+        }
+    };
+    for (int col = range.from.col; col <= range.to.col; ++col) {
+        const Column* column = FindColumn(col);
+        if (!column) {
+            continue;
+        }
+        const size_t begin = range.from.row;
+        const size_t end = std::min(static_cast<size_t>(range.to.row) + 1, column->tags.size());
+        if (begin >= end) {
+            continue;
+        }
+        size_t first_node = (begin + SUMMARY_ROWS - 1) / SUMMARY_ROWS;
+        size_t last_node = end / SUMMARY_ROWS;
+        if (first_node >= last_node) {
+            scan(col, begin, end);
+            continue;
+        }
+        scan(col, begin, first_node * SUMMARY_ROWS);
+        scan(col, last_node * SUMMARY_ROWS, end);
+        for (size_t level = 0; first_node < last_node; ++level, first_node /= 2, last_node /= 2) {
+            if (first_node % 2 == 1) {
+                CollectPending(col, level, first_node++, result);
+            }
+            if (last_node % 2 == 1) {
+                CollectPending(col, level, --last_node, result);
+            }
+        }
+    }
+    return result;
+}
+
+ColumnarValueStore::Column& ColumnarValueStore::GetOrCreateSlot(Position pos) {
+    if (static_cast<size_t>(pos.col) >= columns_.size()) {
+        columns_.resize(pos.col + 1);
+        trees_.resize(pos.col + 1);
+    }
+    Column& column = columns_[pos.col];
+    if (static_cast<size_t>(pos.row) < column.tags.size()) {
+        return column;
+    }
+    column.numbers.resize(pos.row + 1, 0);
+    column.tags.resize(pos.row + 1, Tag::Empty);
+    GrowTree(pos.col);
+    return column;
+}
+
+void ColumnarValueStore::GrowTree(int col) {
+    // New nodes start stale; the last old node of a level may gain a child.
+    SummaryTree& tree = trees_[col];
+    size_t size = (columns_[col].tags.size() + SUMMARY_ROWS - 1) / SUMMARY_ROWS;
+    for (size_t level = 0;; ++level, size = (size + 1) / 2) {
+        if (level == tree.size()) {
+            tree.emplace_back();
+        }
+        auto& nodes = tree[level];
+        if (nodes.size() < size) {
+            if (!nodes.empty()) {
+                nodes.back().stale.store(true, std::memory_order_relaxed);
+            }
+            nodes.resize(size);
+        }
+        if (size == 1) {
+            break;
+        }
+    }
+}
+
+void ColumnarValueStore::MarkStale(Position pos) {
+    // A stale node has stale ancestors, so the walk may stop at the first one.
+    SummaryTree& tree = trees_[pos.col];
+    size_t index = pos.row / SUMMARY_ROWS;
+    for (auto& nodes : tree) {
+        Node& node = nodes[index];
+        if (node.stale.load(std::memory_order_relaxed)) {
+            break;
+        }
+        node.stale.store(true, std::memory_order_relaxed);
+        index /= 2;
+    }
+}
+
+ColumnarValueStore::Summary ColumnarValueStore::Summarize(const Column& column, size_t begin, size_t end) {
+    const double* numbers = column.numbers.data() + begin;
+    const Tag* tags = column.tags.data() + begin;
+    const size_t count = end - begin;
+
+    Summary summary;
+    TagSummary tag_summary = ScanTags(tags, count);
+    summary.numbers = tag_summary.numbers;
+    summary.pending = tag_summary.pending;
+    if (tag_summary.has_errors) {
+        summary.first_error = *std::find_if(tags, tags + count, IsError);
+    }
+    if (summary.numbers == 0) {
+        return summary;
+    }
+    // the other slots hold zero
+    summary.sum = Reduce<false>(numbers, tags, count, 0.0, [](double lhs, double rhs) {
+        return lhs + rhs;
+    });
+    summary.min = ReduceNumbers(numbers, tags, count, summary.numbers, summary.min, [](double lhs, double rhs) {
+        return std::min(lhs, rhs);
+    });
+    summary.max = ReduceNumbers(numbers, tags, count, summary.numbers, summary.max, [](double lhs, double rhs) {
+        return std::max(lhs, rhs);
+    });
+    return summary;
+}
+
+ColumnarValueStore::Summary ColumnarValueStore::Combine(const Summary& lhs, const Summary& rhs) {
+    Summary result;
+    result.sum = lhs.sum + rhs.sum;
+    result.min = std::min(lhs.min, rhs.min);
+    result.max = std::max(lhs.max, rhs.max);
+    result.numbers = lhs.numbers + rhs.numbers;
+    result.pending = lhs.pending + rhs.pending;
+    result.first_error = lhs.first_error != Tag::Empty ? lhs.first_error : rhs.first_error;
+    return result;
+}
+
+const ColumnarValueStore::Summary& ColumnarValueStore::GetSummary(int col, size_t level, size_t index) const {
+    Node& node = trees_[col][level][index];
+    if (node.stale.load(std::memory_order_acquire)) {
+        std::lock_guard lock(refresh_mutex_);
+        Refresh(col, level, index);
+    }
+    return node.summary;
+}
+
+void ColumnarValueStore::Refresh(int col, size_t level, size_t index) const {
+    // Nodes below a queried one cover queried slots only, which are not
+    // written while the query runs.
+    Node& node = trees_[col][level][index];
+    if (!node.stale.load(std::memory_order_relaxed)) {
+        return;
+    }
+    if (level == 0) {
+        const Column& column = columns_[col];
+        const size_t begin = index * SUMMARY_ROWS;
+        node.summary = Summarize(column, begin, std::min(begin + SUMMARY_ROWS, column.tags.size()));
+    }
+    else {
+        const auto& children = trees_[col][level - 1];
+        Refresh(col, level - 1, 2 * index);
+        node.summary = children[2 * index].summary;
+        if (2 * index + 1 < children.size()) {
+            Refresh(col, level - 1, 2 * index + 1);
+            node.summary = Combine(node.summary, children[2 * index + 1].summary);
+        }
+    }
+    node.stale.store(false, std::memory_order_release);
+}
+
+ColumnarValueStore::Summary ColumnarValueStore::SummarizeRows(int col, size_t begin, size_t end) const {
+    const Column& column = columns_[col];
+    size_t first_node = (begin + SUMMARY_ROWS - 1) / SUMMARY_ROWS;
+    size_t last_node = end / SUMMARY_ROWS;
+    if (first_node >= last_node) {
+        return Summarize(column, begin, end);
+    }
+
+    // Rows before the first whole node, whole nodes from both ends towards
+    // the top of the tree, rows after the last whole node.
+    Summary head = Summarize(column, begin, first_node * SUMMARY_ROWS);
+    Summary tail = Summarize(column, last_node * SUMMARY_ROWS, end);
+    for (size_t level = 0; first_node < last_node; ++level, first_node /= 2, last_node /= 2) {
+        if (first_node % 2 == 1) {
+            head = Combine(head, GetSummary(col, level, first_node++));
+        }
+        if (last_node % 2 == 1) {
+            tail = Combine(GetSummary(col, level, --last_node), tail);
+        }
+    }
+    return Combine(head, tail);
+}
+
+void ColumnarValueStore::CollectPending(int col, size_t level, size_t index, std::vector<Position>& result) const {
+    if (GetSummary(col, level, index).pending == 0) {
+        return;
+    }
+    if (level > 0) {
+        CollectPending(col, level - 1, 2 * index, result);
+        if (2 * index + 1 < trees_[col][level - 1].size()) {
+            CollectPending(col, level - 1, 2 * index + 1, result);
+        }
+        return;
+    }
+    const auto& tags = columns_[col].tags;
+    const size_t begin = index * SUMMARY_ROWS;
+    for (size_t row = begin; row < std::min(begin + SUMMARY_ROWS, tags.size()); ++row) {
+        if (tags[row] == Tag::Pending) {
+            result.push_back({ static_cast<int>(row), col });
+        }
+    }
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include "aggregate.h"
+#include "common.h"
+
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// Computed cell values laid out by column: a contiguous array of numbers and
+// a parallel array of one-byte tags per column, indexed by row. Only the kind
+// of a text value is recorded, along with its number when the text reads as
+// one; its characters stay with the cell that produced them. The number of
+// any other slot is zero. Numeric scans of a column read two dense arrays.
+//
+// Each column also keeps a tree of summaries over runs of SUMMARY_ROWS rows,
+// every level summarising pairs of nodes of the level below. Writes only mark
+// the nodes above a slot as stale; a range query refreshes the stale nodes it
+// needs, so after an edit it costs O(log n) per column instead of O(n).
+class ColumnarValueStore {
+public:
+    static const int SUMMARY_ROWS = 64;
+
+    enum class Tag : uint8_t {
+        Empty,
+        Number,
+        // text that formulas read as a number, e.g. "12"
+        NumericText,
+        Text,
+        // a value that has not been computed yet
+        Pending,
+        RefError,
+        ValueError,
+        Div0Error,
+    };
+
+    struct Column {
+        std::vector<double> numbers;
+        std::vector<Tag> tags;
+    };
+
+    // Records a value; the number of a text value is not stored. Writing a
+    // position that already holds a value never reallocates, so distinct
+    // positions may be overwritten concurrently.
+    void Set(Position pos, const CellInterface::Value& value);
+    void SetPending(Position pos);
+    void Erase(Position pos);
+
+    Tag GetTag(Position pos) const;
+    static bool IsText(Tag tag);
+    double GetNumber(Position pos) const;
+    FormulaError GetError(Position pos) const;
+
+    // Returns nullptr for a column that has never held a value.
+    const Column* FindColumn(int col) const;
+    size_t GetColumnCount() const;
+    // Replaces every value at once, e.g. with the columns of a snapshot.
+    void Restore(std::vector<Column> columns);
+
+    // Folds the numbers stored inside range into aggregate, numeric texts
+    // included; other texts and empty slots are skipped. Returns the first
+    // error met instead, unless the function is COUNT, which skips errors too.
+    // Several threads may query at once while other slots are written.
+    std::optional<FormulaError> Accumulate(Range range, Aggregate& aggregate) const;
+    // Positions of the pending values inside range.
+    std::vector<Position> FindPending(Range range) const;
+
+private:
+    struct Summary {
+        double sum = 0;
+        double min = std::numeric_limits<double>::infinity();
+        double max = -std::numeric_limits<double>::infinity();
+        uint32_t numbers = 0;
+        uint32_t pending = 0;
+        // the error of the lowest row
+        Tag first_error = Tag::Empty;
+    };
+
+    struct Node {
+        Summary summary;
+        std::atomic<bool> stale{ true };
+
+        Node() = default;
+        Node(const Node& other);
+    };
+
+    // Level 0 has a node per SUMMARY_ROWS rows of the column, every next
+    // level a node per two nodes of the previous one, up to a single root.
+    using SummaryTree = std::vector<std::vector<Node>>;
+
+    std::vector<Column> columns_;
+    mutable std::vector<SummaryTree> trees_;
+    mutable std::mutex refresh_mutex_;
+
+    Column& GetOrCreateSlot(Position pos);
+    // Adds the stale nodes a column grown to its current length needs.
+    void GrowTree(int col);
+    void MarkStale(Position pos);
+
+    static Summary Summarize(const Column& column, size_t begin, size_t end);
+    static Summary Combine(const Summary& lhs, const Summary& rhs);
+    const Summary& GetSummary(int col, size_t level, size_t index) const;
+    void Refresh(int col, size_t level, size_t index) const;
+    // Summarises rows [begin, end) of a column, which must hold them all.
+    Summary SummarizeRows(int col, size_t begin, size_t end) const;
+    void CollectPending(int col, size_t level, size_t index, std::vector<Position>& result) const;
+};